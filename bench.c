@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Banco de pruebas del empaquetador: genera conjuntos de datos reproducibles,
+// ejecuta cada operacion varias veces como proceso aparte y escribe una linea
+// JSON por operacion con el tiempo real (p50/p99), MB/s, archivos/s y el
+// pico de memoria del proceso.
+
+#define OPT_TINY_FILES 256
+#define OPT_LARGE_FILES 257
+#define OPT_LARGE_SIZE 258
+#define OPT_STREAM_SIZE 259
+#define OPT_CHURN_FILES 260
+#define OPT_CHURN_ROUNDS 261
+#define OPT_ONLY 262
+#define WRITE_CHUNK (1 << 20)
+
+typedef struct {
+    const char* binary;
+    const char* workdir;
+    int runs;
+    size_t tinyFiles;
+    size_t largeFiles;
+    size_t largeSize;
+    size_t streamSize;
+    size_t churnFiles;
+    int churnRounds;
+    const char* only;
+    char** extraArgs; // Se agregan a cada ejecucion (por ejemplo --io-uring -j 4)
+    int numExtraArgs;
+} BenchConfig;
+
+// Archivos de un conjunto de datos, con nombres relativos a su directorio.
+typedef struct {
+    char dir[PATH_MAX];
+    char** names;
+    size_t numFiles;
+    size_t totalBytes;
+} Dataset;
+
+// Resultado de varias ejecuciones de una operacion.
+typedef struct {
+    double* seconds;
+    int count;
+    long maxRssKb;
+    bool failed;
+} Samples;
+
+void* checkedRealloc(void* pointer, size_t size) {
+    void* result = realloc(pointer, size);
+    if (result == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+// xorshift64*: el mismo seed genera siempre los mismos datos
+uint64_t nextRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool parseByteCount(const char* text, size_t* value) {
+    char* end;
+    errno = 0;
+    unsigned long long count = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') return false;
+    switch (*end) {
+        case 'G': case 'g': count <<= 10; // fall through
+        case 'M': case 'm': count <<= 10; // fall through
+        case 'K': case 'k': count <<= 10; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return false;
+    *value = (size_t)count;
+    return true;
+}
+
+// Escribe `size` bytes pseudoaleatorios. La mitad de cada bloque de 4 KB
+// repite el anterior para que la compresion tenga algo que hacer.
+bool writeSyntheticFile(const char* path, size_t size, uint64_t seed) {
+    struct stat st;
+    if (stat(path, &st) == 0 && (size_t)st.st_size == size) return true; // Ya generado
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    unsigned char* buffer = checkedRealloc(NULL, WRITE_CHUNK);
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    size_t written = 0;
+    bool ok = true;
+    while (written < size && ok) {
+        size_t chunk = size - written < WRITE_CHUNK ? size - written : WRITE_CHUNK;
+        for (size_t i = 0; i < chunk; i += sizeof(uint64_t)) {
+            uint64_t value = nextRandom(&state);
+            size_t n = chunk - i < sizeof(uint64_t) ? chunk - i : sizeof(uint64_t);
+            if (i % 4096 >= 2048 && i >= 4096) {
+                memcpy(buffer + i, buffer + i - 4096, n);
+            } else {
+                memcpy(buffer + i, &value, n);
+            }
+        }
+        ok = write(fd, buffer, chunk) == (ssize_t)chunk;
+        written += chunk;
+    }
+    free(buffer);
+    close(fd);
+    if (!ok) fprintf(stderr, "Error writing %s\n", path);
+    return ok;
+}
+
+void addDatasetFile(Dataset* set, const char* name, size_t size) {
+    set->names = checkedRealloc(set->names, (set->numFiles + 1) * sizeof(char*));
+    set->names[set->numFiles++] = strdup(name);
+    set->totalBytes += size;
+}
+
+void freeDataset(Dataset* set) {
+    for (size_t i = 0; i < set->numFiles; i++) free(set->names[i]);
+    free(set->names);
+    memset(set, 0, sizeof(Dataset));
+}
+
+bool makeDataset(Dataset* set, const BenchConfig* config, const char* name, size_t numFiles,
+                 size_t minSize, size_t maxSize, uint64_t seed) {
+    memset(set, 0, sizeof(Dataset));
+    snprintf(set->dir, sizeof(set->dir), "%s/%s", config->workdir, name);
+    mkdir(set->dir, 0755);
+    uint64_t state = seed;
+    for (size_t i = 0; i < numFiles; i++) {
+        char fileName[32];
+        char path[PATH_MAX + 32];
+        size_t size = minSize + (maxSize > minSize ? nextRandom(&state) % (maxSize - minSize + 1) : 0);
+        snprintf(fileName, sizeof(fileName), "f%06zu", i);
+        snprintf(path, sizeof(path), "%s/%s", set->dir, fileName);
+        if (!writeSyntheticFile(path, size, seed + i)) return false;
+        addDatasetFile(set, fileName, size);
+    }
+    return true;
+}
+
+int removeEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+void removeTree(const char* path) {
+    nftw(path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+bool copyFile(const char* from, const char* to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = in >= 0 && out >= 0;
+    while (ok) {
+        ssize_t done = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+        if (done == 0) break;
+        ok = done > 0;
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (!ok) fprintf(stderr, "Error copying %s to %s\n", from, to);
+    return ok;
+}
+
+// Ejecuta el empaquetador en `cwd` con la salida descartada. Devuelve el
+// tiempo real y el pico de memoria del proceso, o false si fallo.
+bool runTool(const BenchConfig* config, const char* cwd, char** args, int numArgs, const char* stdinPath,
+             double* seconds, long* maxRssKb) {
+    char** argv = checkedRealloc(NULL, (numArgs + config->numExtraArgs + 2) * sizeof(char*));
+    int argc = 0;
+    argv[argc++] = (char*)config->binary;
+    for (int i = 0; i < numArgs; i++) argv[argc++] = args[i];
+    for (int i = 0; i < config->numExtraArgs; i++) argv[argc++] = config->extraArgs[i];
+    argv[argc] = NULL;
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_RDWR);
+        int input = stdinPath != NULL ? open(stdinPath, O_RDONLY) : devNull;
+        if (chdir(cwd) != 0 || input < 0) _exit(127);
+        dup2(input, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    free(argv);
+    if (pid < 0) return false;
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return false;
+    *seconds = now() - start;
+    *maxRssKb = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void addSample(Samples* samples, double seconds, long maxRssKb, bool ok) {
+    samples->seconds = checkedRealloc(samples->seconds, (samples->count + 1) * sizeof(double));
+    samples->seconds[samples->count++] = seconds;
+    if (maxRssKb > samples->maxRssKb) samples->maxRssKb = maxRssKb;
+    if (!ok) samples->failed = true;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Percentil por rango mas cercano sobre muestras ordenadas
+double percentile(const Samples* samples, double fraction) {
+    size_t rank = (size_t)(fraction * samples->count + 0.999999);
+    if (rank < 1) rank = 1;
+    return samples->seconds[rank - 1];
+}
+
+void report(const BenchConfig* config, const char* workload, const char* operation, Samples* samples,
+            size_t files, size_t bytes) {
+    if (samples->count == 0) return;
+    qsort(samples->seconds, samples->count, sizeof(double), compareDoubles);
+    double p50 = percentile(samples, 0.50);
+    double p99 = percentile(samples, 0.99);
+    printf("{\"workload\":\"%s\",\"operation\":\"%s\",\"runs\":%d,\"files\":%zu,\"bytes\":%zu,"
+           "\"p50_seconds\":%.6f,\"p99_seconds\":%.6f,\"mb_per_second\":%.2f,\"files_per_second\":%.2f,"
+           "\"peak_rss_kb\":%ld,\"ok\":%s,\"args\":\"",
+           workload, operation, samples->count, files, bytes, p50, p99,
+           p50 > 0 ? bytes / p50 / 1e6 : 0.0, p50 > 0 ? files / p50 : 0.0,
+           samples->maxRssKb, samples->failed ? "false" : "true");
+    for (int i = 0; i < config->numExtraArgs; i++) {
+        printf(i ? " %s" : "%s", config->extraArgs[i]);
+    }
+    printf("\"}\n");
+    fflush(stdout);
+    free(samples->seconds);
+    memset(samples, 0, sizeof(Samples));
+}
+
+// Arma los argumentos "<opciones> <empaquetado> [archivos...]"
+char** buildArgs(const char* options, const char* archive, char** files, size_t numFiles, int* numArgs) {
+    char** args = checkedRealloc(NULL, (numFiles + 3) * sizeof(char*));
+    int n = 0;
+    args[n++] = (char*)options;
+    if (strcmp(options, "-p") == 0) args[n++] = "x"; // -p lleva un argumento
+    args[n++] = (char*)archive;
+    for (size_t i = 0; i < numFiles; i++) args[n++] = files[i];
+    *numArgs = n;
+    return args;
+}
+
+bool runOnce(const BenchConfig* config, const char* cwd, const char* options, const char* archive, char** files,
+             size_t numFiles, const char* stdinPath, Samples* samples) {
+    int numArgs;
+    char** args = buildArgs(options, archive, files, numFiles, &numArgs);
+    double seconds = 0;
+    long rss = 0;
+    bool ok = runTool(config, cwd, args, numArgs, stdinPath, &seconds, &rss);
+    free(args);
+    if (samples != NULL) addSample(samples, seconds, rss, ok);
+    return ok;
+}
+
+// Mide cada operacion sobre un empaquetado base. Las que lo modifican trabajan
+// sobre una copia nueva en cada ejecucion; la copia no entra en la medicion.
+void benchArchiveOperations(const BenchConfig* config, const char* workload, Dataset* set, const char* base,
+                            const char* stdinPath, bool measureCreate) {
+    char archive[PATH_MAX + 32];
+    char outDir[PATH_MAX + 32];
+    snprintf(archive, sizeof(archive), "%s/%s-work.pk", config->workdir, workload);
+    snprintf(outDir, sizeof(outDir), "%s/%s-out", config->workdir, workload);
+    Samples samples = {0};
+
+    if (measureCreate) {
+        for (int r = 0; r < config->runs; r++) {
+            unlink(base);
+            if (stdinPath != NULL) {
+                runOnce(config, set->dir, "-c", base, NULL, 0, stdinPath, &samples);
+            } else {
+                runOnce(config, set->dir, "-cf", base, set->names, set->numFiles, NULL, &samples);
+            }
+        }
+        report(config, workload, "create", &samples, set->numFiles, set->totalBytes);
+    }
+
+    for (int r = 0; r < config->runs; r++) {
+        runOnce(config, set->dir, "-t", base, NULL, 0, NULL, &samples);
+    }
+    report(config, workload, "list", &samples, set->numFiles, 0);
+
+    for (int r = 0; r < config->runs; r++) {
+        removeTree(outDir);
+        mkdir(outDir, 0755);
+        runOnce(config, outDir, "-x", base, NULL, 0, NULL, &samples);
+    }
+    report(config, workload, "extract", &samples, set->numFiles, set->totalBytes);
+    removeTree(outDir);
+    if (stdinPath != NULL) return; // El miembro "stdin" no tiene archivo que actualizar
+
+    // Un 1% de los miembros (al menos uno) para actualizar y borrar
+    size_t subset = set->numFiles / 100 ? set->numFiles / 100 : 1;
+    size_t subsetBytes = 0;
+    char** names = checkedRealloc(NULL, subset * sizeof(char*));
+    for (size_t i = 0; i < subset; i++) {
+        names[i] = set->names[i * (set->numFiles / subset)];
+    }
+    for (size_t i = 0; i < subset; i++) {
+        char path[PATH_MAX * 2];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", set->dir, names[i]);
+        if (stat(path, &st) == 0) subsetBytes += st.st_size;
+    }
+
+    for (int r = 0; r < config->runs; r++) {
+        if (!copyFile(base, archive)) break;
+        runOnce(config, set->dir, "-u", archive, names, subset, NULL, &samples);
+    }
+    report(config, workload, "update", &samples, subset, subsetBytes);
+
+    for (int r = 0; r < config->runs; r++) {
+        if (!copyFile(base, archive)) break;
+        runOnce(config, set->dir, "-d", archive, names, subset, NULL, &samples);
+    }
+    report(config, workload, "delete", &samples, subset, 0);
+
+    // Desfragmentar despues de borrar: todo lo que sigue al primer hueco se mueve
+    for (int r = 0; r < config->runs; r++) {
+        if (!copyFile(base, archive) || !runOnce(config, set->dir, "-d", archive, names, subset, NULL, NULL)) break;
+        runOnce(config, set->dir, "-p", archive, NULL, 0, NULL, &samples);
+    }
+    report(config, workload, "defrag", &samples, set->numFiles - subset, set->totalBytes - subsetBytes);
+
+    unlink(archive);
+    free(names);
+}
+
+bool selected(const BenchConfig* config, const char* workload) {
+    if (config->only == NULL) return true;
+    size_t length = strlen(workload);
+    for (const char* p = config->only; (p = strstr(p, workload)) != NULL; p += length) {
+        if ((p == config->only || p[-1] == ',') && (p[length] == '\0' || p[length] == ',')) return true;
+    }
+    return false;
+}
+
+void benchTiny(const BenchConfig* config) {
+    Dataset set;
+    char base[PATH_MAX + 32];
+    if (!makeDataset(&set, config, "tiny", config->tinyFiles, 0, 4096, 1)) return;
+    snprintf(base, sizeof(base), "%s/tiny.pk", config->workdir);
+    benchArchiveOperations(config, "tiny", &set, base, NULL, true);
+    unlink(base);
+    freeDataset(&set);
+}
+
+void benchLarge(const BenchConfig* config) {
+    Dataset set;
+    char base[PATH_MAX + 32];
+    if (!makeDataset(&set, config, "large", config->largeFiles, config->largeSize, config->largeSize, 2)) return;
+    snprintf(base, sizeof(base), "%s/large.pk", config->workdir);
+    benchArchiveOperations(config, "large", &set, base, NULL, true);
+    unlink(base);
+    freeDataset(&set);
+}
+
+void benchStream(const BenchConfig* config) {
+    Dataset set;
+    char base[PATH_MAX + 32];
+    char input[PATH_MAX + 32];
+    memset(&set, 0, sizeof(Dataset));
+    snprintf(set.dir, sizeof(set.dir), "%s/stream", config->workdir);
+    mkdir(set.dir, 0755);
+    snprintf(input, sizeof(input), "%s/input", set.dir);
+    if (!writeSyntheticFile(input, config->streamSize, 3)) return;
+    addDatasetFile(&set, "stdin", config->streamSize);
+    snprintf(base, sizeof(base), "%s/stream.pk", config->workdir);
+    benchArchiveOperations(config, "stream", &set, base, input, true);
+    unlink(base);
+    freeDataset(&set);
+}
+
+// Empaquetado fragmentado: se borran y se vuelven a agregar miembros al azar,
+// que caen en los huecos que dejaron otros.
+void benchChurn(const BenchConfig* config) {
+    Dataset set;
+    char base[PATH_MAX + 32];
+    if (!makeDataset(&set, config, "churn", config->churnFiles, 64 * 1024, 4 << 20, 4)) return;
+    snprintf(base, sizeof(base), "%s/churn.pk", config->workdir);
+    unlink(base);
+    if (!runOnce(config, set.dir, "-cf", base, set.names, set.numFiles, NULL, NULL)) {
+        fprintf(stderr, "Error creating the churn archive\n");
+        freeDataset(&set);
+        return;
+    }
+
+    uint64_t state = 5;
+    size_t batch = set.numFiles / 10 ? set.numFiles / 10 : 1;
+    char** names = checkedRealloc(NULL, batch * sizeof(char*));
+    for (int round = 0; round < config->churnRounds; round++) {
+        for (size_t i = 0; i < batch; i++) {
+            names[i] = set.names[nextRandom(&state) % set.numFiles];
+            for (size_t j = 0; j < i; j++) {
+                if (names[j] == names[i]) { i--; break; }
+            }
+        }
+        runOnce(config, set.dir, "-d", base, names, batch, NULL, NULL);
+        runOnce(config, set.dir, "-rf", base, names, batch, NULL, NULL);
+    }
+    free(names);
+
+    benchArchiveOperations(config, "churn", &set, base, NULL, false);
+    unlink(base);
+    freeDataset(&set);
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config = { "./proyecto", "bench-work", 5, 5000, 2, (size_t)1 << 30, (size_t)256 << 20, 200, 10, NULL, NULL, 0 };
+
+    static struct option longOptions[] = {
+        {"binary", required_argument, NULL, 'b'},
+        {"workdir", required_argument, NULL, 'w'},
+        {"runs", required_argument, NULL, 'r'},
+        {"tiny-files", required_argument, NULL, OPT_TINY_FILES},
+        {"large-files", required_argument, NULL, OPT_LARGE_FILES},
+        {"large-size", required_argument, NULL, OPT_LARGE_SIZE},
+        {"stream-size", required_argument, NULL, OPT_STREAM_SIZE},
+        {"churn-files", required_argument, NULL, OPT_CHURN_FILES},
+        {"churn-rounds", required_argument, NULL, OPT_CHURN_ROUNDS},
+        {"only", required_argument, NULL, OPT_ONLY},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    bool ok = true;
+    while ((opt = getopt_long(argc, argv, "b:w:r:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'b': config.binary = optarg; break;
+            case 'w': config.workdir = optarg; break;
+            case 'r': config.runs = atoi(optarg); ok = config.runs > 0; break;
+            case OPT_TINY_FILES: config.tinyFiles = strtoul(optarg, NULL, 10); break;
+            case OPT_LARGE_FILES: config.largeFiles = strtoul(optarg, NULL, 10); break;
+            case OPT_LARGE_SIZE: ok = parseByteCount(optarg, &config.largeSize); break;
+            case OPT_STREAM_SIZE: ok = parseByteCount(optarg, &config.streamSize); break;
+            case OPT_CHURN_FILES: config.churnFiles = strtoul(optarg, NULL, 10); break;
+            case OPT_CHURN_ROUNDS: config.churnRounds = atoi(optarg); break;
+            case OPT_ONLY: config.only = optarg; break;
+            default: ok = false; break;
+        }
+        if (!ok) break;
+    }
+    if (!ok) {
+        fprintf(stderr, "Usage: %s [-b binary] [-w workdir] [-r runs] [--tiny-files n] [--large-files n] "
+                        "[--large-size bytes] [--stream-size bytes] [--churn-files n] [--churn-rounds n] "
+                        "[--only tiny,large,stream,churn] [-- packer options]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    config.extraArgs = &argv[optind];
+    config.numExtraArgs = argc - optind;
+
+    // El binario se ejecuta desde los directorios de datos: ruta absoluta
+    char binary[PATH_MAX];
+    char workdir[PATH_MAX];
+    mkdir(config.workdir, 0755);
+    if (realpath(config.binary, binary) == NULL || access(binary, X_OK) != 0) {
+        fprintf(stderr, "Cannot run %s\n", config.binary);
+        return EXIT_FAILURE;
+    }
+    if (realpath(config.workdir, workdir) == NULL) {
+        fprintf(stderr, "Cannot use the directory %s\n", config.workdir);
+        return EXIT_FAILURE;
+    }
+    config.binary = binary;
+    config.workdir = workdir;
+
+    if (selected(&config, "tiny")) benchTiny(&config);
+    if (selected(&config, "large")) benchLarge(&config);
+    if (selected(&config, "stream")) benchStream(&config);
+    if (selected(&config, "churn")) benchChurn(&config);
+    return EXIT_SUCCESS;
+}
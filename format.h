@@ -0,0 +1,292 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Formato en disco del empaquetado, compartido por main.c (que lo escribe) y
+// pack.c (que solo lo lee): constantes, registros, candados, CRC32C, el hash
+// y las reglas de los nombres y el descompresor de bloques. Todo es static para que cada
+// programa que enlace libpack.a conserve sus propios simbolos.
+
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (4 << 20)
+#define ARCHIVE_MAGIC "PKAR"
+#define ARCHIVE_VERSION 9
+#define ARCHIVE_COMPRESSED 0x1 // Los miembros nuevos se guardan comprimidos
+#define ARCHIVE_DEDUP 0x2 // Los bloques repetidos se guardan una sola vez
+#define HEADER_SIZE 4096 // Los bloques de datos empiezan despues de la cabecera
+#define METADATA_PAGE_SIZE 4096 // Los metadatos se escriben por paginas
+#define JOURNAL_MAGIC "PKJL"
+#define MEMBER_DELETED 0x1 // Lapida: el registro queda en su lugar para no mover los indices
+#define MEMBER_COMPRESSED 0x2 // Bloques comprimidos uno por uno y guardados seguidos
+#define MEMBER_DIRECTORY 0x4 // Directorio: solo el nombre, sin datos
+#define LZ_MIN_MATCH 4
+
+// Candados fcntl de descriptor abierto (OFD): dos bytes de la cabecera y, lejos
+// de los datos, un byte por confirmacion para anotar a los lectores de su foto.
+#define LOCK_WRITER 0   // Exclusivo mientras un proceso modifica el empaquetado
+#define LOCK_METADATA 1 // La cabecera y la region se cargan o se confirman enteras
+#define LOCK_SNAPSHOTS ((off_t)1 << 62) // + epoch: lectores que usan esa foto
+
+// Un extent es una serie de bloques contiguos: [start, start + length). Con
+// start == HOLE_EXTENT son length bloques de ceros que no ocupan espacio.
+#define HOLE_EXTENT UINT64_MAX
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+} Extent;
+
+// Cabecera en disco (offset 0). Los metadatos de longitud variable van en una
+// region de paginas detras de los bloques de datos, en metadataOffset, con un
+// hueco disperso entre medio para que los datos crezcan sin moverla. Cada
+// seccion empieza en una pagina y tiene margen para crecer en su lugar; el
+// diario va justo despues de la region.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t flags;
+    uint64_t dataOffset;
+    uint64_t numBlocks;
+    uint64_t numFiles;
+    uint64_t numFreeExtents;
+    uint64_t metadataOffset;
+    uint64_t metadataSize;     // Bytes usados de la region
+    uint64_t indexCapacity;
+    uint64_t metadataCapacity; // Tamano de la region, en paginas enteras
+    uint64_t freeOffset;       // Inicio de cada seccion dentro de la region;
+    uint64_t indexOffset;      // los miembros empiezan en 0
+    uint64_t checksumOffset;
+    uint64_t hashOffset;
+    uint64_t pendingOffset;
+    uint64_t numPendingExtents;
+    uint64_t epoch;            // Crece con cada confirmacion
+} ArchiveHeader;
+
+// Bloques que dejaron de usarse pero que la foto de la confirmacion epoch (y
+// las anteriores) todavia ve; se liberan cuando ya no hay lectores de esas fotos.
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+    uint64_t epoch;
+} PendingExtent;
+
+// Registro del diario: la cabecera nueva y las paginas de la region que
+// cambian (numPages numeros de pagina uint32_t y despues las paginas).
+typedef struct {
+    char magic[4];
+    uint32_t numPages;
+    uint32_t checksum; // CRC32C de todo el registro con este campo en 0
+    uint32_t reserved;
+    ArchiveHeader header;
+} JournalRecord;
+
+// Registro de un miembro en disco, seguido del nombre (sin '\0') y de sus extents;
+// si esta comprimido siguen las longitudes de sus bloques (uint32_t cada una).
+// Con tailLength > 0 los ultimos bytes estan en tailBlock desde tailOffset.
+// Las demas secciones son los extents libres, la tabla hash de nombres, el
+// CRC32C de cada bloque (uint32_t), salvo si esta comprimido sin
+// ARCHIVE_DEDUP las huellas de todos los bloques (uint64_t, 0 = libre) y los
+// bloques pendientes de liberar (PendingExtent).
+typedef struct {
+    uint64_t fileSize;
+    uint32_t nameLength;
+    uint32_t numExtents;
+    uint32_t flags;
+    uint32_t tailLength;
+    uint64_t tailBlock;
+    uint32_t tailOffset;
+    uint32_t reserved;
+} MemberRecord;
+
+#define CRC32C_POLY 0x82F63B78u // Castagnoli, reflejado
+#define CRC32C_STRIPE 8192      // Bytes de cada uno de los tres flujos intercalados
+
+static uint32_t crc32cTable[8][256];
+static uint32_t crc32cStripeShift; // x^(8 * CRC32C_STRIPE) mod P, para unir los flujos
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char* data, size_t length);
+
+// Producto de dos polinomios modulo P (representacion reflejada, como zlib).
+static uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    while (m != 0) {
+        if (a & m) product ^= b;
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// CRC de A seguido de B a partir de los CRC de cada parte; shift es x^(8 * |B|) mod P.
+static uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint32_t shift) {
+    return crc32cMultiply(shift, crcA) ^ crcB;
+}
+
+// Version portable: ocho tablas, ocho bytes por iteracion.
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t length) {
+    crc = ~crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff] ^
+              crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff] ^
+              crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff] ^
+              crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Con SSE4.2 la instruccion crc32 tiene latencia 3 pero acepta una por ciclo:
+// se calculan tres flujos intercalados y luego se unen multiplicando por x^n.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length >= 3 * CRC32C_STRIPE) {
+        uint64_t a = ~crc & 0xffffffffu;
+        uint64_t b = 0xffffffffu;
+        uint64_t c = 0xffffffffu;
+        for (size_t i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t wordA, wordB, wordC;
+            memcpy(&wordA, data + i, 8);
+            memcpy(&wordB, data + CRC32C_STRIPE + i, 8);
+            memcpy(&wordC, data + 2 * CRC32C_STRIPE + i, 8);
+            a = _mm_crc32_u64(a, wordA);
+            b = _mm_crc32_u64(b, wordB);
+            c = _mm_crc32_u64(c, wordC);
+        }
+        crc = crc32cCombine(~(uint32_t)a, ~(uint32_t)b, crc32cStripeShift);
+        crc = crc32cCombine(crc, ~(uint32_t)c, crc32cStripeShift);
+        data += 3 * CRC32C_STRIPE;
+        length -= 3 * CRC32C_STRIPE;
+    }
+
+    uint64_t value = ~crc & 0xffffffffu;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    uint32_t tail = (uint32_t)value;
+    for (; length > 0; data++, length--) {
+        tail = _mm_crc32_u8(tail, *data);
+    }
+    return ~tail;
+}
+#endif
+
+// Prepara las tablas y elige la version con instrucciones de hardware si el
+// procesador las tiene.
+static void crc32cInit(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32cTable[t][i] = crc32cTable[0][crc32cTable[t - 1][i] & 0xff] ^ (crc32cTable[t - 1][i] >> 8);
+        }
+    }
+
+    // x^(8 * CRC32C_STRIPE): se eleva x^8 al cuadrado log2(CRC32C_STRIPE) veces
+    uint32_t shift = 1u << 23;
+    for (size_t n = 1; n < CRC32C_STRIPE; n *= 2) {
+        shift = crc32cMultiply(shift, shift);
+    }
+    crc32cStripeShift = shift;
+
+    crc32cUpdate = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32cUpdate = crc32cHardware;
+    }
+#endif
+}
+
+static uint32_t crc32c(const unsigned char* data, size_t length) {
+    return crc32cUpdate(0, data, length);
+}
+
+static uint64_t hashName(const char* name) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (const unsigned char* p = (const unsigned char*)name; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Los miembros se extraen relativos al directorio actual: un nombre vacio,
+// absoluto o con algun componente ".." podria escribir fuera de el.
+static bool safeMemberName(const char* name) {
+    if (name[0] == '\0' || name[0] == '/') return false;
+    const char* p = name;
+    while (*p != '\0') {
+        size_t length = strcspn(p, "/");
+        if (length == 2 && p[0] == '.' && p[1] == '.') return false;
+        p += length;
+        while (*p == '/') p++;
+    }
+    return true;
+}
+
+static bool lzReadLength(const unsigned char* src, size_t size, size_t* ip, size_t* length) {
+    unsigned char byte;
+    do {
+        if (*ip >= size) return false;
+        byte = src[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Descomprime un bloque; falla si los datos no producen exactamente expected bytes.
+static bool lzDecompress(const unsigned char* src, size_t size, unsigned char* dst, size_t expected) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < size) {
+        unsigned token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !lzReadLength(src, size, &ip, &literals)) return false;
+        if (literals > size - ip || literals > expected - op) return false;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == size) break;
+
+        if (size - ip < 2) return false;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lzReadLength(src, size, &ip, &length)) return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > expected - op) return false;
+        if (offset >= length) {
+            memcpy(dst + op, dst + op - offset, length);
+        } else {
+            for (size_t k = 0; k < length; k++) {
+                dst[op + k] = dst[op - offset + k];
+            }
+        }
+        op += length;
+    }
+    return op == expected;
+}
+
+#endif
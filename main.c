@@ -1,23 +1,73 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "format.h"
 
-#define BLOCK_SIZE 262144 // 256 KB
-#define MAX_FILES 100
-#define MAX_FILENAME_LENGTH 256
-#define MAX_BLOCKS_PER_FILE 64
-#define MAX_BLOCKS MAX_BLOCKS_PER_FILE * MAX_FILES
+#define DEFAULT_BLOCK_SIZE 262144 // 256 KB
+#define METADATA_GAP_MIN_BYTES (1 << 20) // Hueco minimo entre los datos y los metadatos
+#define PENDING_THIS_OPERATION UINT64_MAX // Liberados ahora: los ve la foto que se confirmo ultima
+#define STREAM_MAGIC "PKST" // Empaquetado en flujo (-f -): miembros seguidos e indice al final
+#define STREAM_VERSION 1
+#define STREAM_MEMBER_MAGIC "PKMB"
+#define STREAM_INDEX_MAGIC "PKIX"
+#define STREAM_FOOTER_MAGIC "PKFT"
+#define GROWTH_CHUNK_BYTES (16 << 20) // Crecimiento minimo del archivo
+#define STREAM_BATCH_BLOCKS 64 // Bloques reservados por lote cuando no se conoce el tamano
+#define INPUT_RING_BYTES (8 << 20) // Lectura adelantada de stdin y tuberias (al menos dos bloques)
+#define TAIL_PACK_LIMIT (blockSize / 2) // Colas de hasta medio bloque van como fragmento en un bloque compartido
+#define EXTRACT_TASK_BLOCKS 32 // Los miembros grandes se reparten entre hilos en tramos de 32 bloques
+#define COPY_BUFFER_BYTES (1 << 20) // Buffer de cada hilo cuando no hay copia en el kernel (al menos un bloque)
+#define URING_QUEUE_DEPTH 32   // Lecturas/escrituras en vuelo por hilo con io_uring
+#define DEFRAG_BATCH_MOVES 64  // Movimientos de bloques enviados juntos al desfragmentar
+#define DEFRAG_RUN_BLOCKS 16   // Bloques contiguos como maximo por movimiento
+#define DEFRAG_ROUND_BYTES (256u << 20) // Bytes movidos entre dos confirmaciones al desfragmentar
+#define PIPELINE_BATCH_BLOCKS 4 // Bloques por hilo en cada lote de compresion o deduplicacion
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+#define OPT_IO_URING 256
+#define OPT_DEDUP 257
+#define OPT_VERIFY 258
+#define OPT_TIME_BUDGET 259
+#define OPT_BYTE_BUDGET 260
+#define OPT_STATS 261
+#define OPT_BLOCK_SIZE 262
+#define OPT_DIRECT 263
+#define DIRECT_ALIGNMENT 4096 // Offsets, longitudes y buffers de O_DIRECT
 
 typedef struct {
-    char fileName[MAX_FILENAME_LENGTH];
+    char* fileName;
     size_t fileSize;
-    size_t blockPositions[MAX_BLOCKS_PER_FILE];
-    size_t numBlocks;
+    Extent* extents;
+    size_t numExtents;
+    size_t extentCapacity;
+    uint32_t flags;
+    uint32_t* blockLengths; // Miembros comprimidos: bytes guardados de cada bloque
+    // Los ultimos tailLength bytes (0: ninguno) van en un fragmento de un
+    // bloque compartido con otros miembros; los extents guardan el resto
+    size_t tailBlock;
+    uint32_t tailOffset;
+    uint32_t tailLength;
 } FileMetadata;
 
 struct Data {
@@ -34,190 +84,4455 @@ struct Data {
     char *outputFile;
     char **inputFiles;
     int numInputFiles;
+    int jobs;
+    bool ioUring;
+    bool compress;
+    bool dedup;
+    bool verify;
+    double timeBudget; // Segundos como maximo para desfragmentar (0: sin limite)
+    size_t byteBudget; // Bytes a mover como maximo al desfragmentar (0: sin limite)
+    size_t blockSize;  // Tamano de bloque al crear (0: por defecto, SIZE_MAX: automatico)
 };
 
+// Nodo del indice de espacio libre: un treap ordenado por start donde cada
+// nodo guarda el extent libre mas largo de su subarbol, para encontrar en
+// O(log n) el primer hueco de N bloques contiguos.
+typedef struct FreeExtentNode {
+    uint64_t start;
+    uint64_t length;
+    uint64_t maxLength;
+    uint32_t priority;
+    struct FreeExtentNode* left;
+    struct FreeExtentNode* right;
+} FreeExtentNode;
+
 typedef struct {
-    FileMetadata files[MAX_FILES];
+    FileMetadata* files;
     size_t numFiles;
-    size_t freeBlocks[MAX_BLOCKS];
+    size_t fileCapacity;
+    size_t numDeleted;
+    uint32_t* nameIndex;    // Tabla hash abierta: indice del miembro + 1, 0 = vacio
+    size_t indexCapacity;   // Potencia de 2, con ocupacion maxima del 50%
+    FreeExtentNode* freeRoot;
+    size_t numFreeExtents;
     size_t numFreeBlocks;
+    size_t numBlocks;
+    uint32_t flags;
+    // CRC32C y huella de cada bloque (la huella falta si se comprime sin
+    // ARCHIVE_DEDUP) y, solo con ARCHIVE_DEDUP, referencias y una tabla hash
+    // abierta (bloque + 1, 0 = vacio) para buscar bloques por su huella.
+    uint32_t* blockChecksums;
+    uint32_t* refCounts;
+    uint64_t* blockHashes;
+    size_t blockTableCapacity;
+    uint32_t* fingerprintIndex;
+    size_t fingerprintCapacity;
+    size_t numFingerprints;
+    // Bytes de fragmentos vivos en cada bloque (0 si no es de fragmentos) y
+    // bloques de fragmentos nuevos de esta operacion: se llenan en orden, el
+    // ultimo sigue abierto hasta tailFill, y su CRC se calcula al confirmar.
+    uint32_t* fragmentBytes;
+    // Bloques que la copia de esta operacion encontro llenos de ceros y no
+    // escribio; al terminar pasan a ser huecos del miembro
+    uint8_t* zeroBlocks;
+    // Bloques liberados que esperan a que ningun lector los vea. Con
+    // deferFrees apagado (lectores excluidos o empaquetado nuevo) se liberan
+    // enseguida; los de newBlocks (reservados en esta operacion) siempre.
+    PendingExtent* pending;
+    size_t numPending;
+    size_t pendingCapacity;
+    bool deferFrees;
+    uint8_t* newBlocks;
+    // Bloques libres que todavia ocupan espacio en disco. Al confirmar se
+    // vuelven huecos; los libres sin marca ya lo son, y reutilizarlos es lo
+    // mismo que escribir al final del archivo.
+    uint8_t* unpunchedBlocks;
+    size_t* tailBlocks;
+    size_t numTailBlocks;
+    size_t tailBlockCapacity;
+    size_t tailFill;
+    // Cabecera y region de metadatos tal como estan en disco, para escribir
+    // solo las paginas que cambian; NULL si todavia no hay nada confirmado.
+    ArchiveHeader committed;
+    unsigned char* metadataImage;
 } FileAllocationTable;
 
+// Tramo de bloques de un miembro que un hilo copia de una vez.
+typedef struct {
+    size_t member;
+    size_t extent;       // Extent donde empieza el tramo
+    size_t extentOffset; // Primer bloque del tramo dentro de ese extent
+    size_t firstBlock;   // Primer bloque del tramo dentro del miembro
+    size_t numBlocks;
+    size_t streamOffset; // Miembros comprimidos: posicion del tramo en el flujo
+} MemberTask;
+
+// Archivo externo de un miembro (entrada al empaquetar, salida al extraer):
+// lo abre el primer tramo que llega y lo cierra el ultimo en terminar.
+typedef struct {
+    int fd;
+    size_t pendingTasks;
+    size_t size; // Bytes del miembro; al empaquetar baja si la entrada se acorta
+    size_t unchanged; // Bloques que -u dejo como estaban
+} MemberFile;
+
+// Opciones de E/S compartidas por todos los hilos de una operacion.
+typedef struct {
+    bool useUring;
+    atomic_bool useCopyFileRange; // Se apaga si el sistema de archivos no lo soporta
+    bool direct;                  // --direct: longitudes de los archivos externos en multiplos de DIRECT_ALIGNMENT
+    int mapFd;                    // Descriptor que tiene vista mmap, o -1
+    const unsigned char* map;
+    size_t mapSize;
+} IoShared;
+
+// Anillo io_uring manejado directamente con las llamadas al sistema.
+typedef struct {
+    int fd;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned toSubmit;
+} IoRing;
+
+// Motor de E/S de un hilo: un anillo io_uring con su reserva fija de buffers
+// registrados, o el camino sincrono (copy_file_range, mmap o pread/pwrite).
+typedef struct {
+    IoShared* shared;
+    bool uring;
+    bool fixedBuffers;
+    IoRing ring;
+    unsigned char* buffers;
+    unsigned char* scratch; // Tres bloques para descomprimir, se reservan al primer uso
+    size_t cachedBlock;     // Bloque del empaquetado que esta en scratch, o SIZE_MAX
+    bool cachedCorrupt;
+} IoEngine;
+
+// -u: los bloques que cambian y estan en la ultima confirmacion no se pisan,
+// se escriben en bloques nuevos; remap[p] es el bloque nuevo de p (o
+// SIZE_MAX). Sin libres se toman bloques del final, hasta limit: las tablas
+// y el hueco antes de los metadatos ya tienen sitio para ellos.
+typedef struct {
+    FileAllocationTable* fat;
+    pthread_mutex_t* lock;
+    size_t* remap;
+    size_t numPositions;
+    size_t limit;
+} CopyOnWrite;
+
+// Copia de un rango entre dos descriptores.
+typedef struct {
+    int srcFd;
+    size_t srcOffset;
+    int dstFd;
+    size_t dstOffset;
+    size_t length;
+    bool padBlock;  // Completar con ceros hasta el final del ultimo bloque escrito
+    // CRC32C de cada bloque del empaquetado que toca la copia, o NULL: al
+    // empaquetar se calculan y al extraer se comprueban leyendo bloques enteros
+    uint32_t* checksums;
+    uint8_t* zeroBlocks; // Al empaquetar, o NULL: marca los bloques de ceros en vez de escribirlos
+    uint64_t* hashes;    // Al empaquetar, o NULL: huella de cada bloque escrito
+    // Con hashes, o NULL: no reescribir los bloques cuyo CRC y huella no
+    // cambian y escribir los demas en bloques nuevos
+    CopyOnWrite* cow;
+    size_t unchanged;    // Resultado: bloques que no hizo falta reescribir
+    size_t corrupt; // Resultado: primer bloque que no coincide con su CRC32C o SIZE_MAX
+    ssize_t copied; // Resultado: bytes copiados (menos si el origen se acaba) o -1
+} CopyOp;
+
+// Copia en paralelo entre el archivo empaquetado y los archivos de los miembros.
+typedef struct {
+    FileAllocationTable* fat;
+    int archiveFd;
+    int blockFd; // Bloques enteros del empaquetado: con --direct abierto con O_DIRECT
+    bool packing;
+    IoShared io;
+    MemberTask* tasks;
+    size_t numTasks;
+    atomic_size_t nextTask;
+    MemberFile* files;
+    pthread_mutex_t lock;
+    bool delta; // -u: los bloques que ya tenia el miembro se comparan antes de escribirlos
+    CopyOnWrite cow;
+    bool verbose;
+    bool veryVerbose;
+} CopyJob;
+
+// Comprobacion en paralelo de los CRC32C: cada hilo toma tramos de
+// EXTRACT_TASK_BLOCKS bloques y lee solo los que estan en uso.
+typedef struct {
+    FileAllocationTable* fat;
+    int archiveFd;
+    size_t* owners;           // Miembro de cada bloque o SIZE_MAX si esta libre
+    atomic_size_t nextChunk;
+    atomic_size_t verified;
+    atomic_size_t corrupted;
+    pthread_mutex_t lock;
+    bool verbose;
+} VerifyJob;
+
+// Movimiento de una ronda de la desfragmentacion.
+typedef struct {
+    size_t from;
+    size_t to;
+} DefragMove;
+
+// Estado de la desfragmentacion entre rondas. Los bloques vivos terminan en
+// [0, live) y antes de next ya estan todos en su lugar.
+typedef struct {
+    size_t* target;  // target[p]: destino del bloque que esta en p (SIZE_MAX si no hay ninguno)
+    size_t* waiting; // waiting[t]: donde esta el bloque cuyo destino es t
+    bool* busy;      // Bloques escritos en esta ronda: no se vuelven a mover hasta confirmarla
+    size_t capacity;
+    size_t live;
+    size_t next;
+} DefragState;
+
+// Bloques reservados de una sola vez para el archivo que se esta escribiendo.
+typedef struct {
+    size_t next;
+    size_t remaining;
+} BlockReservation;
+
+// Entrada que se lee por lotes: el miembro ya esta en la tabla.
+typedef struct {
+    size_t member;
+    int fd;
+} PackInput;
+
+// Lote de bloques que el hilo principal lee y el pool comprime o resume.
+typedef struct {
+    unsigned char* raw;
+    unsigned char* packed;
+    size_t* members;
+    uint32_t* rawLengths;
+    uint32_t* packedLengths; // Igual a rawLengths si el bloque no se pudo comprimir
+    uint64_t* hashes;
+    size_t numBlocks;
+    uint32_t mode;           // ARCHIVE_COMPRESSED o ARCHIVE_DEDUP
+    atomic_size_t next;
+} BlockBatch;
+
+// Hilos que procesan el lote publicado; el hilo principal tambien ayuda.
+typedef struct {
+    pthread_t* threads;
+    int numThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    BlockBatch* batch;
+    size_t generation;
+    int running;
+    bool stop;
+} BlockPool;
+
+// Anillo de bloques entre el hilo que lee una entrada de tamano desconocido y
+// el que la escribe en el empaquetado. head cuenta los bloques leidos y tail
+// los ya escritos; el lector espera si el anillo esta lleno.
+typedef struct {
+    int fd;
+    const char* name; // Para los mensajes de error
+    unsigned char* buffers;
+    size_t* lengths;
+    size_t slots;
+    size_t head;
+    size_t tail;
+    bool done;      // El lector llego al final de la entrada (o fallo)
+    bool stop;      // El escritor ya no quiere mas bloques
+    bool threaded;  // Sin hilo lector cada bloque se lee al pedirlo
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+} InputRing;
+
+// Flujo de bytes comprimidos de un miembro, escrito bloque a bloque.
+typedef struct {
+    size_t member;
+    unsigned char* buffer;
+    size_t used;
+    BlockReservation reservation;
+} PackedStream;
+
+// Empaquetado en flujo: se escribe de una pasada y sin volver atras, para
+// poder mandarlo por una tuberia. Tras la cabecera va cada miembro con su
+// nombre y sus datos en trozos de hasta un bloque, cada uno con el CRC32C de
+// los datos originales; un trozo con rawLength 0 cierra el miembro. Al final
+// van el indice (cabecera, una entrada por miembro y los nombres) y un pie de
+// tamano fijo para que quien pueda hacer seek liste sin recorrer los datos.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t flags;
+} StreamHeader;
+
+// Cabecera de miembro, seguida del nombre. El indice empieza con una de igual
+// tamano y magic STREAM_INDEX_MAGIC, con el numero de miembros en count.
+typedef struct {
+    char magic[4];
+    uint32_t nameLength;
+    uint32_t flags;
+    uint32_t count;
+} StreamMemberHeader;
+
+// Trozo de datos: storedLength == rawLength si va sin comprimir
+typedef struct {
+    uint32_t rawLength;
+    uint32_t storedLength;
+    uint32_t checksum;
+    uint32_t reserved;
+} StreamChunk;
+
 typedef struct {
-    unsigned char data[BLOCK_SIZE];
-} Block;
+    uint64_t offset; // Cabecera del miembro dentro del flujo
+    uint64_t fileSize;
+    uint64_t storedSize;
+    uint32_t nameLength;
+    uint32_t flags;
+} StreamIndexEntry;
+
+typedef struct {
+    char magic[4];
+    uint32_t checksum; // CRC32C del indice completo
+    uint64_t indexOffset;
+} StreamFooter;
+
+
+// Fases que mide --stats. Al empaquetar la entrada son los archivos de origen;
+// al extraer o verificar, los bloques del empaquetado. Las copias dentro del
+// kernel (copy_file_range) leen y escriben a la vez y cuentan como escritura.
+typedef enum {
+    PHASE_INPUT_READ,
+    PHASE_ALLOCATOR,
+    PHASE_BLOCK_WRITE,
+    PHASE_METADATA_WRITE,
+    PHASE_SYNC,
+    NUM_PHASES
+} StatsPhase;
+
+typedef enum {
+    CALL_READ,
+    CALL_PREAD,
+    CALL_WRITE,
+    CALL_PWRITE,
+    CALL_COPY_FILE_RANGE,
+    CALL_IO_URING_ENTER,
+    CALL_FDATASYNC,
+    CALL_FTRUNCATE,
+    CALL_FALLOCATE,
+    NUM_CALLS
+} StatsCall;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t nanoseconds; // Suma de todos los hilos: puede superar el tiempo real
+} StatsCounter;
+
+// Contadores de una ejecucion. Sin --stats solo cuesta comprobar `enabled`.
+typedef struct {
+    bool enabled;
+    bool prometheus;
+    StatsCounter phases[NUM_PHASES];
+    StatsCounter syscalls[NUM_CALLS];
+} RunStats;
+
+void* checkedRealloc(void* ptr, size_t size) {
+    void* result = realloc(ptr, size);
+    if (result == NULL && size > 0) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+// Tamano de bloque del empaquetado abierto: se elige al crearlo y despues se
+// lee de la cabecera. Cada proceso trabaja con un solo empaquetado.
+size_t blockSize = DEFAULT_BLOCK_SIZE;
+
+// --direct: los bloques de datos del empaquetado y los archivos de los miembros
+// se leen y escriben con O_DIRECT, sin pasar por la cache de paginas.
+bool directIo = false;
+
+// Potencia de dos entre MIN_BLOCK_SIZE y MAX_BLOCK_SIZE
+bool validBlockSize(size_t size) {
+    return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0;
+}
+
+// Buffer de `count` bloques alineado a pagina
+unsigned char* allocBlocks(size_t count) {
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, DIRECT_ALIGNMENT, (count ? count : 1) * blockSize) != 0) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+// Bloques que caben en el buffer de copia de un hilo (al menos uno)
+size_t copyBufferBlocks(void) {
+    return COPY_BUFFER_BYTES / blockSize ? COPY_BUFFER_BYTES / blockSize : 1;
+}
+
+size_t blockOffset(size_t block) {
+    return HEADER_SIZE + block * blockSize;
+}
+
+RunStats stats;
+
+uint64_t statsStart(void) {
+    if (!stats.enabled) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void statsAdd(StatsCounter* counter, uint64_t start, uint64_t bytes) {
+    __atomic_fetch_add(&counter->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->bytes, bytes, __ATOMIC_RELAXED);
+    if (start != 0) __atomic_fetch_add(&counter->nanoseconds, statsStart() - start, __ATOMIC_RELAXED);
+}
+
+// Cierra una fase empezada con statsStart (start = 0 la cuenta sin tiempo)
+void statsPhase(StatsPhase phase, uint64_t start, ssize_t bytes) {
+    if (stats.enabled) statsAdd(&stats.phases[phase], start, bytes > 0 ? (uint64_t)bytes : 0);
+}
 
-size_t findFreeBlock(FileAllocationTable* fat) {
-    for (size_t i = 0; i < fat->numFreeBlocks; i++) {
-        if (fat->freeBlocks[i] != 0) {
-            size_t freeBlock = fat->freeBlocks[i];
-            fat->freeBlocks[i] = 0;
-            return freeBlock;
+void statsCall(StatsCall call, ssize_t bytes) {
+    if (stats.enabled) statsAdd(&stats.syscalls[call], 0, bytes > 0 ? (uint64_t)bytes : 0);
+}
+
+// Agrega los bloques al final de la lista, extendiendo el ultimo extent si es contiguo.
+void appendExtent(Extent** extents, size_t* numExtents, size_t* capacity, size_t block, size_t length) {
+    if (*numExtents > 0) {
+        Extent* last = &(*extents)[*numExtents - 1];
+        if (last->start == HOLE_EXTENT ? block == HOLE_EXTENT : last->start + last->length == block) {
+            last->length += length;
+            return;
         }
     }
-    return (size_t)-1;
+    if (*numExtents == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4;
+        *extents = checkedRealloc(*extents, *capacity * sizeof(Extent));
+    }
+    (*extents)[*numExtents].start = block;
+    (*extents)[*numExtents].length = length;
+    (*numExtents)++;
 }
 
-void expandArchive(FILE* archive, FileAllocationTable* fat) {
-    fseek(archive, 0, SEEK_END);
-    size_t currentSize = ftell(archive);
-    size_t expandedSize = currentSize + BLOCK_SIZE;
-    ftruncate(fileno(archive), expandedSize);
-    fat->freeBlocks[fat->numFreeBlocks++] = currentSize;
+uint32_t nextPriority(void) {
+    static uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
 }
 
-void listArchiveContents(const char* archiveName, bool verbose) {
-		//printf("%s\n", archiveName);
-    FILE* archive = fopen(archiveName, "rb");
-    if (archive == NULL) {
-        fprintf(stderr, "Error opening the packed file.\n");
+void updateFreeNode(FreeExtentNode* node) {
+    node->maxLength = node->length;
+    if (node->left != NULL && node->left->maxLength > node->maxLength) node->maxLength = node->left->maxLength;
+    if (node->right != NULL && node->right->maxLength > node->maxLength) node->maxLength = node->right->maxLength;
+}
+
+// Divide el arbol en los extents con start < key y los demas.
+void splitFreeTree(FreeExtentNode* node, uint64_t key, FreeExtentNode** left, FreeExtentNode** right) {
+    if (node == NULL) {
+        *left = *right = NULL;
         return;
     }
+    if (node->start < key) {
+        splitFreeTree(node->right, key, &node->right, right);
+        *left = node;
+    } else {
+        splitFreeTree(node->left, key, left, &node->left);
+        *right = node;
+    }
+    updateFreeNode(node);
+}
 
-    FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+FreeExtentNode* mergeFreeTree(FreeExtentNode* left, FreeExtentNode* right) {
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+    if (left->priority > right->priority) {
+        left->right = mergeFreeTree(left->right, right);
+        updateFreeNode(left);
+        return left;
+    }
+    right->left = mergeFreeTree(left, right->left);
+    updateFreeNode(right);
+    return right;
+}
 
-    printf("Contents of the packaged file:\n");
-    printf("-------------------------------\n");
+void destroyFreeTree(FreeExtentNode* node) {
+    if (node == NULL) return;
+    destroyFreeTree(node->left);
+    destroyFreeTree(node->right);
+    free(node);
+}
 
-    for (size_t i = 0; i < fat.numFiles; i++) {
-        FileMetadata entry = fat.files[i];
-        printf("%s\t%zu bytes\n", entry.fileName, entry.fileSize);
+void collectFreeExtents(FreeExtentNode* node, unsigned char* out, size_t* count) {
+    if (node == NULL) return;
+    collectFreeExtents(node->left, out, count);
+    Extent extent = { node->start, node->length };
+    memcpy(out + *count * sizeof(Extent), &extent, sizeof(Extent));
+    (*count)++;
+    collectFreeExtents(node->right, out, count);
+}
 
-        if (verbose) {
-            printf("  Blocks: ");
-            for (size_t j = 0; j < entry.numBlocks; j++) {
-                printf("%zu ", entry.blockPositions[j]);
+// Marca [start, start + length) como libre, fusionandolo con los extents vecinos.
+void freeBlockRange(FileAllocationTable* fat, size_t start, size_t length) {
+    if (length == 0) return;
+    uint64_t started = statsStart();
+    if (fat->unpunchedBlocks != NULL) memset(fat->unpunchedBlocks + start, 1, length);
+    fat->numFreeBlocks += length;
+    size_t freed = length;
+
+    FreeExtentNode *left, *right, *removed;
+    splitFreeTree(fat->freeRoot, start, &left, &right);
+
+    FreeExtentNode* previous = left;
+    while (previous != NULL && previous->right != NULL) previous = previous->right;
+    if (previous != NULL && previous->start + previous->length == start) {
+        start = previous->start;
+        length += previous->length;
+        splitFreeTree(left, previous->start, &left, &removed);
+        free(removed);
+        fat->numFreeExtents--;
+    }
+
+    FreeExtentNode* next = right;
+    while (next != NULL && next->left != NULL) next = next->left;
+    if (next != NULL && start + length == next->start) {
+        length += next->length;
+        splitFreeTree(right, next->start + 1, &removed, &right);
+        free(removed);
+        fat->numFreeExtents--;
+    }
+
+    FreeExtentNode* node = checkedRealloc(NULL, sizeof(FreeExtentNode));
+    node->start = start;
+    node->length = length;
+    node->maxLength = length;
+    node->priority = nextPriority();
+    node->left = node->right = NULL;
+    fat->freeRoot = mergeFreeTree(mergeFreeTree(left, node), right);
+    fat->numFreeExtents++;
+    statsPhase(PHASE_ALLOCATOR, started, freed * blockSize);
+}
+
+// Reserva hasta `wanted` bloques contiguos y devuelve cuantos obtuvo (0 si no hay
+// espacio libre). Usa el primer hueco donde caben todos; si ninguno alcanza,
+// entrega el hueco mas grande para que el llamador pida el resto despues.
+size_t reserveBlocks(FileAllocationTable* fat, size_t wanted, size_t* start) {
+    FreeExtentNode* node = fat->freeRoot;
+    if (node == NULL || wanted == 0) return 0;
+    uint64_t started = statsStart();
+
+    if (node->maxLength >= wanted) {
+        while (true) {
+            if (node->left != NULL && node->left->maxLength >= wanted) {
+                node = node->left;
+            } else if (node->length >= wanted) {
+                break;
+            } else {
+                node = node->right;
             }
-            printf("\n");
+        }
+    } else {
+        while (node->length != node->maxLength) {
+            node = (node->left != NULL && node->left->maxLength == node->maxLength) ? node->left : node->right;
         }
     }
 
-    fclose(archive);
+    size_t granted = node->length < wanted ? node->length : wanted;
+    *start = node->start;
+
+    FreeExtentNode *left, *middle, *right;
+    splitFreeTree(fat->freeRoot, node->start, &left, &middle);
+    splitFreeTree(middle, node->start + 1, &middle, &right);
+    if (middle->length > granted) {
+        middle->start += granted;
+        middle->length -= granted;
+        middle->maxLength = middle->length;
+        left = mergeFreeTree(left, middle);
+    } else {
+        free(middle);
+        fat->numFreeExtents--;
+    }
+    fat->freeRoot = mergeFreeTree(left, right);
+    fat->numFreeBlocks -= granted;
+    if (fat->newBlocks != NULL) memset(fat->newBlocks + *start, 1, granted);
+    if (fat->unpunchedBlocks != NULL) memset(fat->unpunchedBlocks + *start, 0, granted);
+    statsPhase(PHASE_ALLOCATOR, started, granted * blockSize);
+    return granted;
+}
+
+// Reserva justo [start, start + length) si esta todo libre.
+bool claimBlockRange(FileAllocationTable* fat, size_t start, size_t length) {
+    FreeExtentNode *left, *node, *right;
+    splitFreeTree(fat->freeRoot, start + 1, &left, &right);
+    FreeExtentNode* last = left;
+    while (last != NULL && last->right != NULL) last = last->right;
+    if (last == NULL || last->start + last->length < start + length) {
+        fat->freeRoot = mergeFreeTree(left, right);
+        return false;
+    }
+    splitFreeTree(left, last->start, &left, &node);
+    fat->numFreeExtents--;
+    if (node->start + node->length > start + length) {
+        FreeExtentNode* after = checkedRealloc(NULL, sizeof(FreeExtentNode));
+        after->start = start + length;
+        after->length = node->start + node->length - after->start;
+        after->maxLength = after->length;
+        after->priority = nextPriority();
+        after->left = after->right = NULL;
+        right = mergeFreeTree(after, right);
+        fat->numFreeExtents++;
+    }
+    if (node->start < start) {
+        node->length = start - node->start;
+        node->maxLength = node->length;
+        left = mergeFreeTree(left, node);
+        fat->numFreeExtents++;
+    } else {
+        free(node);
+    }
+    fat->freeRoot = mergeFreeTree(left, right);
+    fat->numFreeBlocks -= length;
+    if (fat->newBlocks != NULL) memset(fat->newBlocks + start, 1, length);
+    if (fat->unpunchedBlocks != NULL) memset(fat->unpunchedBlocks + start, 0, length);
+    return true;
 }
 
-void writeBlock(FILE* archive, Block* block, size_t position) {
-    fseek(archive, position, SEEK_SET);
-    fwrite(block, sizeof(Block), 1, archive);
+// Primer bloque libre desde `from`, o SIZE_MAX si no queda ninguno.
+size_t firstFreeBlock(FileAllocationTable* fat, size_t from) {
+    FreeExtentNode* found = NULL;
+    for (FreeExtentNode* node = fat->freeRoot; node != NULL;) {
+        if (node->start + node->length > from) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    if (found == NULL) return SIZE_MAX;
+    return found->start > from ? found->start : from;
 }
 
-void updateFAT(FileAllocationTable* fat, const char* fileName, size_t fileSize, size_t blockPosition, size_t bytesRead) {
+void freeFAT(FileAllocationTable* fat) {
     for (size_t i = 0; i < fat->numFiles; i++) {
-        if (strcmp(fat->files[i].fileName, fileName) == 0) {
-            fat->files[i].blockPositions[fat->files[i].numBlocks++] = blockPosition;
-            fat->files[i].fileSize += bytesRead;
+        free(fat->files[i].fileName);
+        free(fat->files[i].extents);
+        free(fat->files[i].blockLengths);
+    }
+    free(fat->files);
+    free(fat->nameIndex);
+    free(fat->blockChecksums);
+    free(fat->refCounts);
+    free(fat->blockHashes);
+    free(fat->fingerprintIndex);
+    free(fat->fragmentBytes);
+    free(fat->zeroBlocks);
+    free(fat->pending);
+    free(fat->newBlocks);
+    free(fat->unpunchedBlocks);
+    free(fat->tailBlocks);
+    free(fat->metadataImage);
+    destroyFreeTree(fat->freeRoot);
+    memset(fat, 0, sizeof(FileAllocationTable));
+}
+
+// Agranda las tablas por bloque para que quepan al menos `blocks` bloques;
+// los bloques nuevos no tienen CRC, referencias ni huella.
+void growBlockTables(FileAllocationTable* fat, size_t blocks) {
+    if (blocks <= fat->blockTableCapacity) return;
+    size_t capacity = fat->blockTableCapacity * 2;
+    if (capacity < blocks) capacity = blocks;
+    fat->blockChecksums = checkedRealloc(fat->blockChecksums, capacity * sizeof(uint32_t));
+    memset(fat->blockChecksums + fat->blockTableCapacity, 0, (capacity - fat->blockTableCapacity) * sizeof(uint32_t));
+    fat->refCounts = checkedRealloc(fat->refCounts, capacity * sizeof(uint32_t));
+    fat->blockHashes = checkedRealloc(fat->blockHashes, capacity * sizeof(uint64_t));
+    memset(fat->refCounts + fat->blockTableCapacity, 0, (capacity - fat->blockTableCapacity) * sizeof(uint32_t));
+    memset(fat->blockHashes + fat->blockTableCapacity, 0, (capacity - fat->blockTableCapacity) * sizeof(uint64_t));
+    fat->fragmentBytes = checkedRealloc(fat->fragmentBytes, capacity * sizeof(uint32_t));
+    memset(fat->fragmentBytes + fat->blockTableCapacity, 0, (capacity - fat->blockTableCapacity) * sizeof(uint32_t));
+    fat->zeroBlocks = checkedRealloc(fat->zeroBlocks, capacity);
+    memset(fat->zeroBlocks + fat->blockTableCapacity, 0, capacity - fat->blockTableCapacity);
+    fat->newBlocks = checkedRealloc(fat->newBlocks, capacity);
+    memset(fat->newBlocks + fat->blockTableCapacity, 0, capacity - fat->blockTableCapacity);
+    fat->unpunchedBlocks = checkedRealloc(fat->unpunchedBlocks, capacity);
+    memset(fat->unpunchedBlocks + fat->blockTableCapacity, 0, capacity - fat->blockTableCapacity);
+    fat->blockTableCapacity = capacity;
+}
+
+void ensureBlockTables(FileAllocationTable* fat) {
+    growBlockTables(fat, fat->numBlocks);
+}
+
+void indexFingerprint(FileAllocationTable* fat, size_t block) {
+    size_t mask = fat->fingerprintCapacity - 1;
+    size_t slot = fat->blockHashes[block] & mask;
+    while (fat->fingerprintIndex[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    fat->fingerprintIndex[slot] = (uint32_t)(block + 1);
+    fat->numFingerprints++;
+}
+
+// Vuelve a llenar la tabla de huellas con los bloques en uso. Los bloques que
+// se liberan no se borran de la tabla: quedan sin huella y se descartan aqui.
+void rebuildFingerprintIndex(FileAllocationTable* fat) {
+    size_t live = 0;
+    for (size_t b = 0; b < fat->numBlocks; b++) {
+        if (fat->refCounts[b] > 0 && fat->blockHashes[b] != 0) live++;
+    }
+    size_t capacity = 64;
+    while (capacity < (live + 1) * 2) capacity *= 2;
+
+    free(fat->fingerprintIndex);
+    fat->fingerprintIndex = calloc(capacity, sizeof(uint32_t));
+    if (fat->fingerprintIndex == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    fat->fingerprintCapacity = capacity;
+    fat->numFingerprints = 0;
+    for (size_t b = 0; b < fat->numBlocks; b++) {
+        if (fat->refCounts[b] > 0 && fat->blockHashes[b] != 0) indexFingerprint(fat, b);
+    }
+}
+
+// Registra la huella de un bloque recien escrito (con su primera referencia).
+void addFingerprint(FileAllocationTable* fat, size_t block, uint64_t hash) {
+    fat->blockHashes[block] = hash;
+    if ((fat->numFingerprints + 1) * 2 > fat->fingerprintCapacity) {
+        rebuildFingerprintIndex(fat);
+    } else {
+        indexFingerprint(fat, block);
+    }
+}
+
+void addPendingRange(FileAllocationTable* fat, size_t start, size_t length, uint64_t epoch) {
+    if (fat->numPending > 0) {
+        PendingExtent* last = &fat->pending[fat->numPending - 1];
+        if (last->epoch == epoch && last->start + last->length == start) {
+            last->length += length;
             return;
         }
     }
+    if (fat->numPending == fat->pendingCapacity) {
+        fat->pendingCapacity = fat->pendingCapacity ? fat->pendingCapacity * 2 : 16;
+        fat->pending = checkedRealloc(fat->pending, fat->pendingCapacity * sizeof(PendingExtent));
+    }
+    fat->pending[fat->numPending].start = start;
+    fat->pending[fat->numPending].length = length;
+    fat->pending[fat->numPending].epoch = epoch;
+    fat->numPending++;
+}
 
-    FileMetadata newEntry;
-    strncpy(newEntry.fileName, fileName, MAX_FILENAME_LENGTH);
-    newEntry.fileSize = fileSize + bytesRead;
-    newEntry.blockPositions[0] = blockPosition;
-    newEntry.numBlocks = 1;
-    fat->files[fat->numFiles++] = newEntry;
+// Libera bloques que eran de un miembro. Si algun lector puede tener una foto
+// donde se usan, quedan pendientes en vez de volver al espacio libre; los
+// reservados en esta operacion no estan en ninguna foto.
+void retireBlockRange(FileAllocationTable* fat, size_t start, size_t length) {
+    if (!fat->deferFrees) {
+        freeBlockRange(fat, start, length);
+        return;
+    }
+    size_t end = start + length;
+    while (start < end) {
+        size_t run = start;
+        while (run < end && fat->newBlocks[run] == fat->newBlocks[start]) run++;
+        if (fat->newBlocks[start]) {
+            freeBlockRange(fat, start, run - start);
+        } else {
+            addPendingRange(fat, start, run - start, PENDING_THIS_OPERATION);
+        }
+        start = run;
+    }
 }
 
-void writeFAT(FILE* archive, FileAllocationTable* fat) {
-    fseek(archive, 0, SEEK_SET);
-    fwrite(fat, sizeof(FileAllocationTable), 1, archive);
+// Libera los bloques pendientes que ya no ve ningun lector: los de fotos
+// anteriores a oldest, o todos (tambien los de esta operacion) con everything.
+void reclaimPendingBlocks(FileAllocationTable* fat, uint64_t oldest, bool everything) {
+    size_t kept = 0;
+    for (size_t i = 0; i < fat->numPending; i++) {
+        PendingExtent* extent = &fat->pending[i];
+        if (everything || extent->epoch < oldest) {
+            freeBlockRange(fat, extent->start, extent->length);
+        } else {
+            fat->pending[kept++] = *extent;
+        }
+    }
+    fat->numPending = kept;
 }
 
-void createArchive(struct Data data) {
-    if (data.verbose) printf("Creating the file %s\n.......", data.outputFile);
-    FILE* archive = fopen(data.outputFile, "wb");
+// Suelta una referencia a cada bloque del rango; sin deduplicacion, o cuando
+// se va la ultima referencia, el bloque deja de usarse.
+void releaseBlockRange(FileAllocationTable* fat, size_t start, size_t length) {
+    if (!(fat->flags & ARCHIVE_DEDUP)) {
+        retireBlockRange(fat, start, length);
+        return;
+    }
+    size_t runStart = start;
+    size_t runLength = 0;
+    for (size_t b = start; b < start + length; b++) {
+        if (fat->refCounts[b] > 1) {
+            fat->refCounts[b]--;
+            continue;
+        }
+        fat->refCounts[b] = 0;
+        fat->blockHashes[b] = 0;
+        if (runStart + runLength != b) {
+            retireBlockRange(fat, runStart, runLength);
+            runStart = b;
+            runLength = 0;
+        }
+        runLength++;
+    }
+    retireBlockRange(fat, runStart, runLength);
+}
 
-    if (archive == NULL) {
-        fprintf(stderr, "Error opening the file %s\n", data.outputFile);
+bool isNewTailBlock(FileAllocationTable* fat, size_t block) {
+    for (size_t i = 0; i < fat->numTailBlocks; i++) {
+        if (fat->tailBlocks[i] == block) return true;
+    }
+    return false;
+}
+
+// Quita el fragmento de cola del miembro; el bloque se libera con el ultimo
+// fragmento (los de esta operacion, al confirmar).
+void releaseTail(FileAllocationTable* fat, FileMetadata* entry) {
+    if (entry->tailLength == 0) return;
+    size_t block = entry->tailBlock;
+    fat->fragmentBytes[block] -= entry->tailLength;
+    entry->tailLength = 0;
+    if (fat->fragmentBytes[block] == 0 && !isNewTailBlock(fat, block)) {
+        retireBlockRange(fat, block, 1);
+    }
+}
+
+void releaseExtents(FileAllocationTable* fat, FileMetadata* entry) {
+    releaseTail(fat, entry);
+    for (size_t k = 0; k < entry->numExtents; k++) {
+        if (entry->extents[k].start == HOLE_EXTENT) continue;
+        releaseBlockRange(fat, entry->extents[k].start, entry->extents[k].length);
+    }
+    entry->numExtents = 0;
+    free(entry->blockLengths);
+    entry->blockLengths = NULL;
+    entry->flags &= ~MEMBER_COMPRESSED;
+}
+
+// Quita de la zona de datos los bloques libres del final (la preasignacion que
+// no se llego a usar y lo que se libero al final): el empaquetado se acorta.
+void trimFreeTail(FileAllocationTable* fat) {
+    FreeExtentNode* last = fat->freeRoot;
+    while (last != NULL && last->right != NULL) last = last->right;
+    if (last == NULL || last->start + last->length != fat->numBlocks) return;
+
+    FreeExtentNode *left, *tail;
+    splitFreeTree(fat->freeRoot, last->start, &left, &tail);
+    fat->freeRoot = left;
+    fat->numFreeExtents--;
+    fat->numFreeBlocks -= tail->length;
+    if (fat->unpunchedBlocks != NULL) memset(fat->unpunchedBlocks + tail->start, 0, tail->length);
+    fat->numBlocks = tail->start;
+    free(tail);
+}
+
+// Bloque lleno de ceros. En x86-64 se comparan 64 bytes por vuelta con SSE2
+// (siempre disponible); length es multiplo de 64 porque los bloques lo son.
+bool isZeroBlock(const unsigned char* data, size_t length) {
+#if defined(__x86_64__)
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < length; i += 64) {
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)),
+                                                _mm_loadu_si128((const __m128i*)(data + i + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)),
+                                                _mm_loadu_si128((const __m128i*)(data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) return false;
+    }
+#else
+    for (size_t i = 0; i < length; i += 64) {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) != 0) return false;
+    }
+#endif
+    return true;
+}
+
+uint64_t rotateLeft(uint64_t value, int bits) {
+    return value << bits | value >> (64 - bits);
+}
+
+// Los empaquetados sin comprimir guardan la huella de cada bloque para que -u
+// reescriba solo los que cambian; con --dedup es ademas la clave del indice.
+bool storesBlockHashes(uint32_t flags) {
+    return (flags & ARCHIVE_DEDUP) || !(flags & ARCHIVE_COMPRESSED);
+}
+
+// Huella de un bloque al estilo de xxHash64: cuatro acumuladores
+// independientes sobre palabras de 8 bytes, que el compilador puede
+// vectorizar, y una mezcla final. length debe ser multiplo de 32.
+uint64_t hashBlock(const unsigned char* data, size_t length) {
+    const uint64_t prime1 = 11400714785074694791ull;
+    const uint64_t prime2 = 14029467366897019727ull;
+    const uint64_t prime3 = 1609587929392839161ull;
+    const uint64_t prime4 = 9650029242287828579ull;
+    uint64_t lanes[4] = { prime1 + prime2, prime2, 0, -prime1 };
+    for (size_t i = 0; i + 32 <= length; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, data + i + lane * 8, sizeof(word));
+            lanes[lane] = rotateLeft(lanes[lane] + word * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+    for (int lane = 0; lane < 4; lane++) {
+        hash ^= rotateLeft(lanes[lane] * prime2, 31) * prime1;
+        hash = hash * prime1 + prime4;
+    }
+    hash += length;
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash != 0 ? hash : 1; // 0 marca los bloques sin huella
+}
+
+void indexMember(FileAllocationTable* fat, size_t member) {
+    size_t mask = fat->indexCapacity - 1;
+    size_t slot = hashName(fat->files[member].fileName) & mask;
+    while (fat->nameIndex[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    fat->nameIndex[slot] = (uint32_t)(member + 1);
+}
+
+void rebuildNameIndex(FileAllocationTable* fat, size_t capacity) {
+    free(fat->nameIndex);
+    fat->indexCapacity = capacity;
+    fat->nameIndex = calloc(capacity, sizeof(uint32_t));
+    if (fat->nameIndex == NULL) {
+        fprintf(stderr, "Out of memory.\n");
         exit(EXIT_FAILURE);
     }
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        if (!(fat->files[i].flags & MEMBER_DELETED)) {
+            indexMember(fat, i);
+        }
+    }
+}
 
-    FileAllocationTable fat;
-    memset(&fat, 0, sizeof(FileAllocationTable));
+// Busca un miembro vivo por nombre en la tabla hash. Las lapidas siguen
+// ocupando su casilla, asi que la busqueda solo se detiene en una vacia.
+FileMetadata* findMember(FileAllocationTable* fat, const char* fileName) {
+    if (fat->indexCapacity == 0) return NULL;
+    size_t mask = fat->indexCapacity - 1;
+    size_t slot = hashName(fileName) & mask;
+    while (fat->nameIndex[slot] != 0) {
+        FileMetadata* entry = &fat->files[fat->nameIndex[slot] - 1];
+        if (!(entry->flags & MEMBER_DELETED) && strcmp(entry->fileName, fileName) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+FileMetadata* addMember(FileAllocationTable* fat, const char* fileName) {
+    if ((fat->numFiles + 1) * 2 > fat->indexCapacity) {
+        rebuildNameIndex(fat, fat->indexCapacity ? fat->indexCapacity * 2 : 64);
+    }
+    if (fat->numFiles == fat->fileCapacity) {
+        fat->fileCapacity = fat->fileCapacity ? fat->fileCapacity * 2 : 16;
+        fat->files = checkedRealloc(fat->files, fat->fileCapacity * sizeof(FileMetadata));
+    }
+    FileMetadata* entry = &fat->files[fat->numFiles];
+    memset(entry, 0, sizeof(FileMetadata));
+    entry->fileName = strdup(fileName);
+    indexMember(fat, fat->numFiles++);
+    return entry;
+}
 
-    fat.freeBlocks[0] = sizeof(FileAllocationTable);
-    fat.numFreeBlocks = 1;
-    fwrite(&fat, sizeof(FileAllocationTable), 1, archive);
+// Marca el miembro como borrado sin desplazar la tabla; sus bloques quedan libres.
+void removeMember(FileAllocationTable* fat, FileMetadata* entry) {
+    releaseExtents(fat, entry);
+    entry->flags |= MEMBER_DELETED;
+    entry->fileSize = 0;
+    entry->fileName[0] = '\0';
+    fat->numDeleted++;
+}
 
-    if (data.numInputFiles > 0 && data.file) {
-        for (int i = 0; i < data.numInputFiles; i++) {
-            FILE* inputFile = fopen(data.inputFiles[i], "rb");
-            if (inputFile == NULL) {
-                fprintf(stderr, "Error opening the file %s\n", data.inputFiles[i]);
-                continue;
-            }
+// Cuando las lapidas son mayoria se eliminan y se reconstruye el indice.
+void compactMembers(FileAllocationTable* fat) {
+    if (fat->numDeleted * 2 <= fat->numFiles) return;
 
-            if (data.verbose) printf("Adding file %s\n.......", data.inputFiles[i]);
-            size_t fileSize = 0;
-            Block block;
-            size_t bytesRead;
+    size_t live = 0;
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        if (fat->files[i].flags & MEMBER_DELETED) {
+            free(fat->files[i].fileName);
+            free(fat->files[i].extents);
+            free(fat->files[i].blockLengths);
+        } else {
+            fat->files[live++] = fat->files[i];
+        }
+    }
+    fat->numFiles = live;
+    fat->numDeleted = 0;
 
-            while ((bytesRead = fread(&block, 1, sizeof(Block), inputFile)) > 0) {
-                size_t blockPosition = findFreeBlock(&fat);
-                if (blockPosition == (size_t)-1) {
-                    if (data.veryVerbose) {
-                        printf("No free blocks, expanding the file\n");
-                    }
-                    expandArchive(archive, &fat);
-                    blockPosition = findFreeBlock(&fat);
-                    if (data.veryVerbose) {
-                        printf("New free block in position %zu\n.......", blockPosition);
-                    }
-                }
+    size_t capacity = 64;
+    while (capacity < live * 2) capacity *= 2;
+    rebuildNameIndex(fat, capacity);
+}
 
-                if (bytesRead < sizeof(Block)) {
-                    memset((char*)&block + bytesRead, 0, sizeof(Block) - bytesRead);
-                }
+ssize_t preadUpTo(int fd, void* buffer, size_t length, size_t offset) {
+    unsigned char* p = buffer;
+    size_t total = 0;
+    while (total < length) {
+        ssize_t done = pread(fd, p + total, length - total, offset + total);
+        statsCall(CALL_PREAD, done);
+        if (done < 0 && errno == EINTR) continue;
+        if (done < 0) return -1;
+        if (done == 0) break;
+        total += done;
+    }
+    return total;
+}
+
+bool preadFully(int fd, void* buffer, size_t length, size_t offset) {
+    return preadUpTo(fd, buffer, length, offset) == (ssize_t)length;
+}
 
-                writeBlock(archive, &block, blockPosition);
-                updateFAT(&fat, data.inputFiles[i], fileSize, blockPosition, bytesRead);
+bool pwriteFully(int fd, const void* buffer, size_t length, size_t offset) {
+    const unsigned char* p = buffer;
+    while (length > 0) {
+        ssize_t done = pwrite(fd, p, length, offset);
+        statsCall(CALL_PWRITE, done);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return false;
+        p += done;
+        offset += done;
+        length -= done;
+    }
+    return true;
+}
 
-                fileSize += bytesRead;
+bool syncFile(int fd) {
+    uint64_t start = statsStart();
+    bool ok = fdatasync(fd) == 0;
+    statsCall(CALL_FDATASYNC, 0);
+    statsPhase(PHASE_SYNC, start, 0);
+    return ok;
+}
 
-                if (data.veryVerbose) {
-                    printf("Writing block %zu to file %s\n.......", blockPosition, data.inputFiles[i]);
-                }
-            }
+void truncateFile(int fd, size_t size) {
+    uint64_t start = statsStart();
+    ftruncate(fd, size);
+    statsCall(CALL_FTRUNCATE, 0);
+    statsPhase(PHASE_SYNC, start, 0);
+}
+
+// Devuelve al sistema de archivos un tramo que no guarda nada
+void punchHole(int fd, size_t offset, size_t length) {
+    uint64_t start = statsStart();
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+    statsCall(CALL_FALLOCATE, 0);
+    statsPhase(PHASE_SYNC, start, 0);
+}
+
+// Abre otra vez el archivo de fd con O_DIRECT, o devuelve -1 si el sistema de
+// archivos no lo admite (o no hay /proc): entonces se sigue con fd.
+int reopenDirect(int fd, int flags) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, flags | O_DIRECT | O_CLOEXEC);
+}
+
+// open con O_DIRECT si se pidio --direct y el sistema de archivos lo admite.
+int openDirect(const char* path, int flags, mode_t mode) {
+    if (directIo) {
+        int fd = open(path, flags | O_DIRECT, mode);
+        if (fd >= 0 || errno != EINVAL) return fd;
+    }
+    return open(path, flags, mode);
+}
 
-            if (data.verbose) printf("File size %s: %zu bytes\n.......", data.inputFiles[i], fileSize);
+// Longitud a pedir con O_DIRECT: se completa hasta DIRECT_ALIGNMENT. Al leer,
+// el final del archivo la acorta; al escribir, lo que sobra se recorta despues
+// con ftruncate. Los buffers son de bloques enteros, asi que siempre cabe.
+size_t directLength(IoShared* shared, size_t length) {
+    if (!shared->direct) return length;
+    return (length + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+}
+
+// Pide un candado OFD sobre [start, start + length) (length 0: hasta el final),
+// esperando si wait. Si el sistema de archivos no tiene candados se sigue sin
+// ellos, como si se hubiera obtenido.
+bool lockRange(int fd, short type, off_t start, off_t length, bool wait) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = length;
+    while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) != 0) {
+        if (errno == EINTR) continue;
+        return errno == EINVAL || errno == ENOLCK || errno == EOPNOTSUPP;
+    }
+    return true;
+}
+
+// La foto mas vieja entre las confirmaciones 0..newest que algun lector
+// todavia usa, o UINT64_MAX si no hay lectores. Cada consulta devuelve un
+// lector cualquiera del rango, asi que se achica el rango hasta no ver mas.
+uint64_t oldestSnapshot(int fd, uint64_t newest) {
+    uint64_t oldest = UINT64_MAX;
+    uint64_t limit = newest + 1;
+    while (limit > 0) {
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = LOCK_SNAPSHOTS;
+        lock.l_len = limit;
+        if (fcntl(fd, F_OFD_GETLK, &lock) != 0 || lock.l_type == F_UNLCK) break;
+        oldest = lock.l_start - LOCK_SNAPSHOTS;
+        limit = oldest;
+    }
+    return oldest;
+}
+
+// Bytes sin datos en el origen desde offset segun SEEK_DATA, en bloques
+// enteros salvo que el hueco llegue al final del archivo; como mucho limit.
+// Sin soporte del sistema de archivos todo cuenta como datos.
+size_t sourceHole(int fd, size_t offset, size_t limit) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    struct stat st;
+    if (data < 0 && errno == ENXIO && fstat(fd, &st) == 0 && (size_t)st.st_size > offset) {
+        size_t hole = st.st_size - offset;
+        return hole < limit ? hole : limit / blockSize * blockSize;
+    }
+    if (data < 0 || (size_t)data <= offset) return 0;
+    size_t hole = (size_t)data - offset;
+    if (hole > limit) hole = limit;
+    return hole / blockSize * blockSize;
+}
+
+size_t roundToPage(size_t bytes) {
+    return (bytes + METADATA_PAGE_SIZE - 1) / METADATA_PAGE_SIZE * METADATA_PAGE_SIZE;
+}
+
+// Lee el registro del diario que hay detras de la region confirmada. Devuelve
+// el registro entero si esta completo y su CRC coincide; si la caida fue
+// mientras se escribia, no hay nada que aplicar.
+unsigned char* readJournal(int fd, const ArchiveHeader* committed) {
+    size_t offset = committed->metadataOffset + committed->metadataCapacity;
+    JournalRecord record;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !preadFully(fd, &record, sizeof(JournalRecord), offset) ||
+        memcmp(record.magic, JOURNAL_MAGIC, sizeof(record.magic)) != 0 ||
+        record.header.metadataCapacity % METADATA_PAGE_SIZE != 0 ||
+        record.numPages > record.header.metadataCapacity / METADATA_PAGE_SIZE) {
+        return NULL;
+    }
+    size_t size = sizeof(JournalRecord) + record.numPages * (sizeof(uint32_t) + METADATA_PAGE_SIZE);
+    if (offset + size > (size_t)st.st_size) return NULL;
+
+    unsigned char* buffer = checkedRealloc(NULL, size);
+    if (!preadFully(fd, buffer, size, offset)) {
+        free(buffer);
+        return NULL;
+    }
+    ((JournalRecord*)buffer)->checksum = 0;
+    bool ok = crc32c(buffer, size) == record.checksum;
+    uint32_t* pages = (uint32_t*)(buffer + sizeof(JournalRecord));
+    for (size_t p = 0; p < record.numPages && ok; p++) {
+        ok = pages[p] < record.header.metadataCapacity / METADATA_PAGE_SIZE;
+    }
+    if (!ok) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Comprueba los extents libres de la imagen: se guardan ordenados, sin
+// solaparse, dentro del empaquetado y sin pisar bloques de ningun miembro.
+bool validFreeExtents(const unsigned char* data, size_t count, size_t numBlocks, const FileAllocationTable* fat) {
+    size_t end = 0;
+    for (size_t i = 0; i < count; i++) {
+        Extent extent;
+        memcpy(&extent, data + i * sizeof(Extent), sizeof(Extent));
+        if (extent.length == 0 || extent.start < end || extent.start > numBlocks || extent.length > numBlocks - extent.start) {
+            return false;
+        }
+        end = extent.start + extent.length;
+    }
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        const FileMetadata* entry = &fat->files[i];
+        for (size_t k = 0; k <= entry->numExtents; k++) {
+            uint64_t start, length;
+            if (k < entry->numExtents) {
+                if (entry->extents[k].start == HOLE_EXTENT) continue;
+                start = entry->extents[k].start;
+                length = entry->extents[k].length;
+            } else if (entry->tailLength > 0) {
+                start = entry->tailBlock;
+                length = 1;
+            } else {
+                continue;
+            }
+            if (start > numBlocks || length > numBlocks - start) return false;
+            // Ultimo extent libre que empieza antes del final de este
+            size_t low = 0, high = count;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                Extent extent;
+                memcpy(&extent, data + middle * sizeof(Extent), sizeof(Extent));
+                if (extent.start < start + length) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            if (low > 0) {
+                Extent extent;
+                memcpy(&extent, data + (low - 1) * sizeof(Extent), sizeof(Extent));
+                if (extent.start + extent.length > start) return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool loadFAT(FILE* archive, FileAllocationTable* fat) {
+    memset(fat, 0, sizeof(FileAllocationTable));
+    int fd = fileno(archive);
+    fflush(archive);
+
+    ArchiveHeader header;
+    if (!preadFully(fd, &header, sizeof(ArchiveHeader), 0) ||
+        memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0) {
+        if (memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) == 0) {
+            fprintf(stderr, "Streamed packed files can only be listed, extracted or verified.\n");
+        } else {
+            fprintf(stderr, "Not a packed file.\n");
+        }
+        return false;
+    }
+    if (header.version != ARCHIVE_VERSION || header.dataOffset != HEADER_SIZE) {
+        fprintf(stderr, "Unsupported packed file version %u.\n", header.version);
+        return false;
+    }
+    if (!validBlockSize(header.blockSize)) {
+        fprintf(stderr, "Unsupported block size %u.\n", header.blockSize);
+        return false;
+    }
+    blockSize = header.blockSize;
+
+    // Un registro completo en el diario confirma una cabecera y paginas nuevas
+    size_t committedEnd = header.metadataOffset + header.metadataCapacity;
+    unsigned char* journal = readJournal(fd, &header);
+    JournalRecord* record = (JournalRecord*)journal;
+    if (journal != NULL) header = record->header;
+
+    unsigned char* buffer = calloc(header.metadataCapacity ? header.metadataCapacity : 1, 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t got = preadUpTo(fd, buffer, header.metadataCapacity, header.metadataOffset);
+    if (got < 0 || (journal == NULL && (size_t)got < header.metadataSize)) {
+        fprintf(stderr, "Truncated packed file metadata.\n");
+        free(buffer);
+        free(journal);
+        return false;
+    }
+    if (journal != NULL) {
+        uint32_t* pages = (uint32_t*)(journal + sizeof(JournalRecord));
+        unsigned char* data = journal + sizeof(JournalRecord) + record->numPages * sizeof(uint32_t);
+        for (size_t p = 0; p < record->numPages; p++) {
+            memcpy(buffer + pages[p] * (size_t)METADATA_PAGE_SIZE, data + p * (size_t)METADATA_PAGE_SIZE, METADATA_PAGE_SIZE);
+        }
+        // Se termina de aplicar; abierto solo para leer, se usa en memoria
+        bool applied = true;
+        for (size_t p = 0; p < record->numPages && applied; p++) {
+            applied = pwriteFully(fd, data + p * (size_t)METADATA_PAGE_SIZE, METADATA_PAGE_SIZE,
+                                  header.metadataOffset + pages[p] * (size_t)METADATA_PAGE_SIZE);
+        }
+        if (applied && pwriteFully(fd, &header, sizeof(ArchiveHeader), 0) && syncFile(fd)) {
+            truncateFile(fd, header.metadataOffset + header.metadataCapacity);
+        }
+        free(journal);
+    } else {
+        // Registro a medias: se descarta
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > committedEnd) truncateFile(fd, committedEnd);
+    }
+
+    fat->numBlocks = header.numBlocks;
+    fat->flags = header.flags;
+    fat->files = checkedRealloc(NULL, header.numFiles * sizeof(FileMetadata));
+    fat->fileCapacity = header.numFiles;
+
+    size_t pos = 0;
+    bool ok = true;
+    for (size_t i = 0; i < header.numFiles && ok; i++) {
+        MemberRecord record;
+        if (pos + sizeof(MemberRecord) > header.freeOffset) {
+            ok = false;
+            break;
+        }
+        memcpy(&record, buffer + pos, sizeof(MemberRecord));
+        pos += sizeof(MemberRecord);
+        size_t extentBytes = record.numExtents * sizeof(Extent);
+        if (pos + record.nameLength + extentBytes > header.freeOffset) {
+            ok = false;
+            break;
+        }
+
+        FileMetadata* entry = &fat->files[fat->numFiles++];
+        entry->fileName = checkedRealloc(NULL, record.nameLength + 1);
+        memcpy(entry->fileName, buffer + pos, record.nameLength);
+        entry->fileName[record.nameLength] = '\0';
+        pos += record.nameLength;
+        entry->fileSize = record.fileSize;
+        entry->flags = record.flags;
+        if (entry->flags & MEMBER_DELETED) fat->numDeleted++;
+        entry->numExtents = record.numExtents;
+        entry->extentCapacity = record.numExtents;
+        entry->extents = checkedRealloc(NULL, extentBytes);
+        if (extentBytes > 0) memcpy(entry->extents, buffer + pos, extentBytes);
+        pos += extentBytes;
+        entry->blockLengths = NULL;
+        entry->tailBlock = record.tailBlock;
+        entry->tailOffset = record.tailOffset;
+        entry->tailLength = record.tailLength;
+        if (entry->tailLength > 0 && (entry->tailLength > entry->fileSize || record.tailBlock >= header.numBlocks ||
+                                      (size_t)record.tailOffset + record.tailLength > blockSize ||
+                                      (entry->flags & MEMBER_COMPRESSED))) {
+            ok = false;
+            break;
+        }
+
+        if (entry->flags & MEMBER_COMPRESSED) {
+            // Cada bloque ocupa entre 1 byte y su tamano original, y todos
+            // juntos deben caber en los extents del miembro
+            size_t numBlocks = (entry->fileSize + blockSize - 1) / blockSize;
+            size_t lengthBytes = numBlocks * sizeof(uint32_t);
+            if (pos + lengthBytes > header.freeOffset) {
+                ok = false;
+                break;
+            }
+            entry->blockLengths = checkedRealloc(NULL, lengthBytes ? lengthBytes : 1);
+            if (lengthBytes > 0) memcpy(entry->blockLengths, buffer + pos, lengthBytes);
+            pos += lengthBytes;
+
+            size_t stored = 0;
+            size_t capacity = 0;
+            for (size_t k = 0; k < entry->numExtents; k++) {
+                capacity += entry->extents[k].length * blockSize;
+            }
+            for (size_t k = 0; k < numBlocks && ok; k++) {
+                size_t rawLength = entry->fileSize - k * blockSize;
+                if (rawLength > blockSize) rawLength = blockSize;
+                ok = entry->blockLengths[k] > 0 && entry->blockLengths[k] <= rawLength;
+                stored += entry->blockLengths[k];
+            }
+            ok = ok && stored <= capacity;
+        }
+    }
+
+    size_t freeBytes = header.numFreeExtents * sizeof(Extent);
+    size_t indexBytes = header.indexCapacity * sizeof(uint32_t);
+    size_t checksumBytes = header.numBlocks * sizeof(uint32_t);
+    size_t hashBytes = storesBlockHashes(header.flags) ? header.numBlocks * sizeof(uint64_t) : 0;
+    size_t pendingBytes = header.numPendingExtents * sizeof(PendingExtent);
+    if (!ok || header.metadataCapacity % METADATA_PAGE_SIZE != 0 || header.metadataOffset < blockOffset(header.numBlocks) ||
+        header.freeOffset > header.indexOffset || header.indexOffset - header.freeOffset < freeBytes ||
+        header.indexOffset > header.checksumOffset || header.checksumOffset - header.indexOffset < indexBytes ||
+        header.checksumOffset > header.hashOffset || header.hashOffset - header.checksumOffset < checksumBytes ||
+        header.hashOffset > header.pendingOffset || header.pendingOffset - header.hashOffset < hashBytes ||
+        header.pendingOffset > header.metadataCapacity || header.metadataCapacity - header.pendingOffset < pendingBytes ||
+        (header.indexCapacity & (header.indexCapacity - 1)) != 0 || header.indexCapacity < header.numFiles * 2) {
+        fprintf(stderr, "Corrupted packed file metadata.\n");
+        free(buffer);
+        freeFAT(fat);
+        return false;
+    }
+    pos = header.freeOffset;
+    if (!validFreeExtents(buffer + pos, header.numFreeExtents, header.numBlocks, fat)) {
+        fprintf(stderr, "Corrupted packed file metadata.\n");
+        free(buffer);
+        freeFAT(fat);
+        return false;
+    }
+    for (size_t i = 0; i < header.numFreeExtents; i++) {
+        Extent extent;
+        memcpy(&extent, buffer + pos + i * sizeof(Extent), sizeof(Extent));
+        freeBlockRange(fat, extent.start, extent.length);
+    }
+    pos = header.indexOffset;
+
+    // El indice de nombres se carga tal cual, sin volver a calcular los hashes
+    fat->indexCapacity = header.indexCapacity;
+    fat->nameIndex = checkedRealloc(NULL, indexBytes);
+    memcpy(fat->nameIndex, buffer + pos, indexBytes);
+    for (size_t i = 0; i < fat->indexCapacity; i++) {
+        if (fat->nameIndex[i] > fat->numFiles) {
+            fprintf(stderr, "Corrupted packed file name index.\n");
+            free(buffer);
+            freeFAT(fat);
+            return false;
+        }
+    }
+
+    ensureBlockTables(fat);
+    pos = header.checksumOffset;
+    if (checksumBytes > 0) memcpy(fat->blockChecksums, buffer + pos, checksumBytes);
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        if (fat->files[i].tailLength > 0) fat->fragmentBytes[fat->files[i].tailBlock] += fat->files[i].tailLength;
+    }
+    pos = header.hashOffset;
+
+    if (hashBytes > 0) memcpy(fat->blockHashes, buffer + pos, hashBytes);
+    if (fat->flags & ARCHIVE_DEDUP) {
+        // Las referencias no se guardan: se cuentan recorriendo los extents
+        for (size_t i = 0; i < fat->numFiles; i++) {
+            FileMetadata* entry = &fat->files[i];
+            for (size_t k = 0; k < entry->numExtents; k++) {
+                if (entry->extents[k].start + entry->extents[k].length > fat->numBlocks) {
+                    fprintf(stderr, "Corrupted packed file metadata.\n");
+                    free(buffer);
+                    freeFAT(fat);
+                    return false;
+                }
+                for (size_t b = 0; b < entry->extents[k].length; b++) {
+                    fat->refCounts[entry->extents[k].start + b]++;
+                }
+            }
+        }
+        rebuildFingerprintIndex(fat);
+    }
+    fat->pendingCapacity = header.numPendingExtents ? header.numPendingExtents : 1;
+    fat->pending = checkedRealloc(NULL, fat->pendingCapacity * sizeof(PendingExtent));
+    memcpy(fat->pending, buffer + header.pendingOffset, pendingBytes);
+    fat->numPending = header.numPendingExtents;
+    for (size_t i = 0; i < fat->numPending; i++) {
+        if (fat->pending[i].start + fat->pending[i].length > fat->numBlocks) {
+            fprintf(stderr, "Corrupted packed file metadata.\n");
+            free(buffer);
+            freeFAT(fat);
+            return false;
+        }
+    }
+    fat->committed = header;
+    fat->metadataImage = buffer;
+    return true;
+}
+
+// Carga los metadatos confirmados. Quien abre para escribir toma el candado de
+// escritor (un segundo escritor espera) y libera los bloques pendientes que ya
+// no ve ningun lector. Quien solo lee se anota en la foto que cargo y la
+// conserva hasta cerrar: ningun escritor reutiliza esos bloques mientras tanto.
+bool readFAT(FILE* archive, FileAllocationTable* fat) {
+    int fd = fileno(archive);
+    bool writer = (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY;
+    if (writer) lockRange(fd, F_WRLCK, LOCK_WRITER, 1, true);
+    while (true) {
+        lockRange(fd, writer ? F_WRLCK : F_RDLCK, LOCK_METADATA, 1, true);
+        bool loaded = loadFAT(archive, fat);
+        uint64_t epoch = fat->committed.epoch;
+        bool registered = !loaded || writer || lockRange(fd, F_RDLCK, LOCK_SNAPSHOTS + epoch, 1, false);
+        lockRange(fd, F_UNLCK, LOCK_METADATA, 1, false);
+        if (!loaded) return false;
+        if (registered) break;
+
+        // Se esta creando el empaquetado de nuevo: se espera a que termine y
+        // se carga lo que confirme
+        freeFAT(fat);
+        lockRange(fd, F_RDLCK, LOCK_SNAPSHOTS + epoch, 1, true);
+        lockRange(fd, F_UNLCK, LOCK_SNAPSHOTS + epoch, 1, false);
+    }
+    if (writer) {
+        fat->deferFrees = true;
+        reclaimPendingBlocks(fat, oldestSnapshot(fd, fat->committed.epoch), false);
+    }
+    return true;
+}
+
+void listArchiveContents(const char* archiveName, bool verbose) {
+		//printf("%s\n", archiveName);
+    FILE* archive = fopen(archiveName, "rb");
+    if (archive == NULL) {
+        fprintf(stderr, "Error opening the packed file.\n");
+        return;
+    }
+
+    FileAllocationTable fat;
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
+
+    printf("Contents of the packaged file:\n");
+    printf("-------------------------------\n");
+
+    for (size_t i = 0; i < fat.numFiles; i++) {
+        FileMetadata* entry = &fat.files[i];
+        if (entry->flags & MEMBER_DELETED) continue;
+        if (entry->flags & MEMBER_DIRECTORY) {
+            printf("%s/\n", entry->fileName);
+            continue;
+        }
+        printf("%s\t%zu bytes\n", entry->fileName, entry->fileSize);
+
+        if (verbose && (entry->flags & MEMBER_COMPRESSED)) {
+            size_t stored = 0;
+            for (size_t k = 0; k < (entry->fileSize + blockSize - 1) / blockSize; k++) {
+                stored += entry->blockLengths[k];
+            }
+            printf("  Compressed: %zu bytes\n", stored);
+        }
+        if (verbose) {
+            printf("  Blocks: ");
+            for (size_t j = 0; j < entry->numExtents; j++) {
+                if (entry->extents[j].start == HOLE_EXTENT) {
+                    printf("hole:%zu ", (size_t)entry->extents[j].length);
+                } else if (entry->extents[j].length == 1) {
+                    printf("%zu ", (size_t)entry->extents[j].start);
+                } else {
+                    printf("%zu-%zu ", (size_t)entry->extents[j].start, (size_t)(entry->extents[j].start + entry->extents[j].length - 1));
+                }
+            }
+            if (entry->tailLength > 0) {
+                printf("%zu+%u:%u", entry->tailBlock, entry->tailOffset, entry->tailLength);
+            }
+            printf("\n");
+        }
+    }
+
+    freeFAT(&fat);
+    fclose(archive);
+}
+
+void writeBlock(FILE* archive, const unsigned char* block, size_t position) {
+    uint64_t start = statsStart();
+    fseek(archive, blockOffset(position), SEEK_SET);
+    fwrite(block, blockSize, 1, archive);
+    statsCall(CALL_WRITE, blockSize);
+    statsPhase(PHASE_BLOCK_WRITE, start, blockSize);
+}
+
+bool writeDataBlock(int fd, const unsigned char* data, size_t position) {
+    uint64_t start = statsStart();
+    bool ok = pwriteFully(fd, data, blockSize, blockOffset(position));
+    statsPhase(PHASE_BLOCK_WRITE, start, blockSize);
+    return ok;
+}
+
+// Elige donde va la region de metadatos con dataBlocks bloques de datos. Se
+// queda donde esta mientras los datos no la alcancen, quepa sin pisar el
+// diario que va detras y el hueco no haya crecido demasiado; si no, va
+// detras de un hueco de 1/8 de los datos que queda disperso, sin solaparse
+// con la region confirmada ni con el diario que se escribe detras de ella.
+size_t placeMetadata(FileAllocationTable* fat, size_t dataBlocks, size_t capacity) {
+    size_t gap = dataBlocks / 8;
+    if (gap < METADATA_GAP_MIN_BYTES / blockSize) gap = METADATA_GAP_MIN_BYTES / blockSize;
+    if (gap == 0) gap = 1;
+    size_t offset = blockOffset(dataBlocks + gap);
+    if (fat->metadataImage == NULL) return offset;
+
+    size_t current = fat->committed.metadataOffset;
+    if (current >= blockOffset(dataBlocks) && current <= blockOffset(dataBlocks + 2 * gap) &&
+        capacity <= fat->committed.metadataCapacity) {
+        return current;
+    }
+    size_t journalEnd = current + fat->committed.metadataCapacity + sizeof(JournalRecord) +
+                        capacity / METADATA_PAGE_SIZE * (sizeof(uint32_t) + METADATA_PAGE_SIZE);
+    if (offset < journalEnd && offset + capacity > current) {
+        offset = blockOffset((journalEnd - HEADER_SIZE + blockSize - 1) / blockSize);
+    }
+    return offset;
+}
+
+// Confirma la region de metadatos `image` (header->metadataCapacity bytes) y
+// la cabecera. Las paginas que cambian van primero al diario, detras de la
+// region confirmada, y solo cuando estan en disco (junto con los bloques de
+// datos ya escritos) se copian a su lugar: una caida deja el estado anterior
+// o, al abrir, se termina de aplicar el nuevo. Los lectores no cargan
+// metadatos mientras tanto. Se queda con `image`.
+bool commitMetadata(FILE* archive, FileAllocationTable* fat, ArchiveHeader* header, unsigned char* image) {
+    int fd = fileno(archive);
+    fflush(archive);
+    lockRange(fd, F_WRLCK, LOCK_METADATA, 1, true);
+    uint64_t start = statsStart();
+    header->epoch = fat->committed.epoch + 1;
+
+    size_t numPages = header->metadataCapacity / METADATA_PAGE_SIZE;
+    bool moved = fat->metadataImage == NULL || header->metadataOffset != fat->committed.metadataOffset;
+    uint32_t* dirty = checkedRealloc(NULL, (numPages ? numPages : 1) * sizeof(uint32_t));
+    size_t numDirty = 0;
+    for (size_t p = 0; p < numPages; p++) {
+        size_t offset = p * (size_t)METADATA_PAGE_SIZE;
+        if (moved || offset + METADATA_PAGE_SIZE > fat->committed.metadataCapacity ||
+            memcmp(image + offset, fat->metadataImage + offset, METADATA_PAGE_SIZE) != 0) {
+            dirty[numDirty++] = (uint32_t)p;
+        }
+    }
+
+    bool ok = true;
+    if (fat->metadataImage != NULL) {
+        size_t recordSize = sizeof(JournalRecord) + numDirty * (sizeof(uint32_t) + METADATA_PAGE_SIZE);
+        unsigned char* buffer = checkedRealloc(NULL, recordSize);
+        JournalRecord* record = (JournalRecord*)buffer;
+        memset(record, 0, sizeof(JournalRecord));
+        memcpy(record->magic, JOURNAL_MAGIC, sizeof(record->magic));
+        record->numPages = (uint32_t)numDirty;
+        record->header = *header;
+        memcpy(buffer + sizeof(JournalRecord), dirty, numDirty * sizeof(uint32_t));
+        unsigned char* pages = buffer + sizeof(JournalRecord) + numDirty * sizeof(uint32_t);
+        for (size_t i = 0; i < numDirty; i++) {
+            memcpy(pages + i * (size_t)METADATA_PAGE_SIZE, image + dirty[i] * (size_t)METADATA_PAGE_SIZE, METADATA_PAGE_SIZE);
+        }
+        record->checksum = crc32c(buffer, recordSize);
+        ok = pwriteFully(fd, buffer, recordSize, fat->committed.metadataOffset + fat->committed.metadataCapacity);
+        statsPhase(PHASE_METADATA_WRITE, start, recordSize);
+        ok = ok && syncFile(fd);
+        free(buffer);
+        start = statsStart();
+    }
+    for (size_t i = 0; i < numDirty && ok; i++) {
+        ok = pwriteFully(fd, image + dirty[i] * (size_t)METADATA_PAGE_SIZE, METADATA_PAGE_SIZE,
+                         header->metadataOffset + dirty[i] * (size_t)METADATA_PAGE_SIZE);
+    }
+    ok = ok && pwriteFully(fd, header, sizeof(ArchiveHeader), 0);
+    statsPhase(PHASE_METADATA_WRITE, start, numDirty * (size_t)METADATA_PAGE_SIZE + sizeof(ArchiveHeader));
+    ok = ok && syncFile(fd);
+    free(dirty);
+    if (!ok) {
+        lockRange(fd, F_UNLCK, LOCK_METADATA, 1, false);
+        fprintf(stderr, "Error writing packed file metadata.\n");
+        free(image);
+        return false;
+    }
+
+    // El archivo termina en la region (sin el registro del diario) y lo que
+    // quede entre los datos y la region vuelve a ser hueco
+    truncateFile(fd, header->metadataOffset + header->metadataCapacity);
+    if (moved && header->metadataOffset > blockOffset(fat->numBlocks)) {
+        punchHole(fd, blockOffset(fat->numBlocks), header->metadataOffset - blockOffset(fat->numBlocks));
+    }
+    lockRange(fd, F_UNLCK, LOCK_METADATA, 1, false);
+    free(fat->metadataImage);
+    fat->metadataImage = image;
+    fat->committed = *header;
+    return true;
+}
+
+// Los bloques de datos no pueden llegar a la region de metadatos confirmada:
+// antes de crecer hasta `blocks` se mueve mas adelante.
+void ensureDataSpace(FILE* archive, FileAllocationTable* fat, size_t blocks) {
+    if (fat->metadataImage == NULL || blockOffset(blocks) <= fat->committed.metadataOffset) return;
+
+    ArchiveHeader header = fat->committed;
+    header.metadataOffset = placeMetadata(fat, blocks, header.metadataCapacity);
+    unsigned char* image = checkedRealloc(NULL, header.metadataCapacity ? header.metadataCapacity : 1);
+    memcpy(image, fat->metadataImage, header.metadataCapacity);
+    if (!commitMetadata(archive, fat, &header, image)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Los bloques de fragmentos de esta operacion ya estan completos en disco:
+// se calcula su CRC32C leyendolos enteros, o se liberan si quedaron vacios.
+void finishTailBlocks(FILE* archive, FileAllocationTable* fat) {
+    if (fat->numTailBlocks == 0) return;
+    fflush(archive);
+    unsigned char* buffer = allocBlocks(1);
+    for (size_t i = 0; i < fat->numTailBlocks; i++) {
+        size_t block = fat->tailBlocks[i];
+        if (fat->fragmentBytes[block] == 0) {
+            freeBlockRange(fat, block, 1);
+        } else if (preadFully(fileno(archive), buffer, blockSize, blockOffset(block))) {
+            fat->blockChecksums[block] = crc32c(buffer, blockSize);
+        } else {
+            fprintf(stderr, "Error reading block %zu of the packed file.\n", block);
+        }
+    }
+    free(buffer);
+    fat->numTailBlocks = 0;
+    fat->tailFill = 0;
+}
+
+// Devuelve al sistema de archivos los bloques libres que todavia ocupan
+// espacio. Va despues de confirmar: hasta entonces la foto anterior puede
+// usarlos. Una caida entre medio solo deja espacio sin devolver.
+void punchFreeBlocks(int fd, FileAllocationTable* fat) {
+    uint8_t* marks = fat->unpunchedBlocks;
+    size_t block = 0;
+    while (marks != NULL && block < fat->numBlocks) {
+        uint8_t* found = memchr(marks + block, 1, fat->numBlocks - block);
+        if (found == NULL) break;
+        block = found - marks;
+        size_t run = block;
+        while (run < fat->numBlocks && marks[run]) run++;
+        punchHole(fd, blockOffset(block), (run - block) * blockSize);
+        memset(marks + block, 0, run - block);
+        block = run;
+    }
+}
+
+// Escribe los metadatos por secciones y confirma solo las paginas que
+// cambian. Cada seccion conserva su lugar mientras quepa en el margen que
+// tiene; si alguna no cabe se distribuye todo de nuevo con un 25% de margen
+// (y al menos una pagina).
+void writeFAT(FILE* archive, FileAllocationTable* fat) {
+    int fd = fileno(archive);
+    finishTailBlocks(archive, fat);
+    // Con los metadatos tomados ningun lector nuevo carga la foto anterior: lo
+    // liberado en esta operacion que no tiene lectores vuelve al espacio libre
+    // ya en esta confirmacion
+    lockRange(fd, F_WRLCK, LOCK_METADATA, 1, true);
+    for (size_t i = 0; i < fat->numPending; i++) {
+        if (fat->pending[i].epoch == PENDING_THIS_OPERATION) fat->pending[i].epoch = fat->committed.epoch;
+    }
+    if (fat->deferFrees) reclaimPendingBlocks(fat, oldestSnapshot(fd, fat->committed.epoch), false);
+    size_t dataEnd = fat->numBlocks > fat->committed.numBlocks ? fat->numBlocks : fat->committed.numBlocks;
+    trimFreeTail(fat);
+    uint64_t start = statsStart();
+    compactMembers(fat);
+    if (fat->indexCapacity == 0) {
+        rebuildNameIndex(fat, 64);
+    }
+
+    size_t membersBytes = 0;
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        FileMetadata* entry = &fat->files[i];
+        membersBytes += sizeof(MemberRecord) + strlen(entry->fileName) + entry->numExtents * sizeof(Extent);
+        if (entry->flags & MEMBER_COMPRESSED) {
+            membersBytes += (entry->fileSize + blockSize - 1) / blockSize * sizeof(uint32_t);
+        }
+    }
+    size_t freeBytes = fat->numFreeExtents * sizeof(Extent);
+    size_t indexBytes = fat->indexCapacity * sizeof(uint32_t);
+    size_t checksumBytes = fat->numBlocks * sizeof(uint32_t);
+    size_t hashBytes = storesBlockHashes(fat->flags) ? fat->numBlocks * sizeof(uint64_t) : 0;
+    size_t pendingBytes = fat->numPending * sizeof(PendingExtent);
+
+    ArchiveHeader header = fat->committed;
+    bool fits = fat->metadataImage != NULL && membersBytes <= header.freeOffset &&
+                freeBytes <= header.indexOffset - header.freeOffset &&
+                indexBytes <= header.checksumOffset - header.indexOffset &&
+                checksumBytes <= header.hashOffset - header.checksumOffset &&
+                hashBytes <= header.pendingOffset - header.hashOffset &&
+                pendingBytes <= header.metadataCapacity - header.pendingOffset;
+    if (!fits) {
+        header.freeOffset = roundToPage(membersBytes + membersBytes / 4 + 1);
+        header.indexOffset = header.freeOffset + roundToPage(freeBytes + freeBytes / 4 + 1);
+        header.checksumOffset = header.indexOffset + roundToPage(indexBytes);
+        header.hashOffset = header.checksumOffset + roundToPage(checksumBytes + checksumBytes / 4 + 1);
+        header.pendingOffset = header.hashOffset + (hashBytes > 0 ? roundToPage(hashBytes + hashBytes / 4 + 1) : 0);
+        header.metadataCapacity = header.pendingOffset + (pendingBytes > 0 ? roundToPage(pendingBytes + pendingBytes / 4 + 1) : 0);
+    }
+
+    unsigned char* buffer = calloc(header.metadataCapacity ? header.metadataCapacity : 1, 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        FileMetadata* entry = &fat->files[i];
+        MemberRecord record = { entry->fileSize, (uint32_t)strlen(entry->fileName), (uint32_t)entry->numExtents, entry->flags,
+                                entry->tailLength, entry->tailLength ? entry->tailBlock : 0, entry->tailOffset, 0 };
+        memcpy(buffer + pos, &record, sizeof(MemberRecord));
+        pos += sizeof(MemberRecord);
+        memcpy(buffer + pos, entry->fileName, record.nameLength);
+        pos += record.nameLength;
+        // Los miembros vacios no tienen tramos ni longitudes: su puntero es NULL
+        if (entry->numExtents > 0) memcpy(buffer + pos, entry->extents, entry->numExtents * sizeof(Extent));
+        pos += entry->numExtents * sizeof(Extent);
+        if (entry->flags & MEMBER_COMPRESSED) {
+            size_t lengthBytes = (entry->fileSize + blockSize - 1) / blockSize * sizeof(uint32_t);
+            if (lengthBytes > 0) memcpy(buffer + pos, entry->blockLengths, lengthBytes);
+            pos += lengthBytes;
+        }
+    }
+    size_t numFreeExtents = 0;
+    collectFreeExtents(fat->freeRoot, buffer + header.freeOffset, &numFreeExtents);
+    if (indexBytes > 0) memcpy(buffer + header.indexOffset, fat->nameIndex, indexBytes);
+    if (checksumBytes > 0) memcpy(buffer + header.checksumOffset, fat->blockChecksums, checksumBytes);
+    if (hashBytes > 0) memcpy(buffer + header.hashOffset, fat->blockHashes, hashBytes);
+    if (pendingBytes > 0) memcpy(buffer + header.pendingOffset, fat->pending, pendingBytes);
+
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = ARCHIVE_VERSION;
+    header.blockSize = blockSize;
+    header.flags = fat->flags;
+    header.dataOffset = HEADER_SIZE;
+    header.numBlocks = fat->numBlocks;
+    header.numFiles = fat->numFiles;
+    header.numFreeExtents = fat->numFreeExtents;
+    header.numPendingExtents = fat->numPending;
+    header.metadataSize = header.pendingOffset + pendingBytes;
+    header.indexCapacity = fat->indexCapacity;
+    header.metadataOffset = placeMetadata(fat, fat->numBlocks, header.metadataCapacity);
+    statsPhase(PHASE_METADATA_WRITE, start, 0);
+
+    // Desde aqui los bloques de esta operacion estan en la foto nueva
+    if (!commitMetadata(archive, fat, &header, buffer)) return;
+    if (fat->newBlocks != NULL) memset(fat->newBlocks, 0, fat->blockTableCapacity);
+
+    // Lo que quedo fuera de la zona de datos, hasta los metadatos (si estos
+    // se movieron, commitMetadata ya acorto el archivo)
+    size_t end = blockOffset(dataEnd) < header.metadataOffset ? blockOffset(dataEnd) : header.metadataOffset;
+    if (end > blockOffset(fat->numBlocks)) punchHole(fd, blockOffset(fat->numBlocks), end - blockOffset(fat->numBlocks));
+    punchFreeBlocks(fd, fat);
+}
+
+// Agranda el archivo en bloques grandes (al menos minBlocks, 16 MB o 1/8 del
+// tamano actual) para no pagar un fallocate por cada bloque escrito.
+void expandArchive(FILE* archive, FileAllocationTable* fat, size_t minBlocks) {
+    size_t growth = fat->numBlocks / 8;
+    if (growth < GROWTH_CHUNK_BYTES / blockSize) growth = GROWTH_CHUNK_BYTES / blockSize;
+    if (growth < minBlocks) growth = minBlocks;
+
+    // Mientras quede hueco antes de los metadatos se crece dentro de el
+    if (fat->metadataImage != NULL) {
+        size_t room = (fat->committed.metadataOffset - HEADER_SIZE) / blockSize;
+        if (fat->numBlocks + growth > room && fat->numBlocks + minBlocks <= room) growth = room - fat->numBlocks;
+    }
+    ensureDataSpace(archive, fat, fat->numBlocks + growth);
+
+    size_t oldBlocks = fat->numBlocks;
+    fat->numBlocks += growth;
+    fflush(archive);
+    struct stat st;
+    uint64_t start = statsStart();
+    int allocated = fallocate(fileno(archive), 0, blockOffset(oldBlocks), growth * blockSize);
+    statsCall(CALL_FALLOCATE, 0);
+    if (allocated != 0 && fstat(fileno(archive), &st) == 0 && (size_t)st.st_size < blockOffset(fat->numBlocks)) {
+        ftruncate(fileno(archive), blockOffset(fat->numBlocks));
+        statsCall(CALL_FTRUNCATE, 0);
+    }
+    statsPhase(PHASE_ALLOCATOR, start, growth * blockSize);
+    ensureBlockTables(fat);
+    freeBlockRange(fat, oldBlocks, growth);
+}
+
+// Devuelve el siguiente bloque de la reserva, pidiendo `wanted` bloques mas al
+// asignador (y agrandando el archivo si no hay espacio) cuando se agota.
+size_t nextReservedBlock(FILE* archive, FileAllocationTable* fat, BlockReservation* reservation, size_t wanted, bool veryVerbose) {
+    if (reservation->remaining == 0) {
+        if (wanted == 0) wanted = 1;
+        reservation->remaining = reserveBlocks(fat, wanted, &reservation->next);
+        if (reservation->remaining == 0) {
+            if (veryVerbose) {
+                printf("No free blocks, expanding the file\n");
+            }
+            expandArchive(archive, fat, wanted);
+            reservation->remaining = reserveBlocks(fat, wanted, &reservation->next);
+        }
+    }
+    reservation->remaining--;
+    return reservation->next++;
+}
+
+void releaseReservation(FileAllocationTable* fat, BlockReservation* reservation) {
+    freeBlockRange(fat, reservation->next, reservation->remaining);
+    reservation->remaining = 0;
+}
+
+// Las colas cortas se empaquetan juntas salvo en empaquetados comprimidos o
+// deduplicados, que guardan sus bloques de otra forma.
+size_t packedTailLength(FileAllocationTable* fat, size_t size) {
+    if (fat->flags & (ARCHIVE_COMPRESSED | ARCHIVE_DEDUP)) return 0;
+    size_t tail = size % blockSize;
+    return tail <= TAIL_PACK_LIMIT ? tail : 0;
+}
+
+// Ubica los ultimos `length` bytes del miembro en el bloque de fragmentos
+// abierto, o en uno nuevo si no caben. Los bloques de fragmentos que ya
+// estaban confirmados no se reescriben.
+void placeTail(FILE* archive, FileAllocationTable* fat, FileMetadata* entry, size_t length, bool veryVerbose) {
+    if (fat->numTailBlocks == 0 || fat->tailFill + length > blockSize) {
+        BlockReservation reservation = {0, 0};
+        size_t block = nextReservedBlock(archive, fat, &reservation, 1, veryVerbose);
+        if (fat->numTailBlocks == fat->tailBlockCapacity) {
+            fat->tailBlockCapacity = fat->tailBlockCapacity ? fat->tailBlockCapacity * 2 : 16;
+            fat->tailBlocks = checkedRealloc(fat->tailBlocks, fat->tailBlockCapacity * sizeof(size_t));
+        }
+        fat->tailBlocks[fat->numTailBlocks++] = block;
+        fat->tailFill = 0;
+    }
+    entry->tailBlock = fat->tailBlocks[fat->numTailBlocks - 1];
+    entry->tailOffset = (uint32_t)fat->tailFill;
+    entry->tailLength = (uint32_t)length;
+    fat->tailFill += length;
+    fat->fragmentBytes[entry->tailBlock] += length;
+}
+
+// Lee hasta length bytes de un descriptor secuencial (archivo, tuberia o stdin).
+ssize_t readUpTo(int fd, void* buffer, size_t length) {
+    unsigned char* p = buffer;
+    size_t total = 0;
+    while (total < length) {
+        ssize_t done = read(fd, p + total, length - total);
+        statsCall(CALL_READ, done);
+        if (done < 0 && errno == EINTR) continue;
+        if (done < 0) return -1;
+        if (done == 0) break;
+        total += done;
+    }
+    return total;
+}
+
+uint32_t lzRead32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+size_t lzHash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Longitud larga: el token guarda 15 y el resto va en bytes de 255 mas uno final.
+bool lzPutLength(unsigned char* dst, size_t* op, size_t capacity, size_t length) {
+    while (length >= 255) {
+        if (*op >= capacity) return false;
+        dst[(*op)++] = 255;
+        length -= 255;
+    }
+    if (*op >= capacity) return false;
+    dst[(*op)++] = (unsigned char)length;
+    return true;
+}
+
+// Escribe una secuencia: token, literales, desplazamiento y largo de la
+// coincidencia. Con matchLength 0 es la secuencia final, solo con literales.
+bool lzEmit(unsigned char* dst, size_t* op, size_t capacity, const unsigned char* literals, size_t numLiterals, size_t offset, size_t matchLength) {
+    if (*op >= capacity) return false;
+    size_t token = (*op)++;
+    size_t literalCode = numLiterals < 15 ? numLiterals : 15;
+    size_t matchCode = 0;
+    if (matchLength > 0) {
+        matchCode = matchLength - LZ_MIN_MATCH < 15 ? matchLength - LZ_MIN_MATCH : 15;
+    }
+    dst[token] = (unsigned char)(literalCode << 4 | matchCode);
+    if (literalCode == 15 && !lzPutLength(dst, op, capacity, numLiterals - 15)) return false;
+    if (*op + numLiterals > capacity) return false;
+    memcpy(dst + *op, literals, numLiterals);
+    *op += numLiterals;
+    if (matchLength == 0) return true;
+
+    if (*op + 2 > capacity) return false;
+    dst[(*op)++] = offset & 0xff;
+    dst[(*op)++] = offset >> 8;
+    return matchCode < 15 || lzPutLength(dst, op, capacity, matchLength - LZ_MIN_MATCH - 15);
+}
+
+// Compresor LZ77 sencillo con el formato de secuencias de LZ4: busca
+// coincidencias de 4 bytes con una tabla hash y se salta mas rapido los datos
+// que no se comprimen. Devuelve 0 si el resultado no cabe en capacity.
+size_t lzCompress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t op = 0;
+    size_t anchor = 0;
+
+    // Los ultimos bytes quedan siempre como literales
+    if (size > 12) {
+        size_t limit = size - 12;
+        size_t matchLimit = size - 5;
+        size_t misses = 0;
+        size_t ip = 0;
+        while (ip < limit) {
+            uint32_t sequence = lzRead32(src + ip);
+            size_t h = lzHash(sequence);
+            size_t candidate = table[h];
+            table[h] = ip;
+            if (candidate < ip && ip - candidate <= LZ_MAX_OFFSET && lzRead32(src + candidate) == sequence) {
+                size_t length = LZ_MIN_MATCH;
+                while (ip + length < matchLimit && src[candidate + length] == src[ip + length]) length++;
+                if (!lzEmit(dst, &op, capacity, src + anchor, ip - anchor, ip - candidate, length)) return 0;
+                ip += length;
+                anchor = ip;
+                misses = 0;
+            } else {
+                ip += 1 + (misses++ >> 6);
+            }
+        }
+    }
+    if (!lzEmit(dst, &op, capacity, src + anchor, size - anchor, 0, 0)) return 0;
+    return op;
+}
+
+// Abre el archivo externo del miembro la primera vez que un tramo lo necesita
+// y devuelve tambien su tamano vigente.
+int openMemberFile(CopyJob* job, size_t member, size_t* size) {
+    FileMetadata* entry = &job->fat->files[member];
+    MemberFile* file = &job->files[member];
+
+    pthread_mutex_lock(&job->lock);
+    if (file->fd == -1) {
+        if (job->packing) {
+            file->fd = openDirect(entry->fileName, O_RDONLY, 0);
+            if (file->fd < 0) {
+                fprintf(stderr, "Error opening input file: %s\n", entry->fileName);
+            }
+        } else {
+            file->fd = openDirect(entry->fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (file->fd < 0) {
+                fprintf(stderr, "Error creating output file: %s\n", entry->fileName);
+            } else if (job->verbose) {
+                printf("Extracting file: %s\n", entry->fileName);
+            }
+        }
+        if (file->fd < 0) file->fd = -2;
+    }
+    int fd = file->fd;
+    *size = file->size;
+    pthread_mutex_unlock(&job->lock);
+    return fd;
+}
+
+void initIoShared(IoShared* shared, bool useUring) {
+    shared->useUring = useUring;
+    // copy_file_range pasa por la cache de paginas: con --direct no se usa
+    shared->direct = directIo;
+    atomic_init(&shared->useCopyFileRange, !directIo);
+    shared->mapFd = -1;
+    shared->map = NULL;
+    shared->mapSize = 0;
+}
+
+bool ioRingInit(IoRing* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(IoRing));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return false;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap && ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return false;
+    }
+    if (singleMmap) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(ring->fd);
+            return false;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!singleMmap) munmap(ring->cqRing, ring->cqRingSize);
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return false;
+    }
+
+    unsigned char* sq = ring->sqRing;
+    unsigned char* cq = ring->cqRing;
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void ioRingDestroy(IoRing* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Prepara una lectura o escritura; se envian todas juntas en ioRingSubmit.
+void ioRingPrepare(IoEngine* engine, bool write, int fd, void* buffer, size_t length, size_t offset, unsigned slot, uint64_t userData) {
+    IoRing* ring = &engine->ring;
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (engine->fixedBuffers) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+bool ioRingSubmit(IoRing* ring, unsigned waitFor) {
+    while (true) {
+        int done = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        statsCall(CALL_IO_URING_ENTER, 0);
+        if (done < 0 && errno == EINTR) continue;
+        if (done < 0) return false;
+        ring->toSubmit -= done;
+        return true;
+    }
+}
+
+// Despues de un error al enviar: descarta lo preparado que no llego al kernel
+// y espera lo que ya esta en vuelo, que todavia usa los buffers de la cola.
+void ioRingDrain(IoRing* ring, unsigned inFlight) {
+    __atomic_store_n(ring->sqTail, *ring->sqTail - ring->toSubmit, __ATOMIC_RELEASE);
+    inFlight -= ring->toSubmit;
+    ring->toSubmit = 0;
+    while (true) {
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        inFlight -= tail - head;
+        __atomic_store_n(ring->cqHead, tail, __ATOMIC_RELEASE);
+        if (inFlight == 0) return;
+        if (!ioRingSubmit(ring, 1)) {
+            fprintf(stderr, "Error waiting for io_uring operations.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void initIoEngine(IoEngine* engine, IoShared* shared) {
+    memset(engine, 0, sizeof(IoEngine));
+    engine->shared = shared;
+    engine->cachedBlock = SIZE_MAX;
+
+    if (shared->useUring && ioRingInit(&engine->ring, URING_QUEUE_DEPTH)) {
+        engine->buffers = allocBlocks(URING_QUEUE_DEPTH);
+        // Un buffer registrado por casilla de la cola; si el kernel no deja
+        // registrarlos (limite de memoria bloqueada) se usan lecturas normales.
+        struct iovec iovecs[URING_QUEUE_DEPTH];
+        for (unsigned i = 0; i < URING_QUEUE_DEPTH; i++) {
+            iovecs[i].iov_base = engine->buffers + i * blockSize;
+            iovecs[i].iov_len = blockSize;
+        }
+        engine->fixedBuffers = syscall(__NR_io_uring_register, engine->ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_QUEUE_DEPTH) == 0;
+        engine->uring = true;
+        return;
+    }
+    engine->buffers = allocBlocks(copyBufferBlocks());
+}
+
+void destroyIoEngine(IoEngine* engine) {
+    if (engine->uring) ioRingDestroy(&engine->ring);
+    free(engine->buffers);
+    free(engine->scratch);
+}
+
+// Indica si el kernel permite crear anillos io_uring (puede estar deshabilitado).
+bool ioUringAvailable(void) {
+    IoRing ring;
+    if (!ioRingInit(&ring, 1)) return false;
+    ioRingDestroy(&ring);
+    return true;
+}
+
+// Copia length bytes de srcFd a dstFd. Prefiere copy_file_range, que mueve los
+// datos dentro del kernel; si el sistema de archivos no lo soporta, escribe
+// desde la vista mmap del empaquetado o, en ultimo caso, pasa por el buffer
+// del hilo. Devuelve los bytes copiados (menos si el origen se acaba) o -1.
+ssize_t copyRangeUntimed(IoEngine* engine, int srcFd, size_t srcOffset, int dstFd, size_t dstOffset, size_t length) {
+    IoShared* shared = engine->shared;
+    size_t total = 0;
+
+    if (atomic_load(&shared->useCopyFileRange)) {
+        while (total < length) {
+            loff_t in = srcOffset + total;
+            loff_t out = dstOffset + total;
+            ssize_t done = copy_file_range(srcFd, &in, dstFd, &out, length - total, 0);
+            statsCall(CALL_COPY_FILE_RANGE, done);
+            if (done < 0 && errno == EINTR) continue;
+            if (done < 0 && total == 0 &&
+                (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADF)) {
+                atomic_store(&shared->useCopyFileRange, false);
+                break;
+            }
+            if (done < 0) return -1;
+            if (done == 0) return total;
+            total += done;
+        }
+        if (total == length) return total;
+    }
+
+    if (shared->map != NULL && srcFd == shared->mapFd && srcOffset + length <= shared->mapSize) {
+        return pwriteFully(dstFd, shared->map + srcOffset, length, dstOffset) ? (ssize_t)length : -1;
+    }
+
+    while (total < length) {
+        size_t chunk = length - total;
+        if (chunk > copyBufferBlocks() * blockSize) chunk = copyBufferBlocks() * blockSize;
+        ssize_t got = preadUpTo(srcFd, engine->buffers, chunk, srcOffset + total);
+        if (got < 0) return -1;
+        if (got > 0 && !pwriteFully(dstFd, engine->buffers, got, dstOffset + total)) return -1;
+        total += got;
+        if ((size_t)got < chunk) break;
+    }
+    return total;
+}
+
+ssize_t copyRange(IoEngine* engine, int srcFd, size_t srcOffset, int dstFd, size_t dstOffset, size_t length) {
+    uint64_t start = statsStart();
+    ssize_t copied = copyRangeUntimed(engine, srcFd, srcOffset, dstFd, dstOffset, length);
+    statsPhase(PHASE_BLOCK_WRITE, start, copied);
+    return copied;
+}
+
+// Guarda el CRC32C y la huella de un bloque que se va a escribir. Con -u, si
+// el bloque ya estaba confirmado y ambos coinciden devuelve true: no hay que
+// escribirlo. Los reservados en esta operacion no tienen nada que comparar.
+bool storeBlockSums(CopyOp* op, size_t block, const unsigned char* data) {
+    uint32_t checksum = crc32c(data, blockSize);
+    if (op->hashes == NULL) {
+        op->checksums[block] = checksum;
+        return false;
+    }
+    uint64_t hash = hashBlock(data, blockSize);
+    bool same = op->cow != NULL && !op->cow->fat->newBlocks[(op->dstOffset - HEADER_SIZE) / blockSize + block] &&
+                op->checksums[block] == checksum && op->hashes[block] == hash;
+    op->checksums[block] = checksum;
+    op->hashes[block] = hash;
+    return same;
+}
+
+// Bloque del empaquetado donde se escriben hasta count bloques de la copia
+// desde block; en *run quedan cuantos van seguidos alli. Sin -u, o si se
+// reservaron en esta operacion, es su lugar; si no, bloques nuevos que se
+// llevan el CRC y la huella recien calculados.
+size_t writePosition(CopyOp* op, size_t block, size_t count, size_t* run) {
+    size_t position = (op->dstOffset - HEADER_SIZE) / blockSize + block;
+    CopyOnWrite* cow = op->cow;
+    *run = count;
+    if (cow == NULL) return position;
+    FileAllocationTable* fat = cow->fat;
+    bool fresh = fat->newBlocks[position];
+    size_t length = 1;
+    while (length < count && fat->newBlocks[position + length] == fresh) length++;
+    *run = length;
+    if (fresh) return position;
+
+    pthread_mutex_lock(cow->lock);
+    size_t target;
+    size_t granted = reserveBlocks(fat, length, &target);
+    if (granted == 0) {
+        if (fat->numBlocks + length > cow->limit) {
+            fprintf(stderr, "Out of reserved blocks.\n");
+            exit(EXIT_FAILURE);
+        }
+        target = fat->numBlocks;
+        granted = length;
+        fat->numBlocks += length;
+        memset(fat->newBlocks + target, 1, length);
+    }
+    pthread_mutex_unlock(cow->lock);
+    for (size_t i = 0; i < granted; i++) {
+        cow->remap[position + i] = target + i;
+        fat->blockChecksums[target + i] = op->checksums[block + i];
+        if (op->hashes != NULL) fat->blockHashes[target + i] = op->hashes[block + i];
+    }
+    *run = granted;
+    return target;
+}
+
+// Escribe count bloques de la copia desde block donde diga writePosition.
+bool writeBlocks(CopyOp* op, const unsigned char* data, size_t block, size_t count) {
+    while (count > 0) {
+        size_t run;
+        size_t position = writePosition(op, block, count, &run);
+        if (!pwriteFully(op->dstFd, data, run * blockSize, blockOffset(position))) return false;
+        data += run * blockSize;
+        block += run;
+        count -= run;
+    }
+    return true;
+}
+
+// Copia con CRC32C: los datos pasan por el buffer del hilo (o se leen de la
+// vista mmap) para calcular o comprobar el CRC de cada bloque entero. Al
+// empaquetar hay que mirar cada bloque de todos modos (CRC, huella, ceros y
+// -u), asi que no se usa copy_file_range; al extraer desde la vista se
+// escribe directamente lo que se acaba de comprobar.
+void copyChecked(IoEngine* engine, CopyOp* op) {
+    IoShared* shared = engine->shared;
+    size_t total = 0;
+    op->copied = -1;
+    op->unchanged = 0;
+    while (total < op->length) {
+        size_t chunk = op->length - total;
+        if (chunk > copyBufferBlocks() * blockSize) chunk = copyBufferBlocks() * blockSize;
+        size_t firstBlock = total / blockSize;
+
+        uint64_t start = statsStart();
+        if (op->padBlock) {
+            // Los huecos del origen no se leen: son bloques de ceros
+            size_t hole = op->zeroBlocks != NULL ? sourceHole(op->srcFd, op->srcOffset + total, chunk) : 0;
+            if (hole > 0) {
+                memset(op->zeroBlocks + firstBlock, 1, (hole + blockSize - 1) / blockSize);
+                total += hole;
+                if (hole < chunk && hole % blockSize != 0) break;
+                continue;
+            }
+            ssize_t got = preadUpTo(op->srcFd, engine->buffers, directLength(shared, chunk), op->srcOffset + total);
+            statsPhase(PHASE_INPUT_READ, start, got);
+            if (got < 0) return;
+            if (got == 0) break;
+            if ((size_t)got > chunk) got = chunk;
+            start = statsStart();
+            size_t padded = ((size_t)got + blockSize - 1) / blockSize * blockSize;
+            memset(engine->buffers + got, 0, padded - got);
+            // Se escriben las series de bloques con datos; los de ceros se
+            // marcan y los que no cambiaron (-u) se dejan como estan
+            bool written = true;
+            size_t run = 0;
+            for (size_t b = 0; b <= padded / blockSize; b++) {
+                const unsigned char* data = engine->buffers + b * blockSize;
+                bool zero = b < padded / blockSize && op->zeroBlocks != NULL && isZeroBlock(data, blockSize);
+                bool same = false;
+                if (b < padded / blockSize && !zero) {
+                    same = storeBlockSums(op, firstBlock + b, data);
+                    if (!same) continue;
+                }
+                if (b > run) {
+                    written = written && writeBlocks(op, engine->buffers + run * blockSize, firstBlock + run, b - run);
+                }
+                if (zero) op->zeroBlocks[firstBlock + b] = 1;
+                if (same) op->unchanged++;
+                run = b + 1;
+            }
+            statsPhase(PHASE_BLOCK_WRITE, start, padded);
+            if (!written) return;
+            total += got;
+            if ((size_t)got < chunk) break;
+            continue;
+        }
+
+        size_t readLength = (chunk + blockSize - 1) / blockSize * blockSize;
+        const unsigned char* data = engine->buffers;
+        if (shared->map != NULL && op->srcFd == shared->mapFd && op->srcOffset + total + readLength <= shared->mapSize) {
+            data = shared->map + op->srcOffset + total;
+        } else if (!preadFully(op->srcFd, engine->buffers, readLength, op->srcOffset + total)) {
+            return;
+        }
+        for (size_t b = 0; b < readLength / blockSize; b++) {
+            if (crc32c(data + b * blockSize, blockSize) != op->checksums[firstBlock + b] && op->corrupt == SIZE_MAX) {
+                op->corrupt = firstBlock + b;
+            }
+        }
+        statsPhase(PHASE_INPUT_READ, start, readLength);
+        // Desde la vista se escriben las mismas paginas que se acaban de
+        // comprobar, sin volver a leerlas con copy_file_range
+        start = statsStart();
+        bool written = pwriteFully(op->dstFd, data, data == engine->buffers ? directLength(shared, chunk) : chunk,
+                                   op->dstOffset + total);
+        statsPhase(PHASE_BLOCK_WRITE, start, chunk);
+        if (!written) return;
+        total += chunk;
+    }
+    op->copied = total;
+}
+
+void ioCopySync(IoEngine* engine, CopyOp* ops, size_t numOps) {
+    for (size_t i = 0; i < numOps; i++) {
+        CopyOp* op = &ops[i];
+        op->corrupt = SIZE_MAX;
+        if (op->checksums != NULL) {
+            copyChecked(engine, op);
+            continue;
+        }
+        // Sin CRC solo se mueven bloques enteros dentro del empaquetado
+        op->copied = copyRange(engine, op->srcFd, op->srcOffset, op->dstFd, op->dstOffset, op->length);
+    }
+}
+
+// Estado de una casilla de la cola: un bloque de una operacion que se lee en
+// su buffer y despues se escribe desde el mismo buffer.
+typedef struct {
+    size_t op;
+    size_t chunkOffset;
+    size_t chunkLength;
+    size_t readLength; // Al extraer con CRC se lee el bloque entero
+    size_t done;
+    size_t got;
+    size_t writeLength;
+    size_t writeOffset;
+    bool writing;
+} IoSlot;
+
+// Mantiene hasta URING_QUEUE_DEPTH bloques en vuelo: cada lectura terminada
+// encadena la escritura de su buffer, y las nuevas lecturas se envian en lote.
+void ioCopyUring(IoEngine* engine, CopyOp* ops, size_t numOps) {
+    IoSlot slots[URING_QUEUE_DEPTH];
+    unsigned freeSlots[URING_QUEUE_DEPTH];
+    unsigned numFree = URING_QUEUE_DEPTH;
+    for (unsigned i = 0; i < URING_QUEUE_DEPTH; i++) {
+        freeSlots[i] = URING_QUEUE_DEPTH - 1 - i;
+    }
+    for (size_t i = 0; i < numOps; i++) {
+        ops[i].copied = ops[i].length;
+        ops[i].corrupt = SIZE_MAX;
+        ops[i].unchanged = 0;
+    }
+
+    size_t nextOp = 0;
+    size_t nextOffset = 0;
+    unsigned inFlight = 0;
+    while (true) {
+        while (numFree > 0 && nextOp < numOps) {
+            CopyOp* op = &ops[nextOp];
+            if (op->length == 0) {
+                nextOp++;
+                continue;
+            }
+            unsigned slot = freeSlots[--numFree];
+            IoSlot* state = &slots[slot];
+            state->op = nextOp;
+            state->chunkOffset = nextOffset;
+            state->chunkLength = op->length - nextOffset < blockSize ? op->length - nextOffset : blockSize;
+            state->readLength = op->checksums != NULL && !op->padBlock ? blockSize : directLength(engine->shared, state->chunkLength);
+            state->done = 0;
+            state->writing = false;
+            ioRingPrepare(engine, false, op->srcFd, engine->buffers + slot * blockSize, state->readLength,
+                          op->srcOffset + nextOffset, slot, slot);
+            inFlight++;
+
+            nextOffset += state->chunkLength;
+            if (nextOffset >= op->length) {
+                nextOp++;
+                nextOffset = 0;
+            }
+        }
+        if (inFlight == 0) break;
+
+        if (!ioRingSubmit(&engine->ring, 1)) {
+            ioRingDrain(&engine->ring, inFlight);
+            for (size_t i = 0; i < numOps; i++) ops[i].copied = -1;
+            return;
+        }
+
+        IoRing* ring = &engine->ring;
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            unsigned slot = (unsigned)cqe->user_data;
+            int result = cqe->res;
+            IoSlot* state = &slots[slot];
+            CopyOp* op = &ops[state->op];
+            unsigned char* buffer = engine->buffers + slot * blockSize;
+            bool finished = false;
+
+            if (result == -EAGAIN || result == -EINTR) {
+                // Se vuelve a pedir lo mismo desde donde iba
+                if (state->writing) {
+                    ioRingPrepare(engine, true, op->dstFd, buffer + state->done, state->writeLength - state->done,
+                                  state->writeOffset + state->done, slot, slot);
+                } else {
+                    ioRingPrepare(engine, false, op->srcFd, buffer + state->done, state->readLength - state->done,
+                                  op->srcOffset + state->chunkOffset + state->done, slot, slot);
+                }
+                continue;
+            }
+            if (result < 0) {
+                op->copied = -1;
+                finished = true;
+            }
+
+            if (!finished && !state->writing) {
+                statsPhase(PHASE_INPUT_READ, 0, result);
+                state->done += result;
+                if (result > 0 && state->done < state->readLength) {
+                    ioRingPrepare(engine, false, op->srcFd, buffer + state->done, state->readLength - state->done,
+                                  op->srcOffset + state->chunkOffset + state->done, slot, slot);
+                    continue;
+                }
+                // Lectura completa (o fin del origen): escribir lo leido
+                state->got = state->done;
+                size_t usable = state->got < state->chunkLength ? state->got : state->chunkLength;
+                if (usable < state->chunkLength && op->copied >= 0 && state->chunkOffset + usable < (size_t)op->copied) {
+                    op->copied = state->chunkOffset + usable;
+                }
+                state->writeLength = op->padBlock ? usable : directLength(engine->shared, usable);
+                if (op->padBlock && state->got > state->chunkLength) state->got = state->chunkLength;
+                if (op->padBlock && state->got % blockSize != 0) {
+                    state->writeLength = state->got + (blockSize - state->got % blockSize);
+                    memset(buffer + state->got, 0, state->writeLength - state->got);
+                }
+                if (op->zeroBlocks != NULL && state->writeLength > 0 && isZeroBlock(buffer, state->writeLength)) {
+                    op->zeroBlocks[state->chunkOffset / blockSize] = 1;
+                    state->writeLength = 0;
+                }
+                if (op->checksums != NULL) {
+                    uint32_t* checksum = &op->checksums[state->chunkOffset / blockSize];
+                    if (op->padBlock && state->writeLength > 0) {
+                        if (storeBlockSums(op, state->chunkOffset / blockSize, buffer)) {
+                            op->unchanged++;
+                            state->writeLength = 0;
+                        }
+                    } else if (!op->padBlock && state->got == blockSize && crc32c(buffer, blockSize) != *checksum &&
+                               state->chunkOffset / blockSize < op->corrupt) {
+                        op->corrupt = state->chunkOffset / blockSize;
+                    }
+                }
+                state->writeOffset = op->dstOffset + state->chunkOffset;
+                if (op->cow != NULL && state->writeLength > 0) {
+                    size_t run;
+                    state->writeOffset = blockOffset(writePosition(op, state->chunkOffset / blockSize, 1, &run));
+                }
+                if (state->writeLength == 0) {
+                    finished = true;
+                } else {
+                    state->writing = true;
+                    state->done = 0;
+                    ioRingPrepare(engine, true, op->dstFd, buffer, state->writeLength, state->writeOffset, slot, slot);
+                }
+            } else if (!finished) {
+                statsPhase(PHASE_BLOCK_WRITE, 0, result);
+                state->done += result;
+                if (state->done < state->writeLength) {
+                    ioRingPrepare(engine, true, op->dstFd, buffer + state->done, state->writeLength - state->done,
+                                  state->writeOffset + state->done, slot, slot);
+                } else {
+                    finished = true;
+                }
+            }
+
+            if (finished) {
+                freeSlots[numFree++] = slot;
+                inFlight--;
+            }
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+void ioCopy(IoEngine* engine, CopyOp* ops, size_t numOps) {
+    if (engine->uring) {
+        ioCopyUring(engine, ops, numOps);
+    } else {
+        ioCopySync(engine, ops, numOps);
+    }
+}
+
+// Lee length bytes del flujo de un miembro comprimido, que empieza al inicio
+// de su primer extent y sigue por los demas en orden. Los bloques del
+// empaquetado se leen enteros, una vez por tramo, para comprobar su CRC32C.
+// Bloque `position` del empaquetado leido entero en el tercer bloque de
+// scratch, con su CRC32C ya comprobado; se queda ahi para el siguiente uso.
+const unsigned char* readCachedBlock(CopyJob* job, IoEngine* engine, size_t position, bool* corrupt) {
+    if (engine->scratch == NULL) {
+        engine->scratch = allocBlocks(3);
+    }
+    unsigned char* cache = engine->scratch + 2 * blockSize;
+    if (engine->cachedBlock != position) {
+        engine->cachedBlock = SIZE_MAX;
+        uint64_t start = statsStart();
+        bool readOk = preadFully(job->archiveFd, cache, blockSize, blockOffset(position));
+        statsPhase(PHASE_INPUT_READ, start, blockSize);
+        if (!readOk) return NULL;
+        engine->cachedBlock = position;
+        engine->cachedCorrupt = crc32c(cache, blockSize) != job->fat->blockChecksums[position];
+    }
+    *corrupt |= engine->cachedCorrupt;
+    return cache;
+}
+
+bool readMemberStream(CopyJob* job, IoEngine* engine, FileMetadata* entry, size_t offset, unsigned char* buffer, size_t length, bool* corrupt) {
+    size_t j = 0;
+    while (j < entry->numExtents && offset >= entry->extents[j].length * blockSize) {
+        offset -= entry->extents[j++].length * blockSize;
+    }
+    while (length > 0) {
+        if (j == entry->numExtents) return false;
+        size_t position = entry->extents[j].start + offset / blockSize;
+        const unsigned char* cache = readCachedBlock(job, engine, position, corrupt);
+        if (cache == NULL) return false;
+
+        size_t within = offset % blockSize;
+        size_t chunk = blockSize - within;
+        if (chunk > length) chunk = length;
+        memcpy(buffer, cache + within, chunk);
+        buffer += chunk;
+        length -= chunk;
+        offset += chunk;
+        if (offset == entry->extents[j].length * blockSize) {
+            offset = 0;
+            j++;
+        }
+    }
+    return true;
+}
+
+// Descomprime los bloques del tramo. Cada bloque se comprimio por separado,
+// asi que basta con saber donde empieza el tramo dentro del flujo.
+void decompressTask(CopyJob* job, MemberTask* task, IoEngine* engine, int fd) {
+    FileMetadata* entry = &job->fat->files[task->member];
+    if (engine->scratch == NULL) {
+        engine->scratch = allocBlocks(3);
+    }
+    unsigned char* packed = engine->scratch;
+    unsigned char* raw = engine->scratch + blockSize;
+
+    size_t streamOffset = task->streamOffset;
+    for (size_t k = 0; k < task->numBlocks; k++) {
+        size_t block = task->firstBlock + k;
+        size_t rawLength = entry->fileSize - block * blockSize;
+        if (rawLength > blockSize) rawLength = blockSize;
+        size_t packedLength = entry->blockLengths[block];
+
+        // Un bloque que no se pudo comprimir se guarda tal cual
+        bool stored = packedLength == rawLength;
+        bool corrupt = false;
+        bool ok = readMemberStream(job, engine, entry, streamOffset, packed, packedLength, &corrupt) &&
+                  (stored || lzDecompress(packed, packedLength, raw, rawLength));
+        if (ok) {
+            uint64_t start = statsStart();
+            ok = pwriteFully(fd, stored ? packed : raw, directLength(&job->io, rawLength), block * blockSize);
+            statsPhase(PHASE_BLOCK_WRITE, start, rawLength);
+        }
+        if (corrupt) {
+            fprintf(stderr, "Checksum mismatch in block %zu of the file %s\n", block + 1, entry->fileName);
+        }
+        if (!ok) {
+            fprintf(stderr, "Error extracting block %zu of the file %s\n", block + 1, entry->fileName);
+        } else if (job->veryVerbose) {
+            printf("Block %zu of the file %s decompressed from %zu bytes\n", block + 1, entry->fileName, packedLength);
+        }
+        streamOffset += packedLength;
+    }
+}
+
+// Copia el fragmento de cola de un miembro. Al extraer se comprueba el CRC
+// del bloque compartido entero, que suele seguir en cache para el siguiente.
+void copyTail(CopyJob* job, FileMetadata* entry, MemberFile* file, IoEngine* engine, int fd) {
+    size_t bodySize = entry->fileSize - entry->tailLength;
+    size_t fragment = blockOffset(entry->tailBlock) + entry->tailOffset;
+    if (job->packing) {
+        uint64_t start = statsStart();
+        ssize_t got = preadUpTo(fd, engine->buffers, directLength(&job->io, entry->tailLength), bodySize);
+        statsPhase(PHASE_INPUT_READ, start, got);
+        if (got < 0) {
+            fprintf(stderr, "Error reading input file: %s\n", entry->fileName);
+            got = 0;
+        }
+        if ((size_t)got > entry->tailLength) got = entry->tailLength;
+        start = statsStart();
+        if (got > 0 && !pwriteFully(job->archiveFd, engine->buffers, got, fragment)) {
+            fprintf(stderr, "Error writing block %zu of the packed file.\n", entry->tailBlock);
+        }
+        statsPhase(PHASE_BLOCK_WRITE, start, got);
+        if ((size_t)got < entry->tailLength) {
+            pthread_mutex_lock(&job->lock);
+            if (bodySize + got < file->size) file->size = bodySize + got;
+            pthread_mutex_unlock(&job->lock);
+        }
+        if (job->veryVerbose) {
+            printf("Last %zu bytes of the file '%s' added at position %zu, offset %u\n", (size_t)got, entry->fileName,
+                   entry->tailBlock, entry->tailOffset);
+        }
+        return;
+    }
+
+    bool corrupt = false;
+    const unsigned char* block = readCachedBlock(job, engine, entry->tailBlock, &corrupt);
+    bool ok = block != NULL;
+    if (ok && job->io.direct) {
+        // El fragmento no esta alineado: se escribe desde el buffer del hilo
+        memcpy(engine->buffers, block + entry->tailOffset, entry->tailLength);
+        block = engine->buffers;
+    } else if (ok) {
+        block += entry->tailOffset;
+    }
+    if (ok) {
+        uint64_t start = statsStart();
+        ok = pwriteFully(fd, block, directLength(&job->io, entry->tailLength), bodySize);
+        statsPhase(PHASE_BLOCK_WRITE, start, entry->tailLength);
+    }
+    size_t last = (entry->fileSize + blockSize - 1) / blockSize;
+    if (corrupt) {
+        fprintf(stderr, "Checksum mismatch in block %zu of the file %s\n", last, entry->fileName);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error extracting block %zu of the file %s\n", last, entry->fileName);
+    } else if (job->veryVerbose) {
+        printf("Block %zu of the file %s extracted from the position %zu, offset %u\n", last, entry->fileName,
+               entry->tailBlock, entry->tailOffset);
+    }
+}
+
+bool hasHoles(FileMetadata* entry) {
+    for (size_t k = 0; k < entry->numExtents; k++) {
+        if (entry->extents[k].start == HOLE_EXTENT) return true;
+    }
+    return false;
+}
+
+void runCopyTask(CopyJob* job, MemberTask* task, IoEngine* engine) {
+    FileMetadata* entry = &job->fat->files[task->member];
+    MemberFile* file = &job->files[task->member];
+    size_t size;
+    int fd = openMemberFile(job, task->member, &size);
+
+    // Un tramo tiene como mucho EXTRACT_TASK_BLOCKS series contiguas de bloques
+    CopyOp ops[EXTRACT_TASK_BLOCKS];
+    size_t opBlocks[EXTRACT_TASK_BLOCKS];
+    size_t opPositions[EXTRACT_TASK_BLOCKS];
+    size_t numOps = 0;
+
+    size_t block = task->firstBlock;
+    size_t extent = task->extent;
+    size_t extentOffset = task->extentOffset;
+    size_t remaining = fd >= 0 ? task->numBlocks : 0;
+    if (entry->flags & MEMBER_COMPRESSED) {
+        if (fd >= 0) decompressTask(job, task, engine, fd);
+        remaining = 0;
+    }
+    while (remaining > 0) {
+        Extent* current = &entry->extents[extent];
+        size_t run = current->length - extentOffset;
+        if (run > remaining) run = remaining;
+        if (current->start == HOLE_EXTENT) {
+            // Al extraer queda como hueco del archivo: ftruncate al cerrarlo
+            block += run;
+            remaining -= run;
+            extent++;
+            extentOffset = 0;
+            continue;
+        }
+
+        size_t position = current->start + extentOffset;
+        size_t fileOffset = block * blockSize;
+        size_t bytes = run * blockSize;
+        if (fileOffset >= size) break;
+        if (fileOffset + bytes > size) bytes = size - fileOffset;
+
+        CopyOp* op = &ops[numOps];
+        if (job->packing) {
+            op->srcFd = fd;
+            op->srcOffset = fileOffset;
+            op->dstFd = job->blockFd;
+            op->dstOffset = blockOffset(position);
+        } else {
+            op->srcFd = job->blockFd;
+            op->srcOffset = blockOffset(position);
+            op->dstFd = fd;
+            op->dstOffset = fileOffset;
+        }
+        op->length = bytes;
+        op->padBlock = job->packing;
+        op->checksums = job->fat->blockChecksums + position;
+        op->zeroBlocks = job->packing ? job->fat->zeroBlocks + position : NULL;
+        op->hashes = job->packing && !(job->fat->flags & (ARCHIVE_COMPRESSED | ARCHIVE_DEDUP)) ? job->fat->blockHashes + position : NULL;
+        op->cow = job->packing && job->delta ? &job->cow : NULL;
+        opBlocks[numOps] = block;
+        opPositions[numOps] = position;
+        numOps++;
+
+        block += run;
+        extentOffset += run;
+        remaining -= run;
+        if (extentOffset == current->length) {
+            extent++;
+            extentOffset = 0;
+        }
+    }
+
+    ioCopy(engine, ops, numOps);
+
+    for (size_t i = 0; i < numOps; i++) {
+        CopyOp* op = &ops[i];
+        if (job->packing) {
+            if (op->copied < 0) {
+                fprintf(stderr, "Error reading input file: %s\n", entry->fileName);
+                op->copied = 0;
+            }
+            if (op->unchanged > 0) {
+                pthread_mutex_lock(&job->lock);
+                file->unchanged += op->unchanged;
+                pthread_mutex_unlock(&job->lock);
+            }
+            if ((size_t)op->copied < op->length) {
+                // La entrada se acorto mientras se leia: el miembro termina aqui
+                pthread_mutex_lock(&job->lock);
+                if (op->srcOffset + op->copied < file->size) file->size = op->srcOffset + op->copied;
+                pthread_mutex_unlock(&job->lock);
+            }
+        } else if (op->copied != (ssize_t)op->length) {
+            fprintf(stderr, "Error extracting block %zu of the file %s\n", opPositions[i], entry->fileName);
+        } else if (op->corrupt != SIZE_MAX) {
+            fprintf(stderr, "Checksum mismatch in block %zu of the file %s\n", opBlocks[i] + op->corrupt + 1, entry->fileName);
+        }
+
+        if (job->veryVerbose) {
+            size_t blocks = ((size_t)op->copied + blockSize - 1) / blockSize;
+            for (size_t k = 0; k < blocks; k++) {
+                if (job->packing) {
+                    printf("Block %zu of the file '%s' added at position %zu\n", opBlocks[i] + k + 1, entry->fileName, opPositions[i] + k);
+                } else {
+                    printf("Block %zu of the file %s extracted from the position %zu\n", opBlocks[i] + k + 1, entry->fileName, opPositions[i] + k);
+                }
+            }
+        }
+    }
+
+    // La cola la copia el tramo que termina el miembro
+    if (entry->tailLength > 0 && fd >= 0 &&
+        task->firstBlock + task->numBlocks == (entry->fileSize - entry->tailLength) / blockSize) {
+        copyTail(job, entry, file, engine, fd);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (--file->pendingTasks == 0 && file->fd >= 0) {
+        if (!job->packing && (hasHoles(entry) || job->io.direct)) truncateFile(file->fd, entry->fileSize);
+        close(file->fd);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+void* copyWorker(void* arg) {
+    CopyJob* job = arg;
+    IoEngine engine;
+    initIoEngine(&engine, &job->io);
+    size_t task;
+    while ((task = atomic_fetch_add(&job->nextTask, 1)) < job->numTasks) {
+        runCopyTask(job, &job->tasks[task], &engine);
+    }
+    destroyIoEngine(&engine);
+    return NULL;
+}
+
+// Reparte el miembro en tramos de EXTRACT_TASK_BLOCKS bloques, que quedan
+// seguidos en la cola. En los miembros comprimidos los tramos cuentan bloques
+// originales y guardan su posicion en el flujo.
+void addMemberTasks(CopyJob* job, size_t member, size_t* capacity) {
+    FileMetadata* entry = &job->fat->files[member];
+    bool compressed = entry->flags & MEMBER_COMPRESSED;
+    size_t totalBlocks = 0;
+    if (compressed) {
+        totalBlocks = (entry->fileSize + blockSize - 1) / blockSize;
+    } else {
+        for (size_t j = 0; j < entry->numExtents; j++) {
+            totalBlocks += entry->extents[j].length;
+        }
+    }
+
+    size_t extent = 0;
+    size_t extentOffset = 0;
+    size_t block = 0;
+    size_t streamOffset = 0;
+    do {
+        if (job->numTasks == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            job->tasks = checkedRealloc(job->tasks, *capacity * sizeof(MemberTask));
+        }
+        MemberTask* task = &job->tasks[job->numTasks++];
+        task->member = member;
+        task->extent = extent;
+        task->extentOffset = extentOffset;
+        task->firstBlock = block;
+        task->numBlocks = totalBlocks - block < EXTRACT_TASK_BLOCKS ? totalBlocks - block : EXTRACT_TASK_BLOCKS;
+        task->streamOffset = streamOffset;
+        job->files[member].pendingTasks++;
+
+        if (compressed) {
+            for (size_t k = 0; k < task->numBlocks; k++) {
+                streamOffset += entry->blockLengths[block + k];
+            }
+            block += task->numBlocks;
+            continue;
+        }
+
+        // Avanzar la posicion fisica hasta el inicio del siguiente tramo
+        size_t skip = task->numBlocks;
+        while (skip > 0) {
+            size_t step = entry->extents[extent].length - extentOffset;
+            if (step > skip) step = skip;
+            extentOffset += step;
+            skip -= step;
+            if (extentOffset == entry->extents[extent].length) {
+                extent++;
+                extentOffset = 0;
+            }
+        }
+        block += task->numBlocks;
+    } while (block < totalBlocks);
+}
+
+void initCopyJob(CopyJob* job, FileAllocationTable* fat, int archiveFd, bool packing, bool ioUring, bool verbose, bool veryVerbose) {
+    memset(job, 0, sizeof(CopyJob));
+    job->fat = fat;
+    job->archiveFd = archiveFd;
+    job->blockFd = directIo ? reopenDirect(archiveFd, packing ? O_RDWR : O_RDONLY) : -1;
+    if (job->blockFd < 0) job->blockFd = archiveFd;
+    job->packing = packing;
+    initIoShared(&job->io, ioUring);
+    job->files = checkedRealloc(NULL, (fat->numFiles ? fat->numFiles : 1) * sizeof(MemberFile));
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        job->files[i].fd = -1;
+        job->files[i].pendingTasks = 0;
+        job->files[i].size = fat->files[i].fileSize;
+        job->files[i].unchanged = 0;
+    }
+    atomic_init(&job->nextTask, 0);
+    pthread_mutex_init(&job->lock, NULL);
+    job->verbose = verbose;
+    job->veryVerbose = veryVerbose;
+}
+
+// Cada hilo toma el siguiente tramo de la cola y lo copia con su propio motor
+// de E/S, sin compartir posicion de lectura; con un solo hilo todo corre en el
+// actual.
+void runCopyJob(CopyJob* job, int jobs) {
+    if ((size_t)jobs > job->numTasks) jobs = (int)job->numTasks;
+    pthread_t* threads = checkedRealloc(NULL, (jobs > 1 ? jobs : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < jobs; t++) {
+        if (pthread_create(&threads[started], NULL, copyWorker, job) == 0) {
+            started++;
+        }
+    }
+    copyWorker(job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+void destroyCopyJob(CopyJob* job) {
+    if (job->blockFd != job->archiveFd) close(job->blockFd);
+    pthread_mutex_destroy(&job->lock);
+    free(job->tasks);
+    free(job->files);
+}
+
+// Lee el siguiente bloque de la entrada en su lugar del anillo. Un bloque
+// incompleto es el ultimo.
+size_t readRingBlock(InputRing* ring, size_t index) {
+    uint64_t start = statsStart();
+    ssize_t got = readUpTo(ring->fd, ring->buffers + (index % ring->slots) * blockSize, blockSize);
+    statsPhase(PHASE_INPUT_READ, start, got);
+    if (got < 0) {
+        fprintf(stderr, "Error reading input file: %s\n", ring->name);
+        got = 0;
+    }
+    ring->lengths[index % ring->slots] = got;
+    return got;
+}
+
+void* inputRingReader(void* arg) {
+    InputRing* ring = arg;
+    pthread_mutex_lock(&ring->lock);
+    while (!ring->done) {
+        while (ring->head - ring->tail == ring->slots && !ring->stop) {
+            pthread_cond_wait(&ring->drained, &ring->lock);
+        }
+        if (ring->stop) break;
+        size_t index = ring->head;
+        pthread_mutex_unlock(&ring->lock);
+
+        size_t got = readRingBlock(ring, index);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->head++;
+        if (got < blockSize) ring->done = true;
+        pthread_cond_signal(&ring->filled);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+// Empieza a leer fd por adelantado. Si no se puede crear el hilo, los bloques
+// se leen de a uno cuando se piden, como antes.
+void startInputRing(InputRing* ring, int fd, const char* name) {
+    memset(ring, 0, sizeof(InputRing));
+    ring->fd = fd;
+    ring->name = name;
+    ring->slots = INPUT_RING_BYTES / blockSize < 2 ? 2 : INPUT_RING_BYTES / blockSize;
+    ring->buffers = allocBlocks(ring->slots);
+    ring->lengths = checkedRealloc(NULL, ring->slots * sizeof(size_t));
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->filled, NULL);
+    pthread_cond_init(&ring->drained, NULL);
+    ring->threaded = pthread_create(&ring->thread, NULL, inputRingReader, ring) == 0;
+}
+
+// Devuelve el siguiente bloque leido y su longitud, o NULL al final. El
+// bloque es del escritor (puede completarlo con ceros) hasta releaseRingBlock.
+unsigned char* nextRingBlock(InputRing* ring, size_t* length) {
+    if (!ring->threaded) {
+        if (ring->done || readRingBlock(ring, ring->tail) == 0) return NULL;
+        ring->head = ring->tail + 1;
+        ring->done = ring->lengths[ring->tail % ring->slots] < blockSize;
+    } else {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head == ring->tail && !ring->done) {
+            pthread_cond_wait(&ring->filled, &ring->lock);
+        }
+        bool empty = ring->head == ring->tail;
+        pthread_mutex_unlock(&ring->lock);
+        if (empty) return NULL;
+    }
+    *length = ring->lengths[ring->tail % ring->slots];
+    if (*length == 0) return NULL;
+    return ring->buffers + (ring->tail % ring->slots) * blockSize;
+}
+
+void releaseRingBlock(InputRing* ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->tail++;
+    pthread_cond_signal(&ring->drained);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void stopInputRing(InputRing* ring) {
+    if (ring->threaded) {
+        pthread_mutex_lock(&ring->lock);
+        ring->stop = true;
+        pthread_cond_signal(&ring->drained);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->thread, NULL);
+    }
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->filled);
+    pthread_cond_destroy(&ring->drained);
+    free(ring->buffers);
+    free(ring->lengths);
+}
+
+// Empaqueta una entrada de tamano desconocido (stdin, tuberias) bloque a
+// bloque. Un hilo lee por adelantado en un anillo mientras este escribe, asi
+// la entrada no se detiene cada vez que una escritura tarda.
+void packStream(FILE* archive, FileAllocationTable* fat, FILE* input, FileMetadata* entry, bool veryVerbose) {
+    BlockReservation reservation = {0, 0};
+    InputRing ring;
+    startInputRing(&ring, fileno(input), entry->fileName);
+    unsigned char* block;
+    size_t bytesRead;
+    size_t blockCount = 0;
+
+    for (; (block = nextRingBlock(&ring, &bytesRead)) != NULL; releaseRingBlock(&ring)) {
+        if (bytesRead < blockSize && packedTailLength(fat, bytesRead) > 0) {
+            // Final corto: va como fragmento en vez de ocupar un bloque entero
+            placeTail(archive, fat, entry, bytesRead, veryVerbose);
+            uint64_t written = statsStart();
+            if (!pwriteFully(fileno(archive), block, bytesRead, blockOffset(entry->tailBlock) + entry->tailOffset)) {
+                fprintf(stderr, "Error writing block %zu of the packed file.\n", entry->tailBlock);
+            }
+            statsPhase(PHASE_BLOCK_WRITE, written, bytesRead);
+            entry->fileSize += bytesRead;
+            if (veryVerbose) {
+                printf("Last %zu bytes of '%s' written to position %zu at offset %u\n", bytesRead, entry->fileName,
+                       entry->tailBlock, entry->tailOffset);
+            }
+            continue;
+        }
+        if (bytesRead < blockSize) {
+            memset(block + bytesRead, 0, blockSize - bytesRead);
+        }
+        if (isZeroBlock(block, blockSize)) {
+            appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, HOLE_EXTENT, 1);
+            entry->fileSize += bytesRead;
+            blockCount++;
+            if (veryVerbose) {
+                printf("Block %zu of '%s' is all zeros, stored as a hole\n", blockCount, entry->fileName);
+            }
+            continue;
+        }
+        size_t blockPosition = nextReservedBlock(archive, fat, &reservation, STREAM_BATCH_BLOCKS, veryVerbose);
+
+        fat->blockChecksums[blockPosition] = crc32c(block, blockSize);
+        fat->blockHashes[blockPosition] = hashBlock(block, blockSize);
+        writeBlock(archive, block, blockPosition);
+        appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, blockPosition, 1);
+        entry->fileSize += bytesRead;
+        blockCount++;
+
+        if (veryVerbose) {
+            printf("Block %zu of '%s' written to position %zu\n", blockCount, entry->fileName, blockPosition);
+        }
+    }
+    stopInputRing(&ring);
+    releaseReservation(fat, &reservation);
+    fflush(archive);
+}
+
+// Libera los bloques del miembro que quedan despues de los primeros keepBlocks.
+void truncateExtents(FileAllocationTable* fat, FileMetadata* entry, size_t keepBlocks) {
+    size_t kept = 0;
+    size_t j = 0;
+    while (j < entry->numExtents && kept + entry->extents[j].length <= keepBlocks) {
+        kept += entry->extents[j++].length;
+    }
+    if (j < entry->numExtents && kept < keepBlocks) {
+        size_t keep = keepBlocks - kept;
+        if (entry->extents[j].start != HOLE_EXTENT) {
+            retireBlockRange(fat, entry->extents[j].start + keep, entry->extents[j].length - keep);
+        }
+        entry->extents[j++].length = keep;
+    }
+    size_t last = j;
+    for (; j < entry->numExtents; j++) {
+        if (entry->extents[j].start == HOLE_EXTENT) continue;
+        retireBlockRange(fat, entry->extents[j].start, entry->extents[j].length);
+    }
+    entry->numExtents = last;
+}
+
+// Agrega blocks bloques libres al final de los extents del miembro,
+// agrandando el empaquetado si no hay espacio. Quedan sin huella, asi que
+// -u nunca los toma por bloques que ya tenian los datos.
+void appendMemberBlocks(FILE* archive, FileAllocationTable* fat, FileMetadata* entry, size_t blocks, bool veryVerbose) {
+    while (blocks > 0) {
+        size_t start;
+        size_t granted = reserveBlocks(fat, blocks, &start);
+        if (granted == 0) {
+            if (veryVerbose) {
+                printf("No free blocks, expanding the file\n");
+            }
+            expandArchive(archive, fat, blocks);
+            continue;
+        }
+        appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, start, granted);
+        memset(fat->blockHashes + start, 0, granted * sizeof(uint64_t));
+        blocks -= granted;
+    }
+}
+
+// Reserva los bloques para size bytes al final de los extents del miembro.
+void reserveMemberBlocks(FILE* archive, FileAllocationTable* fat, FileMetadata* entry, size_t size, bool veryVerbose) {
+    size_t tail = packedTailLength(fat, size);
+    if (tail > 0) placeTail(archive, fat, entry, tail, veryVerbose);
+    appendMemberBlocks(archive, fat, entry, (size - tail + blockSize - 1) / blockSize, veryVerbose);
+}
+
+// -u por diferencias: el miembro conserva sus bloques para size bytes y solo
+// se liberan los que sobran o se reservan los que faltan. Los huecos pasan a
+// ser bloques nuevos; si siguen siendo ceros la copia los vuelve a quitar.
+void resizeMemberBlocks(FILE* archive, FileAllocationTable* fat, FileMetadata* entry, size_t size, bool veryVerbose) {
+    releaseTail(fat, entry);
+    size_t tail = packedTailLength(fat, size);
+    if (tail > 0) placeTail(archive, fat, entry, tail, veryVerbose);
+    size_t blocks = (size - tail + blockSize - 1) / blockSize;
+    size_t current = 0;
+    for (size_t k = 0; k < entry->numExtents; k++) {
+        current += entry->extents[k].length;
+    }
+    if (blocks < current) truncateExtents(fat, entry, blocks);
+
+    Extent* old = entry->extents;
+    size_t count = entry->numExtents;
+    entry->extents = NULL;
+    entry->numExtents = 0;
+    entry->extentCapacity = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (old[k].start == HOLE_EXTENT) {
+            appendMemberBlocks(archive, fat, entry, old[k].length, veryVerbose);
+        } else {
+            appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, old[k].start, old[k].length);
+        }
+    }
+    free(old);
+    if (blocks > current) appendMemberBlocks(archive, fat, entry, blocks - current, veryVerbose);
+}
+
+// Los bloques que la copia marco como ceros pasan a ser huecos del miembro y
+// se liberan. Pueden ser bloques de la foto confirmada (con -u): el espacio en
+// disco lo devuelve punchFreeBlocks cuando ya no los ve ningun lector.
+size_t holeZeroBlocks(FileAllocationTable* fat, FileMetadata* entry) {
+    size_t holes = 0;
+    for (size_t k = 0; k < entry->numExtents && holes == 0; k++) {
+        if (entry->extents[k].start == HOLE_EXTENT) continue;
+        for (size_t b = 0; b < entry->extents[k].length && holes == 0; b++) {
+            holes = fat->zeroBlocks[entry->extents[k].start + b];
+        }
+    }
+    if (holes == 0) return 0;
+
+    Extent* old = entry->extents;
+    size_t count = entry->numExtents;
+    entry->extents = NULL;
+    entry->numExtents = 0;
+    entry->extentCapacity = 0;
+    holes = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (old[k].start == HOLE_EXTENT) {
+            appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, HOLE_EXTENT, old[k].length);
+            continue;
+        }
+        size_t run = 0; // Bloques de ceros seguidos que terminan en b
+        for (size_t b = 0; b <= old[k].length; b++) {
+            size_t position = old[k].start + b;
+            if (b < old[k].length && fat->zeroBlocks[position]) {
+                fat->zeroBlocks[position] = 0;
+                appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, HOLE_EXTENT, 1);
+                run++;
+                continue;
+            }
+            if (run > 0) {
+                retireBlockRange(fat, position - run, run);
+                holes += run;
+                run = 0;
+            }
+            if (b < old[k].length) appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, position, 1);
+        }
+    }
+    free(old);
+    return holes;
+}
+
+// Antes de -u: cada bloque confirmado de los miembros puede acabar en uno
+// nuevo, asi que las tablas y el hueco antes de los metadatos se preparan
+// para todos ellos. Los que no hagan falta no ocupan espacio en disco.
+void reserveCopyOnWrite(FILE* archive, FileAllocationTable* fat, CopyJob* job, size_t* planned, size_t numPlanned) {
+    size_t committed = 0;
+    for (size_t p = 0; p < numPlanned; p++) {
+        FileMetadata* entry = &fat->files[planned[p]];
+        for (size_t k = 0; k < entry->numExtents; k++) {
+            if (entry->extents[k].start == HOLE_EXTENT) continue;
+            for (size_t b = 0; b < entry->extents[k].length; b++) {
+                committed += !fat->newBlocks[entry->extents[k].start + b];
+            }
+        }
+    }
+    job->cow.fat = fat;
+    job->cow.lock = &job->lock;
+    job->cow.numPositions = fat->numBlocks;
+    job->cow.limit = fat->numBlocks + committed;
+    job->cow.remap = checkedRealloc(NULL, (fat->numBlocks ? fat->numBlocks : 1) * sizeof(size_t));
+    for (size_t b = 0; b < fat->numBlocks; b++) {
+        job->cow.remap[b] = SIZE_MAX;
+    }
+    ensureDataSpace(archive, fat, job->cow.limit);
+    growBlockTables(fat, job->cow.limit);
+}
+
+// Despues de -u: el miembro pasa a usar los bloques nuevos de los que cambiaron
+// y los viejos se retiran; quedan pendientes mientras alguna foto los vea.
+void remapMemberBlocks(FileAllocationTable* fat, FileMetadata* entry, CopyOnWrite* cow) {
+    Extent* old = entry->extents;
+    size_t count = entry->numExtents;
+    entry->extents = NULL;
+    entry->numExtents = 0;
+    entry->extentCapacity = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (old[k].start == HOLE_EXTENT) {
+            appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, HOLE_EXTENT, old[k].length);
+            continue;
+        }
+        for (size_t b = 0; b < old[k].length; b++) {
+            size_t position = old[k].start + b;
+            size_t target = position < cow->numPositions ? cow->remap[position] : SIZE_MAX;
+            if (target == SIZE_MAX) {
+                appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, position, 1);
+                continue;
+            }
+            appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, target, 1);
+            retireBlockRange(fat, position, 1);
+        }
+    }
+    free(old);
+}
+
+// Copia en paralelo los miembros ya reservados y consolida la tabla: se
+// descartan los que no se pudieron abrir y se recortan los que se acortaron.
+void runPackJob(FILE* archive, FileAllocationTable* fat, size_t* planned, size_t numPlanned, int jobs, bool ioUring,
+                bool delta, bool verbose, bool veryVerbose, const char* action) {
+    fflush(archive);
+
+    CopyJob job;
+    initCopyJob(&job, fat, fileno(archive), true, ioUring, verbose, veryVerbose);
+    job.delta = delta;
+    if (delta) reserveCopyOnWrite(archive, fat, &job, planned, numPlanned);
+    size_t capacity = 0;
+    for (size_t p = 0; p < numPlanned; p++) {
+        addMemberTasks(&job, planned[p], &capacity);
+    }
+    runCopyJob(&job, jobs);
+
+    for (size_t p = 0; p < numPlanned; p++) {
+        size_t i = planned[p];
+        FileMetadata* entry = &fat->files[i];
+        if (delta) remapMemberBlocks(fat, entry, &job.cow);
+        if (job.files[i].pendingTasks == 0 && job.files[i].fd == -2) {
+            removeMember(fat, entry);
+            continue;
+        }
+        size_t holes = holeZeroBlocks(fat, entry);
+        if (veryVerbose && holes > 0) {
+            printf("%zu zero blocks of the file '%s' stored as holes\n", holes, entry->fileName);
+        }
+        if (job.files[i].size != entry->fileSize) {
+            size_t size = job.files[i].size;
+            if (size < entry->fileSize - entry->tailLength) {
+                releaseTail(fat, entry);
+                truncateExtents(fat, entry, (size + blockSize - 1) / blockSize);
+            } else {
+                // Solo se acorto la cola: el fragmento conserva su lugar
+                size_t cut = entry->fileSize - size;
+                fat->fragmentBytes[entry->tailBlock] -= cut;
+                entry->tailLength -= cut;
+            }
+            entry->fileSize = size;
+        }
+        if (verbose) {
+            printf("File '%s' %s the packed file (%zu bytes).\n", entry->fileName, action, entry->fileSize);
+            if (job.files[i].unchanged > 0) printf("  %zu unchanged blocks kept in place\n", job.files[i].unchanged);
+        }
+    }
+    free(job.cow.remap);
+    destroyCopyJob(&job);
+}
+
+// Busca un bloque en uso con el mismo contenido. La huella solo elige los
+// candidatos: el contenido se compara antes de compartir el bloque.
+size_t findDuplicateBlock(FileAllocationTable* fat, int fd, uint64_t hash, const unsigned char* data, unsigned char* scratch) {
+    if (fat->fingerprintCapacity == 0) return SIZE_MAX;
+    size_t mask = fat->fingerprintCapacity - 1;
+    for (size_t slot = hash & mask; fat->fingerprintIndex[slot] != 0; slot = (slot + 1) & mask) {
+        size_t block = fat->fingerprintIndex[slot] - 1;
+        if (fat->blockHashes[block] == hash && fat->refCounts[block] > 0 && fat->refCounts[block] < UINT32_MAX &&
+            preadFully(fd, scratch, blockSize, blockOffset(block)) && memcmp(scratch, data, blockSize) == 0) {
+            return block;
+        }
+    }
+    return SIZE_MAX;
+}
+
+void initBlockBatch(BlockBatch* batch, size_t capacity) {
+    batch->raw = allocBlocks(capacity);
+    batch->packed = allocBlocks(capacity);
+    batch->members = checkedRealloc(NULL, capacity * sizeof(size_t));
+    batch->rawLengths = checkedRealloc(NULL, capacity * sizeof(uint32_t));
+    batch->packedLengths = checkedRealloc(NULL, capacity * sizeof(uint32_t));
+    batch->hashes = checkedRealloc(NULL, capacity * sizeof(uint64_t));
+    batch->numBlocks = 0;
+    batch->mode = 0;
+    atomic_init(&batch->next, 0);
+}
+
+void destroyBlockBatch(BlockBatch* batch) {
+    free(batch->raw);
+    free(batch->packed);
+    free(batch->members);
+    free(batch->rawLengths);
+    free(batch->packedLengths);
+    free(batch->hashes);
+}
+
+// Procesa los bloques del lote que quedan sin tomar. Al deduplicar se calcula
+// la huella del bloque completado con ceros; al comprimir, si un bloque no se
+// achica se guarda tal cual y su longitud queda igual a la original.
+void processBatchBlocks(BlockBatch* batch) {
+    size_t i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->numBlocks) {
+        size_t rawLength = batch->rawLengths[i];
+        if (batch->mode & ARCHIVE_DEDUP) {
+            unsigned char* raw = batch->raw + i * blockSize;
+            memset(raw + rawLength, 0, blockSize - rawLength);
+            batch->hashes[i] = hashBlock(raw, blockSize);
+            continue;
+        }
+        size_t length = lzCompress(batch->raw + i * blockSize, rawLength, batch->packed + i * blockSize, rawLength - 1);
+        batch->packedLengths[i] = length > 0 ? length : rawLength;
+    }
+}
+
+void* batchWorker(void* arg) {
+    BlockPool* pool = arg;
+    size_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == seen && !pool->stop) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) break;
+        seen = pool->generation;
+        BlockBatch* batch = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+
+        processBatchBlocks(batch);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void initBlockPool(BlockPool* pool, int numThreads) {
+    memset(pool, 0, sizeof(BlockPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->threads = checkedRealloc(NULL, (numThreads > 0 ? numThreads : 1) * sizeof(pthread_t));
+    for (int t = 0; t < numThreads; t++) {
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, batchWorker, pool) == 0) {
+            pool->numThreads++;
+        }
+    }
+}
+
+void destroyBlockPool(BlockPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->numThreads; t++) {
+        pthread_join(pool->threads[t], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+}
+
+// Publica el lote para los hilos del pool y vuelve enseguida.
+void startBlockBatch(BlockPool* pool, BlockBatch* batch) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&batch->next, 0);
+    pool->batch = batch;
+    pool->generation++;
+    pool->running = pool->numThreads;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// El hilo principal comprime lo que quede del lote y espera al resto.
+void finishBlockBatch(BlockPool* pool) {
+    processBatchBlocks(pool->batch);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Llena el lote con los siguientes bloques de las entradas, en orden. Cada
+// entrada se cierra al llegar a su final.
+void fillBlockBatch(FileAllocationTable* fat, BlockBatch* batch, size_t capacity, PackInput* inputs, size_t numInputs, size_t* current) {
+    batch->numBlocks = 0;
+    while (batch->numBlocks < capacity && *current < numInputs) {
+        PackInput* input = &inputs[*current];
+        size_t i = batch->numBlocks;
+        uint64_t start = statsStart();
+        ssize_t got = readUpTo(input->fd, batch->raw + i * blockSize, blockSize);
+        statsPhase(PHASE_INPUT_READ, start, got);
+        if (got < 0) {
+            fprintf(stderr, "Error reading input file: %s\n", fat->files[input->member].fileName);
+            got = 0;
+        }
+        if (got > 0) {
+            batch->members[i] = input->member;
+            batch->rawLengths[i] = got;
+            batch->numBlocks++;
+        }
+        if (got < (ssize_t)blockSize) {
+            if (input->fd != STDIN_FILENO) close(input->fd);
+            (*current)++;
+        }
+    }
+}
+
+// Escribe el bloque pendiente del flujo (completado con ceros) en el siguiente
+// bloque reservado y lo agrega a los extents del miembro.
+void flushPackedStream(FILE* archive, FileAllocationTable* fat, PackedStream* stream, bool veryVerbose) {
+    if (stream->used == 0) return;
+    memset(stream->buffer + stream->used, 0, blockSize - stream->used);
+    size_t position = nextReservedBlock(archive, fat, &stream->reservation, STREAM_BATCH_BLOCKS, veryVerbose);
+    fat->blockChecksums[position] = crc32c(stream->buffer, blockSize);
+    if (!writeDataBlock(fileno(archive), stream->buffer, position)) {
+        fprintf(stderr, "Error writing block %zu of the packed file.\n", position);
+    }
+    FileMetadata* entry = &fat->files[stream->member];
+    appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, position, 1);
+    stream->used = 0;
+}
+
+void appendPackedStream(FILE* archive, FileAllocationTable* fat, PackedStream* stream, const unsigned char* data, size_t length, bool veryVerbose) {
+    while (length > 0) {
+        size_t chunk = blockSize - stream->used;
+        if (chunk > length) chunk = length;
+        memcpy(stream->buffer + stream->used, data, chunk);
+        stream->used += chunk;
+        data += chunk;
+        length -= chunk;
+        if (stream->used == blockSize) {
+            flushPackedStream(archive, fat, stream, veryVerbose);
+        }
+    }
+}
+
+// Guarda un bloque de un empaquetado con deduplicacion: si ya hay uno igual
+// se suma una referencia, si no se escribe en el siguiente bloque reservado.
+size_t storeUniqueBlock(FILE* archive, FileAllocationTable* fat, BlockReservation* reservation, const unsigned char* data,
+                        uint64_t hash, unsigned char* scratch, bool veryVerbose, bool* shared) {
+    size_t position = findDuplicateBlock(fat, fileno(archive), hash, data, scratch);
+    *shared = position != SIZE_MAX;
+    if (*shared) {
+        fat->refCounts[position]++;
+        return position;
+    }
+    position = nextReservedBlock(archive, fat, reservation, STREAM_BATCH_BLOCKS, veryVerbose);
+    fat->blockChecksums[position] = crc32c(data, blockSize);
+    if (!writeDataBlock(fileno(archive), data, position)) {
+        fprintf(stderr, "Error writing block %zu of the packed file.\n", position);
+    }
+    fat->refCounts[position] = 1;
+    addFingerprint(fat, position, hash);
+    return position;
+}
+
+// Empaqueta las entradas por lotes de bloques: comprimiendo cada bloque por
+// separado o, con deduplicacion, resumiendolo para reutilizar los bloques
+// repetidos. Mientras el pool procesa un lote el hilo principal lee el
+// siguiente; los bloques se escriben en el orden de las entradas, asi el
+// resultado no depende de -j.
+void packPipelined(FILE* archive, FileAllocationTable* fat, PackInput* inputs, size_t numInputs, int jobs,
+                    bool verbose, bool veryVerbose, const char* action) {
+    fflush(archive);
+    bool dedup = fat->flags & ARCHIVE_DEDUP;
+    for (size_t i = 0; i < numInputs; i++) {
+        FileMetadata* entry = &fat->files[inputs[i].member];
+        if (!dedup) entry->flags |= MEMBER_COMPRESSED;
+        entry->fileSize = 0;
+    }
+
+    BlockPool pool;
+    initBlockPool(&pool, jobs - 1);
+    size_t capacity = (size_t)jobs * PIPELINE_BATCH_BLOCKS;
+    BlockBatch batches[2];
+    initBlockBatch(&batches[0], capacity);
+    initBlockBatch(&batches[1], capacity);
+    batches[0].mode = batches[1].mode = dedup ? ARCHIVE_DEDUP : ARCHIVE_COMPRESSED;
+    BlockBatch* ready = &batches[0];
+    BlockBatch* next = &batches[1];
+    size_t totalBlocks = 0;
+    size_t sharedBlocks = 0;
+
+    PackedStream stream = { SIZE_MAX, allocBlocks(1), 0, { 0, 0 } };
+    size_t current = 0;
+    fillBlockBatch(fat, ready, capacity, inputs, numInputs, &current);
+    while (ready->numBlocks > 0) {
+        startBlockBatch(&pool, ready);
+        fillBlockBatch(fat, next, capacity, inputs, numInputs, &current);
+        finishBlockBatch(&pool);
+
+        for (size_t i = 0; i < ready->numBlocks; i++) {
+            if (dedup) {
+                FileMetadata* entry = &fat->files[ready->members[i]];
+                bool shared;
+                size_t position = storeUniqueBlock(archive, fat, &stream.reservation, ready->raw + i * blockSize,
+                                                   ready->hashes[i], stream.buffer, veryVerbose, &shared);
+                appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, position, 1);
+                entry->fileSize += ready->rawLengths[i];
+                totalBlocks++;
+                sharedBlocks += shared;
+
+                if (veryVerbose) {
+                    printf("Block %zu of the file '%s' %s position %zu\n", (entry->fileSize + blockSize - 1) / blockSize,
+                           entry->fileName, shared ? "shares the block at" : "added at", position);
+                }
+                continue;
+            }
+
+            if (ready->members[i] != stream.member) {
+                // Cada miembro empieza su flujo en un bloque nuevo
+                if (stream.member != SIZE_MAX) flushPackedStream(archive, fat, &stream, veryVerbose);
+                stream.member = ready->members[i];
+            }
+            FileMetadata* entry = &fat->files[stream.member];
+            size_t block = entry->fileSize / blockSize;
+            if ((block & (block - 1)) == 0) {
+                entry->blockLengths = checkedRealloc(entry->blockLengths, (block ? block * 2 : 1) * sizeof(uint32_t));
+            }
+            size_t rawLength = ready->rawLengths[i];
+            size_t packedLength = ready->packedLengths[i];
+            const unsigned char* data = packedLength == rawLength ? ready->raw : ready->packed;
+            appendPackedStream(archive, fat, &stream, data + i * blockSize, packedLength, veryVerbose);
+            entry->blockLengths[block] = packedLength;
+            entry->fileSize += rawLength;
+
+            if (veryVerbose) {
+                printf("Block %zu of the file '%s' compressed to %zu bytes\n", block + 1, entry->fileName, packedLength);
+            }
+        }
+
+        BlockBatch* swap = ready;
+        ready = next;
+        next = swap;
+    }
+    if (stream.member != SIZE_MAX) flushPackedStream(archive, fat, &stream, veryVerbose);
+    releaseReservation(fat, &stream.reservation);
+
+    if (verbose && dedup) {
+        for (size_t i = 0; i < numInputs; i++) {
+            FileMetadata* entry = &fat->files[inputs[i].member];
+            printf("File '%s' %s the packed file (%zu bytes).\n", entry->fileName, action, entry->fileSize);
+        }
+        printf("%zu of %zu blocks were already in the packed file.\n", sharedBlocks, totalBlocks);
+    } else if (verbose) {
+        for (size_t i = 0; i < numInputs; i++) {
+            FileMetadata* entry = &fat->files[inputs[i].member];
+            size_t stored = 0;
+            for (size_t k = 0; k < (entry->fileSize + blockSize - 1) / blockSize; k++) {
+                stored += entry->blockLengths[k];
+            }
+            printf("File '%s' %s the packed file (%zu bytes, %zu compressed).\n", entry->fileName, action, entry->fileSize, stored);
+        }
+    }
+
+    free(stream.buffer);
+    destroyBlockBatch(&batches[0]);
+    destroyBlockBatch(&batches[1]);
+    destroyBlockPool(&pool);
+}
+
+// Empaqueta la entrada estandar como un miembro nuevo.
+void packStandardInput(FILE* archive, FileAllocationTable* fat, const char* name, int jobs, bool veryVerbose) {
+    if (fat->flags & (ARCHIVE_COMPRESSED | ARCHIVE_DEDUP)) {
+        addMember(fat, name);
+        PackInput input = { fat->numFiles - 1, STDIN_FILENO };
+        packPipelined(archive, fat, &input, 1, jobs, false, veryVerbose, "added to");
+    } else {
+        packStream(archive, fat, stdin, addMember(fat, name), veryVerbose);
+    }
+}
+
+void addDirectoryMember(FileAllocationTable* fat, const char* fileName, bool verbose) {
+    if (verbose) printf("Adding directory %s\n", fileName);
+    addMember(fat, fileName)->flags |= MEMBER_DIRECTORY;
+}
+
+// packFiles para empaquetados con compresion o deduplicacion: se abren todas
+// las entradas y se leen por lotes.
+void packPipelinedFiles(FILE* archive, FileAllocationTable* fat, char** fileNames, int numFiles, int jobs, bool verbose, bool veryVerbose) {
+    PackInput* inputs = checkedRealloc(NULL, (numFiles ? numFiles : 1) * sizeof(PackInput));
+    size_t numInputs = 0;
+
+    for (int i = 0; i < numFiles; i++) {
+        const char* fileName = fileNames[i];
+        if (findMember(fat, fileName) != NULL) {
+            fprintf(stderr, "File '%s' is already in the packed file, use -u to replace it.\n", fileName);
+            continue;
+        }
+        int fd = open(fileName, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error opening input file: %s\n", fileName);
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+            close(fd);
+            addDirectoryMember(fat, fileName, verbose);
+            continue;
+        }
+        if (verbose) printf("Adding file %s\n", fileName);
+        addMember(fat, fileName);
+        inputs[numInputs].member = fat->numFiles - 1;
+        inputs[numInputs].fd = fd;
+        numInputs++;
+    }
+
+    packPipelined(archive, fat, inputs, numInputs, jobs, verbose, veryVerbose, "added to");
+    free(inputs);
+}
+
+// Agrega los archivos al empaquetado. Primero, en el orden de los argumentos,
+// se reservan todos los bloques de cada archivo (asi la disposicion no depende
+// del numero de hilos); despues los hilos leen las entradas y escriben sus
+// tramos, y al final se consolidan los tamanos en la tabla.
+void packFiles(FILE* archive, FileAllocationTable* fat, char** fileNames, int numFiles, int jobs, bool ioUring, bool verbose, bool veryVerbose) {
+    if (fat->flags & (ARCHIVE_COMPRESSED | ARCHIVE_DEDUP)) {
+        packPipelinedFiles(archive, fat, fileNames, numFiles, jobs, verbose, veryVerbose);
+        return;
+    }
+
+    size_t* planned = checkedRealloc(NULL, (numFiles ? numFiles : 1) * sizeof(size_t));
+    size_t numPlanned = 0;
+
+    for (int i = 0; i < numFiles; i++) {
+        const char* fileName = fileNames[i];
+        if (findMember(fat, fileName) != NULL) {
+            fprintf(stderr, "File '%s' is already in the packed file, use -u to replace it.\n", fileName);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(fileName, &st) != 0) {
+            fprintf(stderr, "Error opening input file: %s\n", fileName);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            addDirectoryMember(fat, fileName, verbose);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+            FILE* input = fopen(fileName, "rb");
+            if (input == NULL) {
+                fprintf(stderr, "Error opening input file: %s\n", fileName);
+                continue;
+            }
+            if (verbose) printf("Adding file %s\n", fileName);
+            packStream(archive, fat, input, addMember(fat, fileName), veryVerbose);
+            fclose(input);
+            continue;
+        }
+
+        if (verbose) printf("Adding file %s\n", fileName);
+        planned[numPlanned++] = fat->numFiles;
+        FileMetadata* entry = addMember(fat, fileName);
+        entry->fileSize = st.st_size;
+        reserveMemberBlocks(archive, fat, entry, entry->fileSize, veryVerbose);
+    }
+
+    runPackJob(archive, fat, planned, numPlanned, jobs, ioUring, false, verbose, veryVerbose, "added to");
+    free(planned);
+}
+
+// Un directorio del recorrido. Se abre con openat desde el de su padre, que
+// sigue abierto mientras le queden subdirectorios por abrir: ni el recorrido
+// ni las llamadas vuelven a resolver rutas completas.
+typedef struct WalkDir {
+    struct WalkDir* parent; // NULL: argumento, se abre desde el directorio actual
+    char* path;             // Nombre del miembro
+    size_t nameOffset;      // Ultima componente de path, relativa a parent
+    size_t root;            // Argumento del que sale
+    int fd;
+    size_t references;      // Subdirectorios sin abrir + 1 mientras se lee
+} WalkDir;
+
+typedef struct {
+    char* name;
+    size_t root;
+} WalkEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    WalkDir** pending; // Pila: en profundidad, para tener pocos directorios abiertos
+    size_t numPending;
+    size_t pendingCapacity;
+    size_t active;
+    WalkEntry* entries;
+    size_t numEntries;
+    size_t entryCapacity;
+} DirectoryWalk;
+
+// Registro que devuelve getdents64
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+// Con walk->lock tomado
+void pushWalkDir(DirectoryWalk* walk, WalkDir* dir) {
+    if (walk->numPending == walk->pendingCapacity) {
+        walk->pendingCapacity = walk->pendingCapacity ? walk->pendingCapacity * 2 : 64;
+        walk->pending = checkedRealloc(walk->pending, walk->pendingCapacity * sizeof(WalkDir*));
+    }
+    walk->pending[walk->numPending++] = dir;
+    pthread_cond_signal(&walk->ready);
+}
+
+// Con walk->lock tomado
+void addWalkEntries(DirectoryWalk* walk, WalkEntry* entries, size_t count) {
+    if (walk->numEntries + count > walk->entryCapacity) {
+        while (walk->numEntries + count > walk->entryCapacity) {
+            walk->entryCapacity = walk->entryCapacity ? walk->entryCapacity * 2 : 1024;
+        }
+        walk->entries = checkedRealloc(walk->entries, walk->entryCapacity * sizeof(WalkEntry));
+    }
+    memcpy(walk->entries + walk->numEntries, entries, count * sizeof(WalkEntry));
+    walk->numEntries += count;
+}
+
+// Con walk->lock tomado
+void releaseWalkDir(WalkDir* dir) {
+    if (dir == NULL || --dir->references > 0) return;
+    if (dir->fd >= 0) close(dir->fd);
+    free(dir);
+}
+
+// Lee un directorio: los archivos regulares y los subdirectorios pasan a la
+// lista, y los subdirectorios ademas a la pila. d_type evita un fstatat por
+// entrada; solo hace falta en los sistemas de archivos que no lo dan y en los
+// enlaces, que se siguen si llevan a un archivo (a un directorio no, porque
+// podrian formar ciclos).
+void readWalkDir(DirectoryWalk* walk, WalkDir* dir, unsigned char* buffer, size_t bufferSize) {
+    WalkEntry* found = NULL;
+    size_t numFound = 0, capacity = 0;
+    WalkDir** subdirs = NULL;
+    size_t numSubdirs = 0, subdirCapacity = 0;
+    size_t pathLength = strlen(dir->path);
+
+    long got;
+    while ((got = syscall(SYS_getdents64, dir->fd, buffer, bufferSize)) > 0) {
+        for (long pos = 0; pos < got;) {
+            LinuxDirent64* record = (LinuxDirent64*)(buffer + pos);
+            pos += record->d_reclen;
+            const char* name = record->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            unsigned char type = record->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+            if (type == DT_LNK && fstatat(dir->fd, name, &st, 0) == 0 && S_ISREG(st.st_mode)) type = DT_REG;
+            if (type != DT_DIR && type != DT_REG) continue;
+            bool isDirectory = type == DT_DIR;
+
+            size_t nameLength = strlen(name);
+            if (pathLength + 1 + nameLength > PATH_MAX) {
+                fprintf(stderr, "Name too long: %s/%s\n", dir->path, name);
+                continue;
+            }
+            char* path = checkedRealloc(NULL, pathLength + 1 + nameLength + 1);
+            memcpy(path, dir->path, pathLength);
+            path[pathLength] = '/';
+            memcpy(path + pathLength + 1, name, nameLength + 1);
+            if (numFound == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                found = checkedRealloc(found, capacity * sizeof(WalkEntry));
+            }
+            found[numFound++] = (WalkEntry){ path, dir->root };
+
+            if (isDirectory) {
+                if (numSubdirs == subdirCapacity) {
+                    subdirCapacity = subdirCapacity ? subdirCapacity * 2 : 16;
+                    subdirs = checkedRealloc(subdirs, subdirCapacity * sizeof(WalkDir*));
+                }
+                WalkDir* subdir = checkedRealloc(NULL, sizeof(WalkDir));
+                *subdir = (WalkDir){ dir, path, pathLength + 1, dir->root, -1, 1 };
+                subdirs[numSubdirs++] = subdir;
+            }
+        }
+    }
+    if (got < 0) fprintf(stderr, "Error reading directory: %s\n", dir->path);
+
+    pthread_mutex_lock(&walk->lock);
+    addWalkEntries(walk, found, numFound);
+    dir->references += numSubdirs;
+    for (size_t i = numSubdirs; i > 0; i--) pushWalkDir(walk, subdirs[i - 1]);
+    pthread_mutex_unlock(&walk->lock);
+    free(found);
+    free(subdirs);
+}
+
+void* walkWorker(void* arg) {
+    DirectoryWalk* walk = arg;
+    size_t bufferSize = 64 << 10;
+    unsigned char* buffer = checkedRealloc(NULL, bufferSize);
+
+    pthread_mutex_lock(&walk->lock);
+    while (true) {
+        while (walk->numPending == 0 && walk->active > 0) pthread_cond_wait(&walk->ready, &walk->lock);
+        if (walk->numPending == 0) break;
+        WalkDir* dir = walk->pending[--walk->numPending];
+        walk->active++;
+        pthread_mutex_unlock(&walk->lock);
+
+        int parentFd = dir->parent != NULL ? dir->parent->fd : AT_FDCWD;
+        dir->fd = openat(parentFd, dir->path + dir->nameOffset, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd < 0) {
+            fprintf(stderr, "Error opening directory: %s\n", dir->path);
+        } else {
+            readWalkDir(walk, dir, buffer, bufferSize);
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        releaseWalkDir(dir->parent);
+        releaseWalkDir(dir);
+        if (--walk->active == 0 && walk->numPending == 0) pthread_cond_broadcast(&walk->ready);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    free(buffer);
+    return NULL;
+}
+
+// Orden de los nombres dentro de un argumento: por componentes, asi cada
+// directorio va seguido de todo su contenido ("a", "a/b", "a.txt").
+int compareWalkEntries(const void* a, const void* b) {
+    const WalkEntry* x = a;
+    const WalkEntry* y = b;
+    if (x->root != y->root) return (x->root > y->root) - (x->root < y->root);
+    const unsigned char* p = (const unsigned char*)x->name;
+    const unsigned char* q = (const unsigned char*)y->name;
+    while (*p != '\0' && *p == *q) {
+        p++;
+        q++;
+    }
+    int c = *p == '/' ? 1 : *p;
+    int d = *q == '/' ? 1 : *q;
+    return c - d;
+}
+
+// Reemplaza los directorios de la lista de entradas por su contenido, con
+// `jobs` hilos. Los argumentos conservan su orden y lo encontrado dentro de
+// cada uno va ordenado por nombre, asi el resultado no depende de los hilos ni
+// del orden en que el sistema de archivos devuelve las entradas. Los
+// directorios quedan tambien en la lista (para guardarlos como miembros).
+char** walkInputFiles(char** inputs, int numInputs, int jobs, int* numFiles) {
+    DirectoryWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.ready, NULL);
+
+    bool anyDirectory = false;
+    for (int i = 0; i < numInputs; i++) {
+        struct stat st;
+        char* name = inputs[i];
+        addWalkEntries(&walk, &(WalkEntry){ name, i }, 1);
+        if (stat(name, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        // "dir/" se guarda como "dir"
+        size_t length = strlen(name);
+        while (length > 1 && name[length - 1] == '/') length--;
+        name = strndup(name, length);
+        walk.entries[walk.numEntries - 1].name = name;
+        WalkDir* root = checkedRealloc(NULL, sizeof(WalkDir));
+        *root = (WalkDir){ NULL, name, 0, i, -1, 1 };
+        pushWalkDir(&walk, root);
+        anyDirectory = true;
+    }
+
+    if (anyDirectory) {
+        pthread_t* threads = checkedRealloc(NULL, jobs * sizeof(pthread_t));
+        int started = 0;
+        for (int i = 0; i < jobs; i++) {
+            if (pthread_create(&threads[started], NULL, walkWorker, &walk) == 0) started++;
+        }
+        // Sin hilos se recorre desde este
+        if (started == 0) walkWorker(&walk);
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        free(threads);
+        qsort(walk.entries, walk.numEntries, sizeof(WalkEntry), compareWalkEntries);
+    }
+
+    char** files = checkedRealloc(NULL, walk.numEntries * sizeof(char*));
+    for (size_t i = 0; i < walk.numEntries; i++) files[i] = walk.entries[i].name;
+    *numFiles = walk.numEntries;
+    free(walk.entries);
+    free(walk.pending);
+    pthread_cond_destroy(&walk.ready);
+    pthread_mutex_destroy(&walk.lock);
+    return files;
+}
+
+// Crea los directorios que faltan en la ruta de path (y path mismo si
+// withLast). Los nombres llegan ordenados, asi que se recuerda el ultimo
+// directorio creado para no repetir mkdir por cada archivo del mismo.
+void makeDirectories(const char* path, bool withLast, char* lastMade) {
+    size_t end = strlen(path);
+    if (!withLast) {
+        while (end > 0 && path[end - 1] != '/') end--;
+        while (end > 1 && path[end - 1] == '/') end--;
+    }
+    if (end == 0 || end > PATH_MAX) return;
+    if (lastMade != NULL && strncmp(lastMade, path, end) == 0 && lastMade[end] == '\0') return;
+
+    char buffer[PATH_MAX + 1];
+    memcpy(buffer, path, end);
+    buffer[end] = '\0';
+    for (size_t i = 1; i <= end; i++) {
+        if (i < end && buffer[i] != '/') continue;
+        buffer[i] = '\0';
+        if (mkdir(buffer, 0777) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error creating directory: %s\n", buffer);
+            return;
+        }
+        if (i < end) buffer[i] = '/';
+    }
+    if (lastMade != NULL) memcpy(lastMade, buffer, end + 1);
+}
+
+int compareSizes(const void* a, const void* b) {
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+size_t nextPowerOfTwo(size_t value) {
+    size_t power = 1;
+    while (power < value) power <<= 1;
+    return power;
+}
+
+// Tamano de bloque para --block-size auto: con ficheros pequenos conviene un
+// bloque corto (menos relleno y colas mas baratas), pero el numero total de
+// bloques no debe pasar de ~1M para que la tabla y los mapas sigan siendo
+// pequenos. Se toma el mayor de ambos criterios dentro de los limites.
+size_t chooseBlockSize(char** files, int numFiles) {
+    size_t* sizes = checkedRealloc(NULL, numFiles * sizeof(size_t));
+    size_t count = 0, total = 0;
+    for (int i = 0; i < numFiles; i++) {
+        struct stat info;
+        if (stat(files[i], &info) == 0 && S_ISREG(info.st_mode)) {
+            sizes[count++] = info.st_size;
+            total += info.st_size;
+        }
+    }
+    size_t size = DEFAULT_BLOCK_SIZE;
+    if (count > 0) {
+        qsort(sizes, count, sizeof(size_t), compareSizes);
+        size = nextPowerOfTwo(sizes[count / 2] / 16);
+        if (size < nextPowerOfTwo(total >> 20)) size = nextPowerOfTwo(total >> 20);
+        if (size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+        if (size > MAX_BLOCK_SIZE) size = MAX_BLOCK_SIZE;
+    }
+    free(sizes);
+    return size;
+}
+
+void selectBlockSize(struct Data data) {
+    if (data.blockSize == SIZE_MAX) {
+        blockSize = data.numInputFiles > 0 && data.file ? chooseBlockSize(data.inputFiles, data.numInputFiles) : DEFAULT_BLOCK_SIZE;
+        if (data.verbose) printf("Using blocks of %zu bytes\n", blockSize);
+    } else if (data.blockSize != 0) {
+        blockSize = data.blockSize;
+    }
+}
+
+// Nombre de empaquetado "-": stdout al crear, stdin al leer
+bool isStandardStream(const char* archiveName) {
+    return archiveName != NULL && strcmp(archiveName, "-") == 0;
+}
+
+// Un empaquetado en flujo se reconoce por su cabecera; stdin siempre lo es
+bool isStreamedArchive(const char* archiveName) {
+    if (isStandardStream(archiveName)) return true;
+    char magic[4];
+    int fd = archiveName != NULL ? open(archiveName, O_RDONLY) : -1;
+    bool streamed = fd >= 0 && preadFully(fd, magic, sizeof(magic), 0) && memcmp(magic, STREAM_MAGIC, sizeof(magic)) == 0;
+    if (fd >= 0) close(fd);
+    return streamed;
+}
+
+typedef struct {
+    FILE* file;
+    uint64_t offset;
+    bool failed;
+} StreamWriter;
+
+void streamWrite(StreamWriter* writer, const void* data, size_t length) {
+    if (writer->failed || length == 0) return;
+    uint64_t start = statsStart();
+    if (fwrite(data, 1, length, writer->file) != length) writer->failed = true;
+    statsPhase(PHASE_BLOCK_WRITE, start, length);
+    writer->offset += length;
+}
+
+// Escribe un miembro leyendo fd hasta el final; entry queda con sus datos
+// para el indice. Si la lectura falla el miembro se cierra con lo leido.
+bool streamMember(StreamWriter* writer, int fd, const char* name, uint32_t flags, unsigned char* raw, unsigned char* packed,
+                  StreamIndexEntry* entry) {
+    StreamMemberHeader header = { STREAM_MEMBER_MAGIC, strlen(name), flags, 0 };
+    entry->offset = writer->offset;
+    entry->fileSize = 0;
+    entry->storedSize = 0;
+    entry->nameLength = header.nameLength;
+    entry->flags = flags;
+    streamWrite(writer, &header, sizeof(header));
+    streamWrite(writer, name, header.nameLength);
+
+    bool ok = true;
+    while (!(flags & MEMBER_DIRECTORY)) {
+        uint64_t start = statsStart();
+        ssize_t got = readUpTo(fd, raw, blockSize);
+        statsPhase(PHASE_INPUT_READ, start, got);
+        if (got <= 0) {
+            ok = got == 0;
+            break;
+        }
+        StreamChunk chunk = { got, got, crc32c(raw, got), 0 };
+        const unsigned char* data = raw;
+        if (flags & MEMBER_COMPRESSED) {
+            size_t length = lzCompress(raw, got, packed, got - 1);
+            if (length > 0) {
+                chunk.storedLength = length;
+                data = packed;
+            }
+        }
+        streamWrite(writer, &chunk, sizeof(chunk));
+        streamWrite(writer, data, chunk.storedLength);
+        entry->fileSize += got;
+        entry->storedSize += chunk.storedLength;
+    }
+    StreamChunk end = { 0, 0, 0, 0 };
+    streamWrite(writer, &end, sizeof(end));
+    return ok;
+}
+
+// -c con -f -: el empaquetado sale por stdout sin seek ni ftruncate. Dedup
+// necesita volver sobre bloques ya escritos, asi que aqui no esta disponible.
+void createStream(struct Data data) {
+    if (data.dedup) {
+        fprintf(stderr, "Deduplication is not available for streamed packed files.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Refusing to write a packed file to a terminal.\n");
+        exit(EXIT_FAILURE);
+    }
+    // stdout queda solo para el empaquetado: los mensajes pasan a stderr
+    int out = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    StreamWriter writer = { fdopen(out, "wb"), 0, false };
+    if (writer.file == NULL) {
+        fprintf(stderr, "Error opening standard output.\n");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(writer.file, NULL, _IOFBF, COPY_BUFFER_BYTES);
+    selectBlockSize(data);
+
+    uint32_t flags = data.compress ? MEMBER_COMPRESSED : 0;
+    StreamHeader header = { STREAM_MAGIC, STREAM_VERSION, blockSize, data.compress ? ARCHIVE_COMPRESSED : 0 };
+    streamWrite(&writer, &header, sizeof(header));
+
+    unsigned char* raw = allocBlocks(1);
+    unsigned char* packed = allocBlocks(1);
+    size_t numInputs = data.numInputFiles > 0 && data.file ? data.numInputFiles : 1;
+    StreamIndexEntry* entries = checkedRealloc(NULL, numInputs * sizeof(StreamIndexEntry));
+    const char** names = checkedRealloc(NULL, numInputs * sizeof(char*));
+    size_t numEntries = 0;
+    size_t nameBytes = 0;
+
+    for (size_t i = 0; i < numInputs; i++) {
+        const char* name = data.numInputFiles > 0 && data.file ? data.inputFiles[i] : "stdin";
+        int fd = STDIN_FILENO;
+        uint32_t memberFlags = flags;
+        struct stat st;
+        if (data.numInputFiles > 0 && data.file) {
+            fd = open(name, O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr, "Error opening input file: %s\n", name);
+                continue;
+            }
+            if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+                memberFlags = MEMBER_DIRECTORY;
+                if (data.verbose) printf("Adding directory %s\n", name);
+            } else if (data.verbose) {
+                printf("Adding file %s\n", name);
+            }
+        } else if (data.verbose) {
+            printf("Reading data from standard input (stdin)\n");
+        }
+        if (!streamMember(&writer, fd, name, memberFlags, raw, packed, &entries[numEntries])) {
+            fprintf(stderr, "Error reading input file: %s\n", name);
+        }
+        if (fd != STDIN_FILENO) close(fd);
+        names[numEntries++] = name;
+        nameBytes += strlen(name);
+    }
+
+    // Indice y pie: se arman en memoria para calcular el CRC de una vez
+    size_t indexSize = sizeof(StreamMemberHeader) + numEntries * sizeof(StreamIndexEntry) + nameBytes;
+    unsigned char* index = checkedRealloc(NULL, indexSize);
+    StreamMemberHeader indexHeader = { STREAM_INDEX_MAGIC, 0, 0, numEntries };
+    memcpy(index, &indexHeader, sizeof(indexHeader));
+    memcpy(index + sizeof(indexHeader), entries, numEntries * sizeof(StreamIndexEntry));
+    size_t pos = sizeof(indexHeader) + numEntries * sizeof(StreamIndexEntry);
+    for (size_t i = 0; i < numEntries; i++) {
+        memcpy(index + pos, names[i], entries[i].nameLength);
+        pos += entries[i].nameLength;
+    }
+    StreamFooter footer = { STREAM_FOOTER_MAGIC, crc32c(index, indexSize), writer.offset };
+    streamWrite(&writer, index, indexSize);
+    streamWrite(&writer, &footer, sizeof(footer));
+
+    if (fflush(writer.file) != 0) writer.failed = true;
+    fclose(writer.file);
+    if (writer.failed) {
+        fprintf(stderr, "Error writing the packed file.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(index);
+    free(names);
+    free(entries);
+    free(raw);
+    free(packed);
+}
+
+typedef enum {
+    STREAM_EXTRACT,
+    STREAM_VERIFY,
+    STREAM_LIST
+} StreamMode;
+
+bool streamRead(FILE* input, void* buffer, size_t length) {
+    uint64_t start = statsStart();
+    size_t got = fread(buffer, 1, length, input);
+    statsPhase(PHASE_INPUT_READ, start, got);
+    return got == length;
+}
+
+// Abre un empaquetado en flujo (stdin con "-") y adopta su tamano de bloque
+FILE* openStream(const char* archiveName, StreamHeader* header) {
+    FILE* input = isStandardStream(archiveName) ? stdin : fopen(archiveName, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening packed file.\n");
+        return NULL;
+    }
+    setvbuf(input, NULL, _IOFBF, COPY_BUFFER_BYTES);
+    if (!streamRead(input, header, sizeof(StreamHeader)) || memcmp(header->magic, STREAM_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Not a packed file.\n");
+    } else if (header->version != STREAM_VERSION || !validBlockSize(header->blockSize)) {
+        fprintf(stderr, "Unsupported packed file version %u.\n", header->version);
+    } else {
+        blockSize = header->blockSize;
+        return input;
+    }
+    if (input != stdin) fclose(input);
+    return NULL;
+}
+
+// Recorre el flujo de una pasada: extrae los miembros, solo comprueba sus
+// CRC o solo los lista. Al extraer, un nombre repetido reemplaza al anterior.
+bool readStream(const char* archiveName, StreamMode mode, bool verbose, bool veryVerbose) {
+    StreamHeader header;
+    FILE* input = openStream(archiveName, &header);
+    if (input == NULL) return false;
+    if (mode == STREAM_LIST) {
+        printf("Contents of the packaged file:\n");
+        printf("-------------------------------\n");
+    }
+
+    unsigned char* raw = allocBlocks(1);
+    unsigned char* packed = allocBlocks(1);
+    char* name = checkedRealloc(NULL, PATH_MAX + 1);
+    char* lastMade = checkedRealloc(NULL, PATH_MAX + 1);
+    lastMade[0] = '\0';
+    bool ok = true;
+    bool damaged = false;
+    size_t numMembers = 0;
+    while (ok) {
+        StreamMemberHeader member;
+        if (!streamRead(input, &member, sizeof(member))) {
+            fprintf(stderr, "Truncated packed file.\n");
+            ok = false;
+            break;
+        }
+        if (memcmp(member.magic, STREAM_INDEX_MAGIC, sizeof(member.magic)) == 0) break;
+        if (memcmp(member.magic, STREAM_MEMBER_MAGIC, sizeof(member.magic)) != 0 || member.nameLength == 0 ||
+            member.nameLength > PATH_MAX || !streamRead(input, name, member.nameLength)) {
+            fprintf(stderr, "Corrupted packed file.\n");
+            ok = false;
+            break;
+        }
+        name[member.nameLength] = '\0';
+        numMembers++;
+
+        int fd = -1;
+        if (mode == STREAM_EXTRACT && !safeMemberName(name)) {
+            // Los datos se leen igual para seguir con el miembro siguiente
+            fprintf(stderr, "Skipping member with an unsafe name: %s\n", name);
+            damaged = true;
+        } else if (mode == STREAM_EXTRACT && (member.flags & MEMBER_DIRECTORY)) {
+            makeDirectories(name, true, lastMade);
+            if (verbose) printf("Extracting directory: %s\n", name);
+        } else if (mode == STREAM_EXTRACT) {
+            makeDirectories(name, false, lastMade);
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                fprintf(stderr, "Error creating output file: %s\n", name);
+            } else if (verbose) {
+                printf("Extracting file: %s\n", name);
+            }
+        }
+
+        size_t fileSize = 0;
+        size_t stored = 0;
+        for (size_t block = 1; ok; block++) {
+            StreamChunk chunk;
+            if (!streamRead(input, &chunk, sizeof(chunk))) {
+                fprintf(stderr, "Truncated packed file.\n");
+                ok = false;
+                break;
+            }
+            if (chunk.rawLength == 0) break;
+            bool plain = chunk.storedLength == chunk.rawLength;
+            if (chunk.rawLength > blockSize || chunk.storedLength == 0 || chunk.storedLength > chunk.rawLength ||
+                !streamRead(input, plain ? raw : packed, chunk.storedLength)) {
+                fprintf(stderr, "Corrupted packed file.\n");
+                ok = false;
+                break;
+            }
+            fileSize += chunk.rawLength;
+            stored += chunk.storedLength;
+            if (mode == STREAM_LIST) continue;
+
+            if ((!plain && !lzDecompress(packed, chunk.storedLength, raw, chunk.rawLength)) ||
+                crc32c(raw, chunk.rawLength) != chunk.checksum) {
+                fprintf(stderr, "Checksum mismatch in block %zu of the file %s\n", block, name);
+                damaged = true;
+            } else if (veryVerbose) {
+                printf("Block %zu of the file %s checked\n", block, name);
+            }
+            if (fd >= 0) {
+                uint64_t start = statsStart();
+                if (!pwriteFully(fd, raw, chunk.rawLength, fileSize - chunk.rawLength)) {
+                    fprintf(stderr, "Error extracting block %zu of the file %s\n", block, name);
+                    damaged = true;
+                }
+                statsPhase(PHASE_BLOCK_WRITE, start, chunk.rawLength);
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (mode == STREAM_LIST && (member.flags & MEMBER_DIRECTORY)) {
+            printf("%s/\n", name);
+        } else if (mode == STREAM_LIST) {
+            printf("%s\t%zu bytes\n", name, fileSize);
+            if (verbose && (member.flags & MEMBER_COMPRESSED)) printf("  Compressed: %zu bytes\n", stored);
+        }
+    }
+    if (ok && verbose && mode == STREAM_VERIFY) {
+        printf("%zu files checked%s\n", numMembers, damaged ? ", some blocks are damaged" : "");
+    }
+
+    free(lastMade);
+    free(name);
+    free(raw);
+    free(packed);
+    if (input != stdin) fclose(input);
+    return ok && !damaged;
+}
+
+// Lista usando el indice del final si el empaquetado admite seek; si no (o
+// si el indice no cuadra, como con un flujo cortado) se recorre entero.
+void listStream(const char* archiveName, bool verbose) {
+    FILE* input = isStandardStream(archiveName) ? NULL : fopen(archiveName, "rb");
+    StreamFooter footer;
+    struct stat st;
+    unsigned char* index = NULL;
+    size_t indexSize = 0;
+    if (input != NULL && fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode) &&
+        (size_t)st.st_size >= sizeof(StreamHeader) + sizeof(StreamMemberHeader) + sizeof(StreamFooter) &&
+        preadFully(fileno(input), &footer, sizeof(footer), st.st_size - sizeof(footer)) &&
+        memcmp(footer.magic, STREAM_FOOTER_MAGIC, sizeof(footer.magic)) == 0 &&
+        footer.indexOffset >= sizeof(StreamHeader) && footer.indexOffset + sizeof(StreamMemberHeader) + sizeof(footer) <= (size_t)st.st_size) {
+        indexSize = st.st_size - sizeof(footer) - footer.indexOffset;
+        index = checkedRealloc(NULL, indexSize);
+        if (!preadFully(fileno(input), index, indexSize, footer.indexOffset) || crc32c(index, indexSize) != footer.checksum) {
+            free(index);
+            index = NULL;
+        }
+    }
+    if (input != NULL) fclose(input);
+
+    StreamMemberHeader header;
+    if (index != NULL) memcpy(&header, index, sizeof(header));
+    size_t entriesEnd = sizeof(header) + (index != NULL ? header.count * sizeof(StreamIndexEntry) : 0);
+    if (index == NULL || memcmp(header.magic, STREAM_INDEX_MAGIC, sizeof(header.magic)) != 0 || entriesEnd > indexSize) {
+        free(index);
+        readStream(archiveName, STREAM_LIST, verbose, false);
+        return;
+    }
 
-            fclose(inputFile);
+    printf("Contents of the packaged file:\n");
+    printf("-------------------------------\n");
+    size_t pos = entriesEnd;
+    for (size_t i = 0; i < header.count; i++) {
+        StreamIndexEntry entry;
+        memcpy(&entry, index + sizeof(header) + i * sizeof(entry), sizeof(entry));
+        if (entry.nameLength > indexSize - pos) {
+            fprintf(stderr, "Corrupted packed file index.\n");
+            break;
         }
-    } else {
-        if (data.verbose) {
-            printf("Reading data from standard input (stdin)\n");
+        if (entry.flags & MEMBER_DIRECTORY) {
+            printf("%.*s/\n", (int)entry.nameLength, (const char*)index + pos);
+        } else {
+            printf("%.*s\t%zu bytes\n", (int)entry.nameLength, (const char*)index + pos, (size_t)entry.fileSize);
         }
+        if (verbose && (entry.flags & MEMBER_COMPRESSED)) printf("  Compressed: %zu bytes\n", (size_t)entry.storedSize);
+        if (verbose) printf("  Offset: %zu\n", (size_t)entry.offset);
+        pos += entry.nameLength;
+    }
+    free(index);
+}
 
-        size_t fileSize = 0;
-        Block block;
-        size_t bytesRead;
-        while ((bytesRead = fread(&block, 1, sizeof(Block), stdin)) > 0) {
-            size_t blockPosition = findFreeBlock(&fat);
-            if (blockPosition == (size_t)-1) {
-                expandArchive(archive, &fat);
-                blockPosition = findFreeBlock(&fat);
-            }
+void createArchive(struct Data data) {
+    if (data.verbose) printf("Creating the file %s\n", data.outputFile);
+    // Se vacia recien con los candados: si el empaquetado existe y se esta
+    // usando, se espera a su escritor y a sus lectores
+    int fd = open(data.outputFile, O_RDWR | O_CREAT, 0666);
+    FILE* archive = fd >= 0 ? fdopen(fd, "wb+") : NULL;
 
-            if (bytesRead < sizeof(Block)) {
-                memset((char*)&block + bytesRead, 0, sizeof(Block) - bytesRead);
-            }
+    if (archive == NULL) {
+        fprintf(stderr, "Error opening the file %s\n", data.outputFile);
+        exit(EXIT_FAILURE);
+    }
+    lockRange(fd, F_WRLCK, LOCK_WRITER, 1, true);
+    lockRange(fd, F_WRLCK, LOCK_SNAPSHOTS, 0, true);
+    lockRange(fd, F_WRLCK, LOCK_METADATA, 1, true);
+    truncateFile(fd, 0);
+    lockRange(fd, F_UNLCK, LOCK_METADATA, 1, false);
 
-            writeBlock(archive, &block, blockPosition);
-            updateFAT(&fat, "stdin", fileSize, blockPosition, bytesRead);
+    selectBlockSize(data);
 
-            fileSize += bytesRead;
+    FileAllocationTable fat;
+    memset(&fat, 0, sizeof(FileAllocationTable));
+    if (data.compress) fat.flags |= ARCHIVE_COMPRESSED;
+    if (data.dedup) fat.flags |= ARCHIVE_DEDUP;
+    writeFAT(archive, &fat);
 
-            if (data.veryVerbose) {
-                printf("Block %zu read from stdin and written to position %zu\n", blockPosition, blockPosition);
-            }
+    if (data.numInputFiles > 0 && data.file) {
+        packFiles(archive, &fat, data.inputFiles, data.numInputFiles, data.jobs, data.ioUring, data.verbose, data.veryVerbose);
+    } else {
+        if (data.verbose) {
+            printf("Reading data from standard input (stdin)\n");
         }
+        packStandardInput(archive, &fat, "stdin", data.jobs, data.veryVerbose);
     }
 
     writeFAT(archive, &fat);
+    freeFAT(&fat);
     fclose(archive);
 }
 
-void extractArchive(const char* archiveName, bool verbose, bool veryVerbose) {
+void extractArchive(const char* archiveName, bool verbose, bool veryVerbose, int jobs, bool ioUring) {
     FILE* archive = fopen(archiveName, "rb");
     if (archive == NULL) {
         fprintf(stderr, "Error opening packed file.\n");
@@ -225,40 +4540,157 @@ void extractArchive(const char* archiveName, bool verbose, bool veryVerbose) {
     }
 
     FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
+
+    CopyJob job;
+    initCopyJob(&job, &fat, fileno(archive), false, ioUring, verbose, veryVerbose);
 
+    // Vista de solo lectura: el CRC se comprueba y se escribe desde ella
+    struct stat st;
+    if (!ioUring && !directIo && fstat(job.archiveFd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, job.archiveFd, 0);
+        if (map != MAP_FAILED) {
+            job.io.mapFd = job.archiveFd;
+            job.io.map = map;
+            job.io.mapSize = st.st_size;
+        }
+    }
+    // Los directorios se crean antes de repartir los miembros entre los hilos
+    char lastMade[PATH_MAX + 1] = "";
+    size_t capacity = 0;
     for (size_t i = 0; i < fat.numFiles; i++) {
-        FileMetadata entry = fat.files[i];
-        FILE* outputFile = fopen(entry.fileName, "wb");
-        if (outputFile == NULL) {
-            fprintf(stderr, "Error creating output file: %s\n", entry.fileName);
+        FileMetadata* entry = &fat.files[i];
+        if (entry->flags & MEMBER_DELETED) continue;
+        if (!safeMemberName(entry->fileName)) {
+            fprintf(stderr, "Skipping member with an unsafe name: %s\n", entry->fileName);
             continue;
         }
-
-        if (verbose) {
-            printf("Extracting file: %s\n", entry.fileName);
+        makeDirectories(entry->fileName, entry->flags & MEMBER_DIRECTORY, lastMade);
+        if (entry->flags & MEMBER_DIRECTORY) {
+            if (verbose) printf("Extracting directory: %s\n", entry->fileName);
+            continue;
         }
+        addMemberTasks(&job, i, &capacity);
+    }
+    runCopyJob(&job, jobs);
 
-        size_t fileSize = 0;
-        for (size_t j = 0; j < entry.numBlocks; j++) {
-            Block block;
-            fseek(archive, entry.blockPositions[j], SEEK_SET);
-            fread(&block, sizeof(Block), 1, archive);
+    if (job.io.map != NULL) {
+        munmap((void*)job.io.map, job.io.mapSize);
+    }
+    destroyCopyJob(&job);
+    freeFAT(&fat);
+    fclose(archive);
+}
+
+void* verifyWorker(void* arg) {
+    VerifyJob* job = arg;
+    unsigned char* buffer = allocBlocks(EXTRACT_TASK_BLOCKS);
+    size_t numChunks = (job->fat->numBlocks + EXTRACT_TASK_BLOCKS - 1) / EXTRACT_TASK_BLOCKS;
+    size_t chunk;
+    while ((chunk = atomic_fetch_add(&job->nextChunk, 1)) < numChunks) {
+        size_t end = (chunk + 1) * EXTRACT_TASK_BLOCKS;
+        if (end > job->fat->numBlocks) end = job->fat->numBlocks;
+        size_t b = chunk * EXTRACT_TASK_BLOCKS;
+        while (b < end) {
+            if (job->owners[b] == SIZE_MAX) {
+                b++;
+                continue;
+            }
+            // Serie de bloques en uso: una sola lectura
+            size_t run = b + 1;
+            while (run < end && job->owners[run] != SIZE_MAX) run++;
+            uint64_t start = statsStart();
+            bool readOk = preadFully(job->archiveFd, buffer, (run - b) * blockSize, blockOffset(b));
+            statsPhase(PHASE_INPUT_READ, start, (run - b) * blockSize);
+            for (size_t k = b; k < run; k++) {
+                const char* name = job->fat->files[job->owners[k]].fileName;
+                if (readOk && crc32c(buffer + (k - b) * blockSize, blockSize) == job->fat->blockChecksums[k]) {
+                    atomic_fetch_add(&job->verified, 1);
+                    continue;
+                }
+                atomic_fetch_add(&job->corrupted, 1);
+                pthread_mutex_lock(&job->lock);
+                if (readOk) {
+                    fprintf(stderr, "Block %zu of the file '%s' is corrupted.\n", k, name);
+                } else {
+                    fprintf(stderr, "Error reading block %zu of the file '%s'.\n", k, name);
+                }
+                pthread_mutex_unlock(&job->lock);
+            }
+            b = run;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
 
-            size_t bytesToWrite = (fileSize + sizeof(Block) > entry.fileSize) ? entry.fileSize - fileSize : sizeof(Block);
-            fwrite(&block, 1, bytesToWrite, outputFile);
+// Comprueba el CRC32C de cada bloque en uso sin extraer nada. Los bloques
+// compartidos por deduplicacion se leen una sola vez.
+bool verifyArchive(const char* archiveName, int jobs, bool verbose) {
+    FILE* archive = fopen(archiveName, "rb");
+    if (archive == NULL) {
+        fprintf(stderr, "Error opening packed file.\n");
+        return false;
+    }
 
-            fileSize += bytesToWrite;
+    FileAllocationTable fat;
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return false;
+    }
 
-            if (veryVerbose) {
-                printf("Block %zu of the file %s extracted from the position %zu\n", j + 1, entry.fileName, entry.blockPositions[j]);
+    VerifyJob job;
+    job.fat = &fat;
+    job.archiveFd = fileno(archive);
+    job.owners = checkedRealloc(NULL, (fat.numBlocks ? fat.numBlocks : 1) * sizeof(size_t));
+    for (size_t b = 0; b < fat.numBlocks; b++) {
+        job.owners[b] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < fat.numFiles; i++) {
+        if (fat.files[i].flags & MEMBER_DELETED) continue;
+        for (size_t k = 0; k < fat.files[i].numExtents; k++) {
+            Extent* e = &fat.files[i].extents[k];
+            if (e->start == HOLE_EXTENT) continue;
+            for (size_t b = e->start; b < e->start + e->length; b++) {
+                job.owners[b] = i;
             }
         }
+        if (fat.files[i].tailLength > 0) job.owners[fat.files[i].tailBlock] = i;
+    }
+    atomic_init(&job.nextChunk, 0);
+    atomic_init(&job.verified, 0);
+    atomic_init(&job.corrupted, 0);
+    pthread_mutex_init(&job.lock, NULL);
+    job.verbose = verbose;
+    posix_fadvise(job.archiveFd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        fclose(outputFile);
+    size_t numChunks = (fat.numBlocks + EXTRACT_TASK_BLOCKS - 1) / EXTRACT_TASK_BLOCKS;
+    if ((size_t)jobs > numChunks) jobs = numChunks ? (int)numChunks : 1;
+    pthread_t* threads = checkedRealloc(NULL, jobs * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < jobs; t++) {
+        if (pthread_create(&threads[started], NULL, verifyWorker, &job) == 0) {
+            started++;
+        }
+    }
+    verifyWorker(&job);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
     }
+    free(threads);
 
+    size_t corrupted = atomic_load(&job.corrupted);
+    if (verbose || corrupted > 0) {
+        printf("%zu blocks verified, %zu corrupted.\n", atomic_load(&job.verified), corrupted);
+    }
+    pthread_mutex_destroy(&job.lock);
+    free(job.owners);
+    freeFAT(&fat);
     fclose(archive);
+    return corrupted == 0;
 }
 
 void deleteFilesFromArchive(const char* archiveName, char** fileNames, int numFiles, bool verbose, bool veryVerbose) {
@@ -269,48 +4701,43 @@ void deleteFilesFromArchive(const char* archiveName, char** fileNames, int numFi
     }
 
     FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
 
     for (int i = 0; i < numFiles; i++) {
         const char* fileName = fileNames[i];
-        bool fileFound = false;
-
-        for (size_t j = 0; j < fat.numFiles; j++) {
-            if (strcmp(fat.files[j].fileName, fileName) == 0) {
-                fileFound = true;
-
-                for (size_t k = 0; k < fat.files[j].numBlocks; k++) {
-                    fat.freeBlocks[fat.numFreeBlocks++] = fat.files[j].blockPositions[k];
-                    if (veryVerbose) {
-                        printf("Block %zu of file '%s' marked as free.\n", fat.files[j].blockPositions[k], fileName);
-                    }
-                }
-
-                for (size_t k = j; k < fat.numFiles - 1; k++) {
-                    fat.files[k] = fat.files[k + 1];
-                }
-                fat.numFiles--;
+        FileMetadata* entry = findMember(&fat, fileName);
 
-                if (verbose) {
-                    printf("File '%s' removed from packed file.\n", fileName);
-                }
+        if (entry == NULL) {
+            fprintf(stderr, "File '%s' not found in packed file.\n", fileName);
+            continue;
+        }
 
-                break;
+        if (veryVerbose) {
+            for (size_t k = 0; k < entry->numExtents; k++) {
+                if (entry->extents[k].start == HOLE_EXTENT) continue;
+                printf("Blocks %zu-%zu of file '%s' marked as free.\n", (size_t)entry->extents[k].start,
+                       (size_t)(entry->extents[k].start + entry->extents[k].length - 1), fileName);
             }
         }
+        removeMember(&fat, entry);
 
-        if (!fileFound) {
-            fprintf(stderr, "File '%s' not found in packed file.\n", fileName);
+        if (verbose) {
+            printf("File '%s' removed from packed file.\n", fileName);
         }
     }
 
-    fseek(archive, 0, SEEK_SET);
-    fwrite(&fat, sizeof(FileAllocationTable), 1, archive);
+    writeFAT(archive, &fat);
+    freeFAT(&fat);
 
     fclose(archive);
 }
 
-void updateFilesInArchive(const char* archiveName, char** fileNames, int numFiles, bool verbose, bool veryVerbose) {
+// Reemplaza el contenido de los miembros. Se liberan sus bloques, se reservan
+// los del nuevo tamano y la copia se hace con los mismos hilos que al agregar.
+void updateFilesInArchive(const char* archiveName, char** fileNames, int numFiles, int jobs, bool ioUring, bool verbose, bool veryVerbose) {
     FILE* archive = fopen(archiveName, "rb+");
     if (archive == NULL) {
         fprintf(stderr, "Error opening packed file.\n");
@@ -318,75 +4745,387 @@ void updateFilesInArchive(const char* archiveName, char** fileNames, int numFile
     }
 
     FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
+
+    size_t* planned = checkedRealloc(NULL, (numFiles ? numFiles : 1) * sizeof(size_t));
+    size_t numPlanned = 0;
+    PackInput* inputs = checkedRealloc(NULL, (numFiles ? numFiles : 1) * sizeof(PackInput));
+    size_t numInputs = 0;
+    bool pipelined = fat.flags & (ARCHIVE_COMPRESSED | ARCHIVE_DEDUP);
 
     for (int i = 0; i < numFiles; i++) {
         const char* fileName = fileNames[i];
-        bool fileFound = false;
+        FileMetadata* entry = findMember(&fat, fileName);
+
+        if (entry == NULL) {
+            fprintf(stderr, "File '%s' not found in packed file.\n", fileName);
+            continue;
+        }
+        if (entry->flags & MEMBER_DIRECTORY) continue;
 
-        for (size_t j = 0; j < fat.numFiles; j++) {
-            if (strcmp(fat.files[j].fileName, fileName) == 0) {
-                fileFound = true;
+        size_t member = entry - fat.files;
+        bool repeated = false;
+        for (size_t p = 0; p < numPlanned; p++) {
+            repeated |= planned[p] == member;
+        }
+        for (size_t p = 0; p < numInputs; p++) {
+            repeated |= inputs[p].member == member;
+        }
+        struct stat st;
+        int fd = -1;
+        if (repeated || stat(fileName, &st) != 0 || (pipelined ? (fd = open(fileName, O_RDONLY)) < 0 : access(fileName, R_OK) != 0)) {
+            if (!repeated) fprintf(stderr, "Error opening input file: %s\n", fileName);
+            continue;
+        }
 
-                for (size_t k = 0; k < fat.files[j].numBlocks; k++) {
-                    fat.freeBlocks[fat.numFreeBlocks++] = fat.files[j].blockPositions[k];
-                    if (veryVerbose) {
-                        printf("Block %zu of file '%s' marked as free.\n", fat.files[j].blockPositions[k], fileName);
-                    }
-                }
+        if (!pipelined && S_ISREG(st.st_mode)) {
+            // Se escriben solo los bloques que cambiaron, en bloques nuevos
+            entry->fileSize = st.st_size;
+            resizeMemberBlocks(archive, &fat, entry, entry->fileSize, veryVerbose);
+            planned[numPlanned++] = member;
+            continue;
+        }
 
-                FILE* inputFile = fopen(fileName, "rb");
-                if (inputFile == NULL) {
-                    fprintf(stderr, "Error opening input file: %s\n", fileName);
-                    continue;
-                }
+        if (veryVerbose) {
+            for (size_t k = 0; k < entry->numExtents; k++) {
+                if (entry->extents[k].start == HOLE_EXTENT) continue;
+                printf("Blocks %zu-%zu of file '%s' marked as free.\n", (size_t)entry->extents[k].start,
+                       (size_t)(entry->extents[k].start + entry->extents[k].length - 1), fileName);
+            }
+        }
+        releaseExtents(&fat, entry);
 
-                size_t fileSize = 0;
-                size_t blockCount = 0;
-                Block block;
-                size_t bytesRead;
-                while ((bytesRead = fread(&block, 1, sizeof(Block), inputFile)) > 0) {
-                    size_t blockPosition = findFreeBlock(&fat);
-                    if (blockPosition == (size_t)-1) {
-                        expandArchive(archive, &fat);
-                        blockPosition = findFreeBlock(&fat);
-                    }
+        if (pipelined) {
+            inputs[numInputs].member = member;
+            inputs[numInputs].fd = fd;
+            numInputs++;
+            continue;
+        }
 
-                    writeBlock(archive, &block, blockPosition);
-                    fat.files[j].blockPositions[blockCount++] = blockPosition;
+        FILE* input = fopen(fileName, "rb");
+        entry->fileSize = 0;
+        if (input != NULL) {
+            packStream(archive, &fat, input, entry, veryVerbose);
+            fclose(input);
+        }
+        if (verbose) {
+            printf("File '%s' updated in the packed file (%zu bytes).\n", fileName, entry->fileSize);
+        }
+    }
 
-                    fileSize += bytesRead;
+    runPackJob(archive, &fat, planned, numPlanned, jobs, ioUring, true, verbose, veryVerbose, "updated in");
+    if (numInputs > 0) {
+        packPipelined(archive, &fat, inputs, numInputs, jobs, verbose, veryVerbose, "updated in");
+    }
+    free(planned);
+    free(inputs);
 
-                    if (veryVerbose) {
-                        printf("Block %zu of the file '%s' updated in position %zu\n", blockCount, fileName, blockPosition);
-                    }
-                }
+    writeFAT(archive, &fat);
+    freeFAT(&fat);
 
-                fat.files[j].fileSize = fileSize;
-                fat.files[j].numBlocks = blockCount;
+    fclose(archive);
+}
 
-                fclose(inputFile);
+// Mueve hacia el inicio un rango que se solapa consigo mismo, como memmove:
+// cada tramo se lee entero antes de escribir encima.
+ssize_t moveOverlapping(IoEngine* engine, CopyOp* op) {
+    size_t limit = (engine->uring ? URING_QUEUE_DEPTH : copyBufferBlocks()) * blockSize;
+    size_t total = 0;
+    uint64_t start = statsStart();
+    while (total < op->length) {
+        size_t chunk = op->length - total;
+        if (chunk > limit) chunk = limit;
+        if (!preadFully(op->srcFd, engine->buffers, chunk, op->srcOffset + total) ||
+            !pwriteFully(op->dstFd, engine->buffers, chunk, op->dstOffset + total)) {
+            return -1;
+        }
+        total += chunk;
+    }
+    statsPhase(PHASE_BLOCK_WRITE, start, total);
+    return total;
+}
 
-                if (verbose) {
-                    printf("File '%s' updated in the packed file.\n", fileName);
-                }
+// Envia los movimientos acumulados y vacia el lote. Los que se solapan
+// consigo mismos no pueden ir por copy_file_range ni en paralelo. Devuelve
+// false si alguno fallo.
+bool flushMoves(IoEngine* engine, CopyOp* moves, size_t* num_moves) {
+    CopyOp direct[DEFRAG_BATCH_MOVES];
+    size_t num_direct = 0;
+    bool ok = true;
+    for (size_t i = 0; i < *num_moves; i++) {
+        CopyOp* move = &moves[i];
+        if (move->dstOffset < move->srcOffset && move->dstOffset + move->length > move->srcOffset) {
+            move->copied = moveOverlapping(engine, move);
+        } else {
+            direct[num_direct++] = *move;
+        }
+    }
+    ioCopy(engine, direct, num_direct);
+    for (size_t i = 0; i < num_direct; i++) {
+        if (direct[i].copied != (ssize_t)direct[i].length) {
+            fprintf(stderr, "Error moving block %zu\n", (size_t)((direct[i].srcOffset - HEADER_SIZE) / blockSize));
+            ok = false;
+        }
+    }
+    for (size_t i = 0; i < *num_moves; i++) {
+        if (moves[i].copied < 0) {
+            fprintf(stderr, "Error moving block %zu\n", (size_t)((moves[i].srcOffset - HEADER_SIZE) / blockSize));
+            ok = false;
+        }
+    }
+    *num_moves = 0;
+    return ok;
+}
 
-                break;
+// Agrega el movimiento de un bloque al lote. Si sigue al ultimo movimiento en
+// origen y destino se extiende ese (hacia el inicio puede solaparse: se copia
+// en orden). Los movimientos de un lote se ejecutan sin orden entre ellos, asi
+// que antes de aceptar uno que lea o escriba un bloque que otro del lote
+// escribe o lee se envia el lote; el resultado es el mismo que copiando en el
+// orden del plan. Devuelve false si fallo un lote enviado.
+bool queueMove(IoEngine* engine, int fd, CopyOp* moves, size_t* num_moves, size_t from, size_t to) {
+    size_t src = blockOffset(from);
+    size_t dst = blockOffset(to);
+    CopyOp* last = *num_moves > 0 ? &moves[*num_moves - 1] : NULL;
+    bool extend = last != NULL && last->length < DEFRAG_RUN_BLOCKS * blockSize &&
+                  last->srcOffset + last->length == src && last->dstOffset + last->length == dst &&
+                  (dst < src || last->dstOffset >= src + blockSize);
+    bool ok = true;
+
+    size_t others = extend ? *num_moves - 1 : *num_moves;
+    for (size_t i = 0; i < others; i++) {
+        CopyOp* move = &moves[i];
+        if ((dst < move->srcOffset + move->length && move->srcOffset < dst + blockSize) ||
+            (src < move->dstOffset + move->length && move->dstOffset < src + blockSize)) {
+            ok = flushMoves(engine, moves, num_moves);
+            extend = false;
+            break;
+        }
+    }
+    if (extend) {
+        last->length += blockSize;
+        return ok;
+    }
+
+    if (*num_moves == DEFRAG_BATCH_MOVES) {
+        ok = flushMoves(engine, moves, num_moves) && ok;
+    }
+    CopyOp* move = &moves[(*num_moves)++];
+    memset(move, 0, sizeof(CopyOp));
+    move->srcFd = fd;
+    move->srcOffset = src;
+    move->dstFd = fd;
+    move->dstOffset = dst;
+    move->length = blockSize;
+    return ok;
+}
+
+double elapsedSeconds(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+// Junta los fragmentos de cola de los bloques que estan a menos de la mitad
+// en bloques nuevos, llenos, antes de compactar. Un bloque que no pasa su
+// CRC32C se deja donde esta para no copiar datos danados con un CRC valido.
+// Los bloques que se vacian quedan pendientes hasta confirmar: no se pisan
+// mientras la foto anterior los use.
+size_t repackTails(FILE* archive, FileAllocationTable* fat, bool very_verbose) {
+    size_t num_sparse = 0;
+    bool *sparse = calloc(fat->numBlocks ? fat->numBlocks : 1, sizeof(bool));
+    if (sparse == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t b = 0; b < fat->numBlocks; b++) {
+        sparse[b] = fat->fragmentBytes[b] > 0 && fat->fragmentBytes[b] < blockSize / 2;
+        if (sparse[b]) num_sparse++;
+    }
+    size_t moved = 0;
+    if (num_sparse < 2) {
+        free(sparse);
+        return 0;
+    }
+
+    int fd = fileno(archive);
+    unsigned char *buffer = allocBlocks(1);
+    size_t cached = SIZE_MAX;
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        FileMetadata *entry = &fat->files[i];
+        if ((entry->flags & MEMBER_DELETED) || entry->tailLength == 0 || !sparse[entry->tailBlock]) continue;
+        size_t from = entry->tailBlock;
+        if (cached != from) {
+            cached = SIZE_MAX;
+            if (!preadFully(fd, buffer, blockSize, blockOffset(from)) ||
+                crc32c(buffer, blockSize) != fat->blockChecksums[from]) {
+                sparse[from] = false;
+                continue;
             }
+            cached = from;
         }
+        size_t offset = entry->tailOffset;
+        size_t length = entry->tailLength;
+        releaseTail(fat, entry);
+        placeTail(archive, fat, entry, length, very_verbose);
+        if (!pwriteFully(fd, buffer + offset, length, blockOffset(entry->tailBlock) + entry->tailOffset)) {
+            fprintf(stderr, "Error writing block %zu of the packed file.\n", entry->tailBlock);
+        }
+        if (very_verbose) {
+            printf("Tail of '%s' moved from position %zu to position %zu\n", entry->fileName, from, entry->tailBlock);
+        }
+        moved++;
+    }
+    free(buffer);
+    free(sparse);
+    finishTailBlocks(archive, fat);
+    return moved;
+}
 
-        if (!fileFound) {
-            fprintf(stderr, "File '%s' not found in packed file.\n", fileName);
+
+// Agranda las tablas de la desfragmentacion para cubrir `blocks` posiciones.
+void growDefragState(DefragState* state, size_t blocks) {
+    if (blocks <= state->capacity) return;
+    state->target = checkedRealloc(state->target, blocks * sizeof(size_t));
+    state->busy = checkedRealloc(state->busy, blocks * sizeof(bool));
+    for (size_t p = state->capacity; p < blocks; p++) {
+        state->target[p] = SIZE_MAX;
+        state->busy[p] = false;
+    }
+    state->capacity = blocks;
+}
+
+// Anota el movimiento en la ronda: desde ahora el bloque esta en `to`.
+void planDefragMove(DefragState* state, DefragMove* plan, size_t* count, size_t from, size_t to) {
+    plan[(*count)++] = (DefragMove){ from, to };
+    size_t destination = state->target[from];
+    state->target[to] = destination;
+    state->waiting[destination] = to;
+    state->target[from] = SIZE_MAX;
+    state->busy[to] = true;
+}
+
+// Planea una ronda de hasta `limit` movimientos, todos hacia bloques libres en
+// la foto confirmada: una caida a mitad de ronda no pisa nada que usen los
+// metadatos. Un bloque va a su destino si esta libre; si lo ocupa otro, ese
+// sale (a su propio destino o, si tampoco esta libre, detras de los bloques
+// vivos) y el lugar queda libre al confirmar la ronda. Los lugares que todavia
+// ve algun lector se saltean.
+size_t planDefragRound(FILE* archive, FileAllocationTable* fat, DefragState* state, size_t limit, DefragMove* plan) {
+    size_t count = 0;
+    for (size_t p = state->next; p < state->live && count < limit; p++) {
+        size_t block = state->waiting[p];
+        if (block == p) {
+            if (p == state->next) state->next++;
+            continue;
+        }
+        if (state->busy[block]) continue;
+        if (claimBlockRange(fat, p, 1)) {
+            planDefragMove(state, plan, &count, block, p);
+            continue;
+        }
+        if (state->target[p] == SIZE_MAX || state->busy[p]) continue;
+        size_t to = state->target[p];
+        if (!claimBlockRange(fat, to, 1)) {
+            to = firstFreeBlock(fat, state->live);
+            if (to == SIZE_MAX) {
+                expandArchive(archive, fat, 1);
+                growDefragState(state, fat->numBlocks);
+                to = firstFreeBlock(fat, state->live);
+            }
+            claimBlockRange(fat, to, 1);
+        }
+        planDefragMove(state, plan, &count, p, to);
+    }
+    return count;
+}
+
+int compareDefragMoves(const void* a, const void* b) {
+    size_t x = ((const DefragMove*)a)->from;
+    size_t y = ((const DefragMove*)b)->from;
+    return (x > y) - (x < y);
+}
+
+// Primer movimiento (ordenados por origen) que sale de `block` o de despues.
+size_t findDefragMove(const DefragMove* plan, size_t count, size_t block) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (plan[middle].from < block) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+size_t movedBlock(const DefragMove* plan, size_t count, size_t block) {
+    size_t i = findDefragMove(plan, count, block);
+    return i < count && plan[i].from == block ? plan[i].to : block;
+}
+
+// Lleva los CRC, huellas, referencias y fragmentos de los bloques movidos a
+// su nueva posicion y cambia los extents de los miembros que los usan. Los
+// origenes quedan pendientes: la foto confirmada los sigue usando.
+void applyDefragRound(FileAllocationTable* fat, DefragMove* plan, size_t count) {
+    qsort(plan, count, sizeof(DefragMove), compareDefragMoves);
+    for (size_t i = 0; i < count; i++) {
+        size_t from = plan[i].from;
+        size_t to = plan[i].to;
+        fat->blockChecksums[to] = fat->blockChecksums[from];
+        fat->blockHashes[to] = fat->blockHashes[from];
+        fat->refCounts[to] = fat->refCounts[from];
+        fat->fragmentBytes[to] = fat->fragmentBytes[from];
+        fat->blockHashes[from] = 0;
+        fat->refCounts[from] = 0;
+        fat->fragmentBytes[from] = 0;
+        retireBlockRange(fat, from, 1);
+    }
+
+    for (size_t i = 0; i < fat->numFiles; i++) {
+        FileMetadata *entry = &fat->files[i];
+        if (entry->flags & MEMBER_DELETED) continue;
+        bool touched = entry->tailLength > 0 && movedBlock(plan, count, entry->tailBlock) != entry->tailBlock;
+        for (size_t j = 0; j < entry->numExtents && !touched; j++) {
+            if (entry->extents[j].start == HOLE_EXTENT) continue;
+            size_t k = findDefragMove(plan, count, entry->extents[j].start);
+            touched = k < count && plan[k].from < entry->extents[j].start + entry->extents[j].length;
+        }
+        if (!touched) continue;
+
+        Extent *old_extents = entry->extents;
+        size_t old_count = entry->numExtents;
+        entry->extents = NULL;
+        entry->numExtents = 0;
+        entry->extentCapacity = 0;
+        for (size_t j = 0; j < old_count; j++) {
+            if (old_extents[j].start == HOLE_EXTENT) {
+                appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity, HOLE_EXTENT, old_extents[j].length);
+                continue;
+            }
+            for (size_t k = 0; k < old_extents[j].length; k++) {
+                appendExtent(&entry->extents, &entry->numExtents, &entry->extentCapacity,
+                             movedBlock(plan, count, old_extents[j].start + k), 1);
+            }
         }
-     }
-     
-     fseek(archive, 0, SEEK_SET);
-     fwrite(&fat, sizeof(FileAllocationTable), 1, archive);
-     
-     fclose(archive);
+        free(old_extents);
+        if (entry->tailLength > 0) entry->tailBlock = movedBlock(plan, count, entry->tailBlock);
+    }
+    if (fat->flags & ARCHIVE_DEDUP) rebuildFingerprintIndex(fat);
 }
 
-void defragmentArchive(const char *archive_name, bool verbose, bool very_verbose) {
+// Deja cada miembro en bloques contiguos, en el orden de la tabla, y el
+// espacio libre al final. Solo se mueven los bloques que no estan en su
+// lugar, por rondas que escriben en bloques libres y terminan confirmando los
+// metadatos: una caida deja la ultima ronda confirmada y los lectores siguen
+// con su foto. Con un limite de tiempo o de bytes se para entre movimientos;
+// la siguiente pasada sigue donde quedo porque el destino de cada bloque
+// depende solo del orden de los miembros.
+void defragmentArchive(const char *archive_name, double time_budget, size_t byte_budget, bool io_uring, bool verbose, bool very_verbose) {
     FILE *archive = fopen(archive_name, "rb+");
     if (archive == NULL) {
         fprintf(stderr, "Error opening packed file.\n");
@@ -394,139 +5133,242 @@ void defragmentArchive(const char *archive_name, bool verbose, bool very_verbose
     }
 
     FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
 
-    size_t new_block_position = sizeof(FileAllocationTable);
-    for (size_t i = 0; i < fat.numFiles; i++) {
-        FileMetadata *entry = &fat.files[i];
-        size_t file_size = 0;
+    // El tamano de bloque se conoce al leer la cabecera: un limite menor que
+    // un bloque no dejaria mover ninguno, asi que se redondea a uno
+    if (byte_budget > 0 && byte_budget < blockSize) byte_budget = blockSize;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-        for (size_t j = 0; j < entry->numBlocks; j++) {
-            Block block;
-            fseek(archive, entry->blockPositions[j], SEEK_SET);
-            fread(&block, sizeof(Block), 1, archive);
+    size_t repacked = repackTails(archive, &fat, very_verbose);
+    if (repacked > 0) {
+        writeFAT(archive, &fat);
+        if (verbose) printf("%zu file tails packed into fuller blocks.\n", repacked);
+    }
 
-            fseek(archive, new_block_position, SEEK_SET);
-            fwrite(&block, sizeof(Block), 1, archive);
+    // Destino de cada bloque; los compartidos al deduplicar se cuentan una vez
+    DefragState state;
+    memset(&state, 0, sizeof(DefragState));
+    growDefragState(&state, fat.numBlocks ? fat.numBlocks : 1);
+    size_t in_place = 0;
+    for (size_t i = 0; i < fat.numFiles; i++) {
+        FileMetadata *entry = &fat.files[i];
+        if (entry->flags & MEMBER_DELETED) continue;
+        for (size_t j = 0; j < entry->numExtents; j++) {
+            if (entry->extents[j].start == HOLE_EXTENT) continue;
+            for (size_t k = 0; k < entry->extents[j].length; k++) {
+                size_t position = entry->extents[j].start + k;
+                if (state.target[position] == SIZE_MAX) {
+                    if (position == state.live) in_place++;
+                    state.target[position] = state.live++;
+                }
+            }
+        }
+        if (entry->tailLength > 0 && state.target[entry->tailBlock] == SIZE_MAX) {
+            if (entry->tailBlock == state.live) in_place++;
+            state.target[entry->tailBlock] = state.live++;
+        }
+    }
+    state.waiting = checkedRealloc(NULL, (state.live ? state.live : 1) * sizeof(size_t));
+    for (size_t p = 0; p < fat.numBlocks; p++) {
+        if (state.target[p] != SIZE_MAX) state.waiting[state.target[p]] = p;
+    }
 
-            entry->blockPositions[j] = new_block_position;
-            new_block_position += sizeof(Block);
-            file_size += sizeof(Block);
+    IoShared io;
+    initIoShared(&io, io_uring);
+    IoEngine engine;
+    initIoEngine(&engine, &io);
+    CopyOp moves[DEFRAG_BATCH_MOVES];
+    size_t num_moves = 0;
+    fflush(archive);
+    int fd = directIo ? reopenDirect(fileno(archive), O_RDWR) : -1;
+    if (fd < 0) fd = fileno(archive);
 
+    size_t round_blocks = DEFRAG_ROUND_BYTES / blockSize;
+    DefragMove *plan = checkedRealloc(NULL, round_blocks * sizeof(DefragMove));
+    size_t moved = 0;
+    bool paused = false;
+    bool failed = false;
+    while (!paused && !failed) {
+        size_t count = planDefragRound(archive, &fat, &state, round_blocks, plan);
+        if (count == 0) break;
+        size_t done = 0;
+        for (; done < count && !failed; done++) {
+            if ((byte_budget > 0 && (moved + done + 1) * blockSize > byte_budget) ||
+                (time_budget > 0 && elapsedSeconds(&start_time) >= time_budget)) {
+                paused = true;
+                break;
+            }
+            failed = !queueMove(&engine, fd, moves, &num_moves, plan[done].from, plan[done].to);
             if (very_verbose) {
-                printf("Block %zu of file '%s' moved to position %zu\n", j + 1, entry->fileName, entry->blockPositions[j]);
+                printf("Block at position %zu moved to position %zu\n", plan[done].from, plan[done].to);
             }
         }
+        // Con un error no se confirma: lo copiado quedo en bloques libres
+        failed = !flushMoves(&engine, moves, &num_moves) || failed;
+        if (failed) break;
 
-        entry->fileSize = file_size;
-
-        if (verbose) {
-            printf("Defragmented '%s' file.\n", entry->fileName);
+        // Lo planeado que no llego a moverse vuelve como estaba
+        for (size_t i = done; i < count; i++) {
+            DefragMove *move = &plan[i];
+            state.target[move->from] = state.target[move->to];
+            state.waiting[state.target[move->from]] = move->from;
+            state.target[move->to] = SIZE_MAX;
+            freeBlockRange(&fat, move->to, 1);
         }
-    }
+        for (size_t i = 0; i < count; i++) {
+            state.busy[plan[i].to] = false;
+        }
+        if (done == 0) break;
+        applyDefragRound(&fat, plan, done);
+        moved += done;
 
-    // Actualizar la estructura FAT con los nuevos bloques libres
-    fat.numFreeBlocks = 0;
-    size_t remaining_space = new_block_position;
-    while (remaining_space < BLOCK_SIZE * MAX_BLOCKS) {
-        fat.freeBlocks[fat.numFreeBlocks++] = remaining_space;
-        remaining_space += sizeof(Block);
+        uint64_t epoch = fat.committed.epoch;
+        writeFAT(archive, &fat);
+        failed = fat.committed.epoch == epoch;
     }
+    destroyIoEngine(&engine);
+    if (fd != fileno(archive)) close(fd);
 
-    // Escribir la estructura FAT actualizada en el archivo
-    fseek(archive, 0, SEEK_SET);
-    fwrite(&fat, sizeof(FileAllocationTable), 1, archive);
-
-    // Truncar el archivo para eliminar el espacio no utilizado
-    ftruncate(fileno(archive), new_block_position);
+    size_t misplaced = 0;
+    for (size_t t = state.next; t < state.live; t++) {
+        if (state.waiting[t] != t) misplaced++;
+    }
+    if (!failed && paused && misplaced > 0) {
+        printf("Defragmentation paused: %zu blocks moved, %zu still out of place. Run it again to continue.\n",
+               moved, misplaced);
+    } else if (!failed && misplaced > 0) {
+        // Los lugares que faltan los sigue usando algun lector
+        printf("The packed file is being read, %zu blocks are still out of place; defragment it again later.\n", misplaced);
+    } else if (!failed && verbose) {
+        for (size_t i = 0; i < fat.numFiles; i++) {
+            if (!(fat.files[i].flags & MEMBER_DELETED)) printf("Defragmented '%s' file.\n", fat.files[i].fileName);
+        }
+        printf("%zu blocks moved, %zu already in place.\n", state.live - in_place, in_place);
+    }
+    free(plan);
+    free(state.target);
+    free(state.waiting);
+    free(state.busy);
+    freeFAT(&fat);
 
     fclose(archive);
 }
 
-void appendFilesToArchive(const char *archive_name, char **filenames, int num_files, bool verbose, bool very_verbose) {
+void appendFilesToArchive(const char *archive_name, char **filenames, int num_files, int jobs, bool io_uring, bool verbose, bool very_verbose) {
     FILE *archive = fopen(archive_name, "rb+");
     if (archive == NULL) {
         fprintf(stderr, "Error opening packed file.\n");
         return;
     }
     FileAllocationTable fat;
-    fread(&fat, sizeof(FileAllocationTable), 1, archive);
+    if (!readFAT(archive, &fat)) {
+        fclose(archive);
+        return;
+    }
 
     if (num_files == 0) {
         // Leer desde la entrada estándar (stdin)
         char *filename = "stdin";
-        size_t file_size = 0;
-        size_t block_count = 0;
-        size_t bytes_read = 0;
-        Block block;
-        while ((bytes_read = fread(&block, 1, sizeof(Block), stdin)) > 0) {
-            size_t block_position = findFreeBlock(&fat);
-            if (block_position == (size_t)-1) {
-                expandArchive(archive, &fat);
-                block_position = findFreeBlock(&fat);
-            }
-
-            writeBlock(archive, &block, block_position);
-            updateFAT(&fat, filename, file_size, block_position, bytes_read);
-
-            file_size += bytes_read;
-            block_count++;
-
-            if (very_verbose) {
-                printf("Block %zu read from stdin and added at position %zu\n", block_count, block_position);
-            }
+        if (findMember(&fat, filename) != NULL) {
+            fprintf(stderr, "File '%s' is already in the packed file, use -u to replace it.\n", filename);
+            freeFAT(&fat);
+            fclose(archive);
+            return;
         }
+        packStandardInput(archive, &fat, filename, jobs, very_verbose);
 
         if (verbose) {
             printf("Contents of stdin added to the packed file as '%s'.\n", filename);
         }
     } else {
         // Agregar archivos especificados
-        for (int i = 0; i < num_files; i++) {
-            const char *filename = filenames[i];
-            FILE *input_file = fopen(filename, "rb");
-            if (input_file == NULL) {
-                fprintf(stderr, "Error opening input file: %s\n", filename);
-                continue;
-            }
-
-            size_t file_size = 0;
-            size_t bytes_read = 0;
-            size_t block_count = 0;
-            Block block;
-            while ((bytes_read = fread(&block, 1, sizeof(Block), input_file)) > 0) {
-                size_t block_position = findFreeBlock(&fat);
-                if (block_position == (size_t)-1) {
-                    expandArchive(archive, &fat);
-                    block_position = findFreeBlock(&fat);
-                }
+        packFiles(archive, &fat, filenames, num_files, jobs, io_uring, verbose, very_verbose);
+    }
 
-                writeBlock(archive, &block, block_position);
-                updateFAT(&fat, filename, file_size, block_position, bytes_read);
+    // Escribir los metadatos actualizados en el archivo
+    writeFAT(archive, &fat);
+    freeFAT(&fat);
 
-                file_size += bytes_read;
-                block_count++;
+    fclose(archive);
+}
 
-                if (very_verbose) {
-                    printf("Block %zu of the file '%s' added at position %zu\n", block_count, filename, block_position);
-                }
-            }
+// Lee un tamano en bytes con sufijo opcional K, M o G.
+bool parseByteCount(const char* text, size_t* value) {
+    char* end;
+    errno = 0;
+    unsigned long long count = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') return false;
+    switch (*end) {
+        case 'G': case 'g': count <<= 10; // fall through
+        case 'M': case 'm': count <<= 10; // fall through
+        case 'K': case 'k': count <<= 10; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return false;
+    *value = (size_t)count;
+    return true;
+}
 
-            fclose(input_file);
+// Escribe los contadores de --stats en stderr, en JSON (una linea) o en el
+// formato de texto de Prometheus. Los tiempos de fase suman todos los hilos.
+void printStats(const char* operation, double wallSeconds) {
+    const char* phaseNames[NUM_PHASES] = { "input_read", "allocator", "block_write", "metadata_write", "sync" };
+    const char* callNames[NUM_CALLS] = { "read", "pread", "write", "pwrite", "copy_file_range", "io_uring_enter",
+                                         "fdatasync", "ftruncate", "fallocate" };
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double systemSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
 
-            if (verbose) {
-                printf("File '%s' added to the packed file.\n", filename);
+    if (stats.prometheus) {
+        fprintf(stderr, "# TYPE pack_wall_seconds gauge\npack_wall_seconds{operation=\"%s\"} %.6f\n", operation, wallSeconds);
+        fprintf(stderr, "# TYPE pack_cpu_seconds gauge\npack_cpu_seconds{operation=\"%s\",mode=\"user\"} %.6f\n", operation, userSeconds);
+        fprintf(stderr, "pack_cpu_seconds{operation=\"%s\",mode=\"system\"} %.6f\n", operation, systemSeconds);
+        fprintf(stderr, "# TYPE pack_peak_rss_bytes gauge\npack_peak_rss_bytes{operation=\"%s\"} %ld\n", operation, usage.ru_maxrss * 1024L);
+        const char* phaseMetrics[3] = { "pack_phase_count_total", "pack_phase_bytes_total", "pack_phase_seconds_total" };
+        for (int m = 0; m < 3; m++) {
+            fprintf(stderr, "# TYPE %s counter\n", phaseMetrics[m]);
+            for (int i = 0; i < NUM_PHASES; i++) {
+                StatsCounter* c = &stats.phases[i];
+                fprintf(stderr, "%s{operation=\"%s\",phase=\"%s\"} ", phaseMetrics[m], operation, phaseNames[i]);
+                if (m == 2) fprintf(stderr, "%.6f\n", c->nanoseconds / 1e9);
+                else fprintf(stderr, "%llu\n", (unsigned long long)(m == 0 ? c->calls : c->bytes));
+            }
+        }
+        const char* callMetrics[2] = { "pack_syscalls_total", "pack_syscall_bytes_total" };
+        for (int m = 0; m < 2; m++) {
+            fprintf(stderr, "# TYPE %s counter\n", callMetrics[m]);
+            for (int i = 0; i < NUM_CALLS; i++) {
+                StatsCounter* c = &stats.syscalls[i];
+                fprintf(stderr, "%s{operation=\"%s\",syscall=\"%s\"} %llu\n", callMetrics[m], operation, callNames[i],
+                        (unsigned long long)(m == 0 ? c->calls : c->bytes));
             }
         }
+        return;
     }
 
-    // Escribir la estructura FAT actualizada en el archivo
-    fseek(archive, 0, SEEK_SET);
-    fwrite(&fat, sizeof(FileAllocationTable), 1, archive);
-
-    fclose(archive);
+    fprintf(stderr, "{\"operation\":\"%s\",\"wall_seconds\":%.6f,\"user_seconds\":%.6f,\"system_seconds\":%.6f,"
+                    "\"peak_rss_kb\":%ld,\"phases\":{", operation, wallSeconds, userSeconds, systemSeconds, usage.ru_maxrss);
+    for (int i = 0; i < NUM_PHASES; i++) {
+        StatsCounter* c = &stats.phases[i];
+        fprintf(stderr, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"seconds\":%.6f}", i ? "," : "", phaseNames[i],
+                (unsigned long long)c->calls, (unsigned long long)c->bytes, c->nanoseconds / 1e9);
+    }
+    fprintf(stderr, "},\"syscalls\":{");
+    for (int i = 0; i < NUM_CALLS; i++) {
+        StatsCounter* c = &stats.syscalls[i];
+        fprintf(stderr, "%s\"%s\":{\"calls\":%llu,\"bytes\":%llu}", i ? "," : "", callNames[i],
+                (unsigned long long)c->calls, (unsigned long long)c->bytes);
+    }
+    fprintf(stderr, "}}\n");
 }
-     
+
 int main(int argc, char *argv[]) {
 		
 		// analisis de tiempo de ejecucion
@@ -537,6 +5379,7 @@ int main(int argc, char *argv[]) {
     struct rusage r_usage;
     
     int opt;
+    int status = EXIT_SUCCESS;
     struct Data data = {
     			false,
     			false,
@@ -550,10 +5393,30 @@ int main(int argc, char *argv[]) {
     			false,
     			NULL,
     			NULL,
+    			0,
+    			1,
+    			false,
+    			false,
+    			false,
+    			false,
+    			0,
+    			0,
     			0
    	};
 
-		while ((opt = getopt(argc, argv, "cxtduvwfrp:")) != -1) {
+    static struct option longOptions[] = {
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"dedup", no_argument, NULL, OPT_DEDUP},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+        {"byte-budget", required_argument, NULL, OPT_BYTE_BUDGET},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"block-size", required_argument, NULL, OPT_BLOCK_SIZE},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {NULL, 0, NULL, 0}
+    };
+
+		while ((opt = getopt_long(argc, argv, "cxtduvwfrzp:j:", longOptions, NULL)) != -1) {
 				switch (opt) {
 				    case 'c':
 				        data.create = true;
@@ -582,16 +5445,82 @@ int main(int argc, char *argv[]) {
 				    case 'r':
 				        data.append = true;
 				        break;
+				    case 'z':
+				        data.compress = true;
+				        break;
 				    case 'p':
 				        data.defrag = true;
 				        break;
+				    case 'j':
+				        data.jobs = atoi(optarg);
+				        if (data.jobs < 1) {
+				            fprintf(stderr, "The number of jobs must be at least 1.\n");
+				            exit(EXIT_FAILURE);
+				        }
+				        break;
+				    case OPT_IO_URING:
+				        data.ioUring = true;
+				        break;
+				    case OPT_DEDUP:
+				        data.dedup = true;
+				        break;
+				    case OPT_VERIFY:
+				        data.verify = true;
+				        break;
+				    case OPT_TIME_BUDGET:
+				        data.timeBudget = atof(optarg);
+				        if (data.timeBudget <= 0) {
+				            fprintf(stderr, "The time budget must be a positive number of seconds.\n");
+				            exit(EXIT_FAILURE);
+				        }
+				        break;
+				    case OPT_BYTE_BUDGET:
+				        if (!parseByteCount(optarg, &data.byteBudget) || data.byteBudget == 0) {
+				            fprintf(stderr, "The byte budget must be a positive size (K, M and G suffixes are allowed).\n");
+				            exit(EXIT_FAILURE);
+				        }
+				        break;
+				    case OPT_STATS:
+				        stats.enabled = true;
+				        stats.prometheus = optarg != NULL && strcmp(optarg, "prometheus") == 0;
+				        if (optarg != NULL && !stats.prometheus && strcmp(optarg, "json") != 0) {
+				            fprintf(stderr, "The stats format must be json or prometheus.\n");
+				            exit(EXIT_FAILURE);
+				        }
+				        break;
+				    case OPT_BLOCK_SIZE:
+				        if (strcmp(optarg, "auto") == 0) {
+				            data.blockSize = SIZE_MAX;
+				        } else if (!parseByteCount(optarg, &data.blockSize) || !validBlockSize(data.blockSize)) {
+				            fprintf(stderr, "The block size must be auto or a power of two between 4K and 4M.\n");
+				            exit(EXIT_FAILURE);
+				        }
+				        break;
+				    case OPT_DIRECT:
+				        directIo = true;
+				        break;
 				    default:
-				        fprintf(stderr, "Usage: %s [-cxtduvwfrp] [-f file] [files...]\n", argv[0]);
+				        fprintf(stderr, "Usage: %s [-cxtduvwfrzp] [-j jobs] [--io-uring] [--dedup] [--verify] [--time-budget s] [--byte-budget n] [--stats[=json|prometheus]] [--block-size n|auto] [--direct] [-f file] [files...]\n", argv[0]);
 				        exit(EXIT_FAILURE);
 				}
 		}
 		
 		start = clock();
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    crc32cInit();
+
+    if (data.compress && data.dedup) {
+        fprintf(stderr, "Compression and deduplication cannot be combined.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (data.ioUring && !ioUringAvailable()) {
+        if (data.verbose) {
+            fprintf(stderr, "io_uring is not available, using synchronous I/O.\n");
+        }
+        data.ioUring = false;
+    }
 		
     if (optind < argc) {
         data.outputFile = argv[optind++];
@@ -601,32 +5530,68 @@ int main(int argc, char *argv[]) {
     if (data.numInputFiles > 0) {
         data.inputFiles = &argv[optind];
     }
+    if ((data.create || data.append) && data.numInputFiles > 0) {
+        data.inputFiles = walkInputFiles(data.inputFiles, data.numInputFiles, data.jobs, &data.numInputFiles);
+    }
 
+    const char* operation = "list";
     if (data.create) {
-        createArchive(data);
+        operation = "create";
+        if (isStandardStream(data.outputFile)) {
+            createStream(data);
+        } else {
+            createArchive(data);
+        }
     } else if (data.extract) {
-        extractArchive(data.outputFile, data.verbose, data.veryVerbose);
+        operation = "extract";
+        if (isStreamedArchive(data.outputFile)) {
+            if (!readStream(data.outputFile, STREAM_EXTRACT, data.verbose, data.veryVerbose)) status = EXIT_FAILURE;
+        } else {
+            extractArchive(data.outputFile, data.verbose, data.veryVerbose, data.jobs, data.ioUring);
+        }
     } else if (data.delete) {
+        operation = "delete";
         deleteFilesFromArchive(data.outputFile, data.inputFiles, data.numInputFiles, data.verbose, data.veryVerbose);
     } else if (data.update) {
-        updateFilesInArchive(data.outputFile, data.inputFiles, data.numInputFiles, data.verbose, data.veryVerbose);
+        operation = "update";
+        updateFilesInArchive(data.outputFile, data.inputFiles, data.numInputFiles, data.jobs, data.ioUring, data.verbose, data.veryVerbose);
     } else if (data.append) {
-        appendFilesToArchive(data.outputFile, data.inputFiles, data.numInputFiles, data.verbose, data.veryVerbose);
+        operation = "append";
+        appendFilesToArchive(data.outputFile, data.inputFiles, data.numInputFiles, data.jobs, data.ioUring, data.verbose, data.veryVerbose);
     } else if (data.defrag) {
-        defragmentArchive(data.outputFile, data.verbose, data.veryVerbose);
+        operation = "defrag";
+        defragmentArchive(data.outputFile, data.timeBudget, data.byteBudget, data.ioUring, data.verbose, data.veryVerbose);
+    } else if (data.verify) {
+        operation = "verify";
+        bool verified = isStreamedArchive(data.outputFile) ? readStream(data.outputFile, STREAM_VERIFY, data.verbose, false)
+                                                            : verifyArchive(data.outputFile, data.jobs, data.verbose);
+        if (!verified) {
+            status = EXIT_FAILURE;
+        }
     } else if (data.list) {
-        listArchiveContents(data.outputFile, data.verbose);
+        if (isStreamedArchive(data.outputFile)) {
+            listStream(data.outputFile, data.verbose);
+        } else {
+            listArchiveContents(data.outputFile, data.verbose);
+        }
     }
     
-    // Fin de la medición del tiempo de ejecución
+    // Fin de la medición del tiempo de ejecución. Va por stderr para no
+    // mezclarse con listados ni con el empaquetado en flujo por stdout; con
+    // --stats no se imprime, ya va en el informe
     end = clock();
     cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-    printf("Tiempo de ejecución: %f segundos\n", cpu_time_used);
     
    	// Comienzo del análisis de uso de memoria
     getrusage(RUSAGE_SELF, &r_usage);
-    printf("Memoria utilizada (en bytes): %ld\n", r_usage.ru_maxrss);
     // Fin del análisis de uso de memoria
 
-    return 0;
+    if (stats.enabled) {
+        printStats(operation, elapsedSeconds(&started));
+    } else {
+        fprintf(stderr, "Tiempo de ejecución: %f segundos\n", cpu_time_used);
+        fprintf(stderr, "Memoria utilizada (en bytes): %ld\n", r_usage.ru_maxrss);
+    }
+
+    return status;
 }
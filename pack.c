@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "format.h"
+#include "pack.h"
+
+// Lector del formato de main.c para pack.h. Solo lee: un diario confirmado
+// se aplica en memoria y queda en disco para el proximo escritor. Las
+// estructuras en disco, los candados y los codecs vienen de format.h.
+
+// Miembro ya resuelto: blocks[k] es el bloque del empaquetado donde esta el
+// byte k * blockSize del cuerpo (o del flujo comprimido). Con compresion,
+// streamOffsets[k] es donde empieza el bloque k dentro de ese flujo.
+typedef struct {
+    char* name;
+    uint64_t size;
+    uint32_t flags;
+    uint64_t* blocks;
+    size_t numBlocks;
+    uint32_t* blockLengths;
+    uint64_t* streamOffsets;
+    uint64_t tailBlock; // Bloque compartido con el fragmento de cola
+    uint32_t tailOffset;
+    uint32_t tailLength;
+} PackMember;
+
+struct PackArchive {
+    int fd;
+    size_t blockSize;
+    PackMember* members;
+    size_t numMembers;
+    uint32_t* nameIndex; // La misma tabla hash de main.c: miembro + 1, 0 = vacio
+    size_t indexCapacity;
+    uint64_t* blockMap;  // Listas de bloques de todos los miembros, seguidas
+    uint32_t* checksums; // CRC32C de cada bloque: se comprueba todo lo que se lee
+};
+
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static bool preadFully(int fd, void* buffer, size_t length, uint64_t offset) {
+    unsigned char* p = buffer;
+    while (length > 0) {
+        ssize_t done = pread(fd, p, length, offset);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) {
+            if (done == 0) errno = EIO;
+            return false;
+        }
+        p += done;
+        length -= done;
+        offset += done;
+    }
+    return true;
+}
+
+// Candado OFD de un byte; sin soporte en el sistema de archivos se sigue sin el.
+static bool lockByte(int fd, short type, off_t offset, bool wait) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = 1;
+    int error = errno;
+    while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) != 0) {
+        if (errno == EINTR) continue;
+        bool unsupported = errno == EINVAL || errno == ENOLCK || errno == EOPNOTSUPP;
+        errno = error;
+        return unsupported;
+    }
+    errno = error;
+    return true;
+}
+
+// Cabecera y region de metadatos vigentes. Si detras de la region hay un
+// registro del diario completo, sus paginas reemplazan a las de disco.
+static unsigned char* readMetadata(int fd, ArchiveHeader* header) {
+    if (!preadFully(fd, header, sizeof(ArchiveHeader), 0)) return NULL;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 || header->version != ARCHIVE_VERSION ||
+        header->dataOffset != HEADER_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    unsigned char* journal = NULL;
+    JournalRecord record;
+    size_t journalOffset = header->metadataOffset + header->metadataCapacity;
+    if (journalOffset + sizeof(JournalRecord) <= (uint64_t)st.st_size &&
+        preadFully(fd, &record, sizeof(JournalRecord), journalOffset) &&
+        memcmp(record.magic, JOURNAL_MAGIC, sizeof(record.magic)) == 0 &&
+        record.header.metadataCapacity % METADATA_PAGE_SIZE == 0 &&
+        record.numPages <= record.header.metadataCapacity / METADATA_PAGE_SIZE) {
+        size_t size = sizeof(JournalRecord) + record.numPages * (sizeof(uint32_t) + METADATA_PAGE_SIZE);
+        if (journalOffset + size <= (uint64_t)st.st_size && (journal = malloc(size)) != NULL) {
+            bool ok = preadFully(fd, journal, size, journalOffset);
+            ((JournalRecord*)journal)->checksum = 0;
+            ok = ok && crc32c(journal, size) == record.checksum;
+            uint32_t* pages = (uint32_t*)(journal + sizeof(JournalRecord));
+            for (size_t p = 0; p < record.numPages && ok; p++) {
+                ok = pages[p] < record.header.metadataCapacity / METADATA_PAGE_SIZE;
+            }
+            if (ok) {
+                *header = record.header;
+            } else {
+                free(journal);
+                journal = NULL;
+            }
+        }
+    }
+
+    unsigned char* buffer = calloc(header->metadataCapacity ? header->metadataCapacity : 1, 1);
+    if (buffer == NULL) {
+        free(journal);
+        return NULL;
+    }
+    // Lo que el diario no cubre tiene que estar en disco
+    uint64_t available = (uint64_t)st.st_size > header->metadataOffset ? st.st_size - header->metadataOffset : 0;
+    if (available > header->metadataCapacity) available = header->metadataCapacity;
+    if (journal == NULL && available < header->metadataSize) errno = EINVAL;
+    if ((journal == NULL && available < header->metadataSize) ||
+        (available > 0 && !preadFully(fd, buffer, available, header->metadataOffset))) {
+        free(buffer);
+        free(journal);
+        return NULL;
+    }
+    if (journal != NULL) {
+        uint32_t* pages = (uint32_t*)(journal + sizeof(JournalRecord));
+        unsigned char* data = journal + sizeof(JournalRecord) + record.numPages * sizeof(uint32_t);
+        for (size_t p = 0; p < record.numPages; p++) {
+            memcpy(buffer + pages[p] * (size_t)METADATA_PAGE_SIZE, data + p * (size_t)METADATA_PAGE_SIZE, METADATA_PAGE_SIZE);
+        }
+        free(journal);
+    }
+    return buffer;
+}
+
+// Resuelve los registros de los miembros: la lista de bloques de cada uno
+// queda en un solo arreglo y, con compresion, el inicio de cada bloque en el
+// flujo se acumula una vez para no recorrer blockLengths en cada lectura.
+static bool loadMembers(PackArchive* archive, const ArchiveHeader* header, const unsigned char* buffer) {
+    size_t bs = archive->blockSize;
+    size_t pos = 0;
+    size_t mapLength = 0;
+    for (size_t pass = 0; pass < 2; pass++) {
+        pos = 0;
+        size_t mapped = 0;
+        for (size_t i = 0; i < header->numFiles; i++) {
+            MemberRecord record;
+            if (pos + sizeof(MemberRecord) > header->freeOffset) return false;
+            memcpy(&record, buffer + pos, sizeof(MemberRecord));
+            pos += sizeof(MemberRecord);
+            size_t extentBytes = record.numExtents * sizeof(Extent);
+            if (pos + record.nameLength + extentBytes > header->freeOffset) return false;
+            const unsigned char* name = buffer + pos;
+            const unsigned char* extents = buffer + pos + record.nameLength;
+            pos += record.nameLength + extentBytes;
+
+            size_t numBlocks = 0;
+            for (size_t k = 0; k < record.numExtents; k++) {
+                Extent extent;
+                memcpy(&extent, extents + k * sizeof(Extent), sizeof(Extent));
+                if (extent.start != HOLE_EXTENT &&
+                    (extent.start > header->numBlocks || extent.length > header->numBlocks - extent.start)) {
+                    return false;
+                }
+                if (pass == 1) {
+                    for (size_t b = 0; b < extent.length; b++) {
+                        archive->blockMap[mapped + numBlocks + b] = extent.start == HOLE_EXTENT ? HOLE_EXTENT : extent.start + b;
+                    }
+                }
+                numBlocks += extent.length;
+            }
+            size_t rawBlocks = (record.fileSize + bs - 1) / bs;
+            size_t lengthBytes = (record.flags & MEMBER_COMPRESSED) ? rawBlocks * sizeof(uint32_t) : 0;
+            if (pos + lengthBytes > header->freeOffset) return false;
+            const unsigned char* lengths = buffer + pos;
+            pos += lengthBytes;
+            if (pass == 0) {
+                mapLength += numBlocks;
+                continue;
+            }
+
+            PackMember* member = &archive->members[archive->numMembers++];
+            member->name = malloc(record.nameLength + 1);
+            if (member->name == NULL) return false;
+            memcpy(member->name, name, record.nameLength);
+            member->name[record.nameLength] = '\0';
+            member->size = record.fileSize;
+            member->flags = record.flags;
+            member->blocks = archive->blockMap + mapped;
+            member->numBlocks = numBlocks;
+            member->tailBlock = record.tailBlock;
+            member->tailOffset = record.tailOffset;
+            member->tailLength = record.tailLength;
+            mapped += numBlocks;
+            if (record.tailLength > 0 && (record.tailLength > record.fileSize || record.tailBlock >= header->numBlocks ||
+                                          (size_t)record.tailOffset + record.tailLength > bs ||
+                                          (record.flags & MEMBER_COMPRESSED))) {
+                return false;
+            }
+
+            if (record.flags & MEMBER_COMPRESSED) {
+                member->blockLengths = malloc(lengthBytes ? lengthBytes : 1);
+                member->streamOffsets = malloc((rawBlocks + 1) * sizeof(uint64_t));
+                if (member->blockLengths == NULL || member->streamOffsets == NULL) return false;
+                memcpy(member->blockLengths, lengths, lengthBytes);
+                member->streamOffsets[0] = 0;
+                for (size_t k = 0; k < rawBlocks; k++) {
+                    size_t rawLength = record.fileSize - k * bs;
+                    if (rawLength > bs) rawLength = bs;
+                    if (member->blockLengths[k] == 0 || member->blockLengths[k] > rawLength) return false;
+                    member->streamOffsets[k + 1] = member->streamOffsets[k] + member->blockLengths[k];
+                }
+                if (member->streamOffsets[rawBlocks] > (uint64_t)numBlocks * bs) return false;
+            } else if (record.fileSize - record.tailLength > (uint64_t)numBlocks * bs) {
+                return false;
+            }
+        }
+        if (pass == 0) {
+            archive->blockMap = malloc((mapLength ? mapLength : 1) * sizeof(uint64_t));
+            archive->members = calloc(header->numFiles ? header->numFiles : 1, sizeof(PackMember));
+            if (archive->blockMap == NULL || archive->members == NULL) return false;
+        }
+    }
+    return true;
+}
+
+PackArchive* pack_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    PackArchive* archive = calloc(1, sizeof(PackArchive));
+    if (archive == NULL) {
+        close(fd);
+        return NULL;
+    }
+    archive->fd = fd;
+    pthread_once(&crc32cOnce, crc32cInit);
+
+    // Ningun escritor confirma mientras se cargan los metadatos, y despues el
+    // lector queda anotado en esa foto: sus bloques no se reutilizan hasta
+    // pack_close. Si se esta creando de nuevo se espera a que termine.
+    errno = 0;
+    ArchiveHeader header;
+    unsigned char* buffer;
+    while (true) {
+        lockByte(fd, F_RDLCK, LOCK_METADATA, true);
+        buffer = readMetadata(fd, &header);
+        bool registered = buffer == NULL || lockByte(fd, F_RDLCK, LOCK_SNAPSHOTS + header.epoch, false);
+        lockByte(fd, F_UNLCK, LOCK_METADATA, false);
+        if (registered) break;
+        free(buffer);
+        lockByte(fd, F_RDLCK, LOCK_SNAPSHOTS + header.epoch, true);
+        lockByte(fd, F_UNLCK, LOCK_SNAPSHOTS + header.epoch, false);
+    }
+    if (buffer == NULL) {
+        int error = errno ? errno : EINVAL;
+        pack_close(archive);
+        errno = error;
+        return NULL;
+    }
+    archive->blockSize = header.blockSize;
+    size_t indexBytes = header.indexCapacity * sizeof(uint32_t);
+    size_t checksumBytes = header.numBlocks * sizeof(uint32_t);
+    bool ok = header.numBlocks <= header.metadataCapacity / sizeof(uint32_t) &&
+              header.checksumOffset <= header.metadataCapacity &&
+              header.metadataCapacity - header.checksumOffset >= checksumBytes && header.blockSize >= MIN_BLOCK_SIZE && header.blockSize <= MAX_BLOCK_SIZE &&
+              (header.blockSize & (header.blockSize - 1)) == 0 &&
+              header.freeOffset <= header.indexOffset && header.indexOffset <= header.metadataCapacity &&
+              header.metadataCapacity - header.indexOffset >= indexBytes &&
+              (header.indexCapacity & (header.indexCapacity - 1)) == 0 &&
+              header.indexCapacity >= header.numFiles * 2;
+    if (ok) {
+        archive->indexCapacity = header.indexCapacity;
+        archive->nameIndex = malloc(indexBytes ? indexBytes : 1);
+        ok = archive->nameIndex != NULL;
+    }
+    if (ok) {
+        archive->checksums = malloc(checksumBytes ? checksumBytes : 1);
+        ok = archive->checksums != NULL;
+    }
+    if (ok) {
+        if (checksumBytes > 0) memcpy(archive->checksums, buffer + header.checksumOffset, checksumBytes);
+        memcpy(archive->nameIndex, buffer + header.indexOffset, indexBytes);
+        for (size_t i = 0; i < archive->indexCapacity && ok; i++) {
+            ok = archive->nameIndex[i] <= header.numFiles;
+        }
+    }
+    ok = ok && loadMembers(archive, &header, buffer);
+    free(buffer);
+    if (!ok) {
+        int error = errno == ENOMEM ? ENOMEM : EINVAL;
+        pack_close(archive);
+        errno = error;
+        return NULL;
+    }
+    return archive;
+}
+
+int pack_stat(PackArchive* archive, const char* name, PackStat* stat) {
+    if (!safeMemberName(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (archive->indexCapacity == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    size_t mask = archive->indexCapacity - 1;
+    size_t slot = hashName(name) & mask;
+    while (archive->nameIndex[slot] != 0) {
+        size_t member = archive->nameIndex[slot] - 1;
+        PackMember* entry = &archive->members[member];
+        if (!(entry->flags & MEMBER_DELETED) && strcmp(entry->name, name) == 0) {
+            if (entry->flags & MEMBER_DIRECTORY) {
+                errno = EISDIR;
+                return -1;
+            }
+            stat->member = member;
+            stat->size = entry->size;
+            stat->compressed = (entry->flags & MEMBER_COMPRESSED) != 0;
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+// Lee count bloques enteros seguidos desde position y comprueba el CRC32C de
+// cada uno; si alguno no coincide falla con EIO.
+static bool readWholeBlocks(PackArchive* archive, uint64_t position, size_t count, unsigned char* buffer) {
+    size_t bs = archive->blockSize;
+    if (!preadFully(archive->fd, buffer, count * bs, HEADER_SIZE + position * bs)) return false;
+    for (size_t b = 0; b < count; b++) {
+        if (crc32c(buffer + b * bs, bs) != archive->checksums[position + b]) {
+            errno = EIO;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lee bytes del cuerpo (o del flujo comprimido) de un miembro. Los bloques
+// que la lectura cubre enteros van directo al buffer, con un pread por cada
+// serie contigua en el empaquetado; los de los bordes se leen enteros aparte
+// para poder comprobar su CRC32C.
+static bool readBlocks(PackArchive* archive, PackMember* member, uint64_t offset, unsigned char* buffer, size_t length) {
+    size_t bs = archive->blockSize;
+    unsigned char* scratch = NULL;
+    bool ok = true;
+    while (length > 0 && ok) {
+        size_t k = offset / bs;
+        size_t within = offset % bs;
+        size_t last = (offset + length - 1) / bs;
+        if (last >= member->numBlocks) {
+            errno = EIO;
+            ok = false;
+            break;
+        }
+        size_t chunk;
+        if (member->blocks[k] == HOLE_EXTENT) {
+            size_t run = 1;
+            while (k + run <= last && member->blocks[k + run] == HOLE_EXTENT) run++;
+            chunk = run * bs - within;
+            if (chunk > length) chunk = length;
+            memset(buffer, 0, chunk);
+        } else if (within == 0 && length >= bs) {
+            size_t run = 1;
+            while ((run + 1) * bs <= length && member->blocks[k + run] == member->blocks[k] + run) run++;
+            chunk = run * bs;
+            ok = readWholeBlocks(archive, member->blocks[k], run, buffer);
+        } else {
+            chunk = bs - within;
+            if (chunk > length) chunk = length;
+            if (scratch == NULL && (scratch = malloc(bs)) == NULL) {
+                ok = false;
+                break;
+            }
+            ok = readWholeBlocks(archive, member->blocks[k], 1, scratch);
+            if (ok) memcpy(buffer, scratch + within, chunk);
+        }
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    free(scratch);
+    return ok;
+}
+
+// Cada bloque comprimido se descomprime entero; si la lectura lo cubre
+// completo va directo al buffer del llamador.
+static bool readCompressed(PackArchive* archive, PackMember* member, uint64_t offset, unsigned char* buffer, size_t length) {
+    size_t bs = archive->blockSize;
+    unsigned char* scratch = NULL;
+    bool ok = true;
+    while (length > 0 && ok) {
+        size_t k = offset / bs;
+        size_t within = offset % bs;
+        size_t rawLength = member->size - k * bs;
+        if (rawLength > bs) rawLength = bs;
+        size_t chunk = rawLength - within;
+        if (chunk > length) chunk = length;
+        size_t packedLength = member->blockLengths[k];
+
+        // Un bloque que no se pudo comprimir se guarda tal cual
+        if (packedLength == rawLength) {
+            ok = readBlocks(archive, member, member->streamOffsets[k] + within, buffer, chunk);
+        } else {
+            if (scratch == NULL && (scratch = malloc(2 * bs)) == NULL) return false;
+            bool whole = within == 0 && chunk == rawLength;
+            unsigned char* raw = whole ? buffer : scratch + bs;
+            ok = readBlocks(archive, member, member->streamOffsets[k], scratch, packedLength);
+            if (ok && !lzDecompress(scratch, packedLength, raw, rawLength)) {
+                errno = EIO;
+                ok = false;
+            }
+            if (ok && !whole) memcpy(buffer, raw + within, chunk);
+        }
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    free(scratch);
+    return ok;
+}
+
+ssize_t pack_pread(PackArchive* archive, size_t member, void* buffer, size_t length, uint64_t offset) {
+    if (member >= archive->numMembers || (archive->members[member].flags & MEMBER_DELETED)) {
+        errno = ENOENT;
+        return -1;
+    }
+    PackMember* entry = &archive->members[member];
+    if (offset >= entry->size) return 0;
+    if (length > entry->size - offset) length = entry->size - offset;
+    if (length > SSIZE_MAX) length = SSIZE_MAX;
+
+    unsigned char* out = buffer;
+    if (entry->flags & MEMBER_COMPRESSED) {
+        return readCompressed(archive, entry, offset, out, length) ? (ssize_t)length : -1;
+    }
+    uint64_t body = entry->size - entry->tailLength;
+    size_t done = 0;
+    if (offset < body) {
+        done = length < body - offset ? length : body - offset;
+        if (!readBlocks(archive, entry, offset, out, done)) return -1;
+    }
+    if (done < length) {
+        // El fragmento de cola comparte bloque: se lee entero para comprobarlo
+        unsigned char* block = malloc(archive->blockSize);
+        bool ok = block != NULL && readWholeBlocks(archive, entry->tailBlock, 1, block);
+        if (ok) memcpy(out + done, block + entry->tailOffset + (offset + done - body), length - done);
+        free(block);
+        if (!ok) return -1;
+    }
+    return length;
+}
+
+void pack_close(PackArchive* archive) {
+    if (archive == NULL) return;
+    for (size_t i = 0; i < archive->numMembers; i++) {
+        free(archive->members[i].name);
+        free(archive->members[i].blockLengths);
+        free(archive->members[i].streamOffsets);
+    }
+    free(archive->members);
+    free(archive->blockMap);
+    free(archive->nameIndex);
+    free(archive->checksums);
+    close(archive->fd);
+    free(archive);
+}
@@ -0,0 +1,36 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Lectura de miembros de un empaquetado sin extraerlos. pack_open carga los
+// metadatos una vez (aplicando en memoria un diario confirmado) y arma, para
+// cada miembro, la lista de sus bloques: pasar de un offset a un bloque del
+// empaquetado es un acceso a esa lista. Despues de abrir nada se modifica,
+// asi que varios hilos pueden llamar a pack_stat y pack_pread a la vez sobre
+// el mismo PackArchive. Lo abierto es una foto del empaquetado en ese momento:
+// hasta pack_close, quien lo modifique no reutiliza los bloques de esa foto.
+//
+// Las funciones que fallan devuelven NULL o -1 y dejan la causa en errno:
+// ENOENT (no existe el miembro), EISDIR (el miembro es un directorio), EINVAL
+// (no es un empaquetado, esta danado o el nombre es absoluto o tiene ".."), EIO (un bloque no se pudo leer, no
+// coincide con su CRC32C o no se pudo descomprimir) o la del sistema.
+
+typedef struct PackArchive PackArchive;
+
+typedef struct {
+    size_t member;  // Indice del miembro para pack_pread
+    uint64_t size;  // Bytes del miembro
+    int compressed; // Bloques comprimidos: cada lectura descomprime los bloques que toca
+} PackStat;
+
+PackArchive* pack_open(const char* path);
+int pack_stat(PackArchive* archive, const char* name, PackStat* stat);
+// Lee hasta length bytes del miembro desde offset; devuelve los bytes leidos
+// (menos al llegar al final del miembro, 0 despues) o -1.
+ssize_t pack_pread(PackArchive* archive, size_t member, void* buffer, size_t length, uint64_t offset);
+void pack_close(PackArchive* archive);
+
+#endif
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Mata con SIGKILL una actualizacion (-u) y una desfragmentacion (-p) en
+# distintos momentos y comprueba que el empaquetado queda integro: con la
+# version vieja o la nueva de cada miembro, nunca una mezcla, y sin perder
+# datos por los bloques que se mueven.
+#
+#     sh tests/crash.sh ./proyecto
+set -e
+BIN=$(cd "$(dirname "${1:-./proyecto}")" && pwd)/$(basename "${1:-./proyecto}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+head -c 100000000 /dev/urandom > old
+head -c 100000000 /dev/urandom > new
+# old con un bloque de cada dos en ceros: -u los guarda como huecos y libera
+# los bloques viejos, que la foto confirmada sigue usando hasta el final
+cp old zeros
+block=0
+while [ $block -lt 382 ]; do
+    dd if=/dev/zero of=zeros bs=262144 seek=$block count=1 conv=notrunc 2> /dev/null
+    block=$((block + 2))
+done
+
+# Despues de la caida: --verify limpio y el miembro entero de una version ($2
+# es la nueva)
+check() {
+    "$BIN" --verify a.pk > /dev/null 2> err || { echo "$1: verify failed"; head -5 err; exit 1; }
+    rm -rf out && mkdir out
+    (cd out && "$BIN" -x ../a.pk > /dev/null 2>&1)
+    if ! cmp -s out/f old && ! cmp -s out/f "$2"; then
+        echo "$1: member is neither the old nor the new version"
+        exit 1
+    fi
+}
+
+for version in new zeros; do
+    for delay in 0.01 0.03 0.05 0.08 0.1 0.2 0.4; do
+        cp old f
+        rm -f a.pk
+        "$BIN" -cf a.pk f > /dev/null 2>&1
+        cp $version f
+        "$BIN" -u a.pk f > /dev/null 2>&1 &
+        pid=$!
+        sleep $delay
+        kill -9 $pid 2> /dev/null || true
+        wait $pid 2> /dev/null || true
+        check "-u to $version killed after ${delay}s" $version
+    done
+done
+
+# Lectores durante -u a zeros: cada --verify carga la ultima foto confirmada
+# y tiene que encontrar sus bloques intactos hasta que la suelta
+cp old f
+rm -f a.pk
+"$BIN" -cf a.pk f > /dev/null 2>&1
+cp zeros f
+"$BIN" -u a.pk f > /dev/null 2>&1 &
+pid=$!
+while kill -0 $pid 2> /dev/null; do
+    if ! "$BIN" --verify a.pk > /dev/null 2> err; then
+        echo "--verify during -u to zeros failed"
+        head -5 err
+        kill -9 $pid 2> /dev/null || true
+        exit 1
+    fi
+done
+wait $pid
+check "-u to zeros with readers" zeros
+
+# Miembros intercalados: al borrar la mitad, g queda repartido en los huecos
+# y -p tiene que mover casi todo
+for i in 01 02 03 04 05 06 07 08 09 10 11 12 13 14 15 16; do
+    head -c 12000000 /dev/urandom > m$i
+done
+rm -f a.pk
+"$BIN" -cf a.pk m* > /dev/null 2>&1
+"$BIN" -d a.pk m01 m03 m05 m07 m09 m11 m13 m15 > /dev/null 2>&1
+rm m01 m03 m05 m07 m09 m11 m13 m15
+head -c 120000000 /dev/urandom > g
+"$BIN" -r a.pk g > /dev/null 2>&1
+cp a.pk fragmented.pk
+
+for delay in 0.005 0.01 0.02 0.03 0.05 0.08; do
+    cp fragmented.pk a.pk
+    "$BIN" -p x a.pk > /dev/null 2>&1 &
+    pid=$!
+    sleep $delay
+    kill -9 $pid 2> /dev/null || true
+    wait $pid 2> /dev/null || true
+    "$BIN" --verify a.pk > /dev/null 2> err || { echo "-p killed after ${delay}s: verify failed"; head -5 err; exit 1; }
+    rm -rf out && mkdir out
+    (cd out && "$BIN" -x ../a.pk > /dev/null 2>&1)
+    for member in g m*; do
+        cmp -s "$member" "out/$member" || { echo "-p killed after ${delay}s: $member changed"; exit 1; }
+    done
+done
+echo "crash OK"
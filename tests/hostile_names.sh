@@ -0,0 +1,37 @@
+#!/bin/sh
+# Miembros con nombres absolutos o con ".." no se extraen fuera del directorio
+# actual, ni del empaquetado normal ni del formato en flujo.
+#
+#     sh tests/hostile_names.sh ./proyecto
+set -e
+BIN=$(cd "$(dirname "${1:-./proyecto}")" && pwd)/$(basename "${1:-./proyecto}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir -p "$WORK/src/sub" "$WORK/abs"
+echo escape > "$WORK/src/outside"
+echo absolute > "$WORK/abs/target"
+echo fine > "$WORK/src/sub/ok"
+cd "$WORK/src/sub"
+"$BIN" -cf "$WORK/a.pk" ok ../outside "$WORK/abs/target" > /dev/null 2>&1
+"$BIN" -cf - ok ../outside "$WORK/abs/target" > "$WORK/s.pk" 2> /dev/null
+rm -rf "$WORK/src" "$WORK/abs"
+
+for archive in a.pk s.pk; do
+    mkdir -p "$WORK/x/$archive/out"
+    cd "$WORK/x/$archive/out"
+    if [ "$archive" = s.pk ]; then
+        "$BIN" -x - < "$WORK/$archive" > /dev/null 2> err || true
+    else
+        "$BIN" -x "$WORK/$archive" > /dev/null 2> err || true
+    fi
+    cmp -s ok - <<EOF || { echo "$archive: safe member not extracted"; exit 1; }
+fine
+EOF
+    if [ -e ../outside ] || [ -e "$WORK/abs/target" ]; then
+        echo "$archive: member written outside the extraction directory"
+        exit 1
+    fi
+    [ "$(grep -c 'unsafe name' err)" -eq 2 ] || { echo "$archive: unsafe names not reported"; exit 1; }
+done
+echo "hostile names OK"